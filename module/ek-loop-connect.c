@@ -10,80 +10,100 @@
 
 #include <linux/bitops.h>
 #include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/hid.h>
+#include <linux/hidraw.h>
+#include <linux/hrtimer.h>
 #include <linux/hwmon.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/idr.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/perf_event.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
 #include <linux/usb.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
 
+#include "ekloco-protocol.h"
+#include "uapi/ekloco.h"
 
-#define USB_VENDOR_ID_EK		0x0483
-#define USB_PRODUCT_ID_EK_LOOP_CONNECT	0x5750
+#define REQ_TIMEOUT		500
 
-#define BUFFER_SIZE		63
-#define CHANNEL_OFFSET		6
-#define CHANNEL_SIZE		2
+/*
+ * Wait for the reply to a /dev/eklocoN frame of a kind the driver doesn't send, like an RGB
+ * command, under the device mutex. Some of those are never answered.
+ */
+#define RAW_REPLY_TIMEOUT	50
 
-#define NUM_FANS		6
-#define NUM_TEMP_SENSORS	3
+// Replies queued for a reader of the multiplexer device, like hidraw's buffer.
+#define CHARDEV_REPLIES		16
 
-#define REQ_TIMEOUT		500
+// Records kept for debugfs capture readers, about 80 kB.
+#define CAPTURE_RECORDS		1024
 
-// Specific byte offsets from response buffers
-#define FAN_READ_RPM_OFFSET 12
-#define FAN_READ_PWM_OFFSET 21
-#define FAN_SET_PWM_OFFSET 24
-#define SENSOR_T1_OFFSET 11
-#define SENSOR_T2_OFFSET 15
-#define SENSOR_T3_OFFSET 19
-#define SENSOR_FLOW_OFFSET 22
-#define SENSOR_LEVEL_OFFSET 27
-
-
-static const u8 fan_read_request[] = {
-        0x10, 0x12, 0x08, 0xaa, 0x01, 0x03, 0xff, 0xff,         // 6B header, 2B channel
-        0x00, 0x20, 0x66, 0xff, 0xff, 0xed, 0x00, 0x00,         // 2B constant, 3B checksum? (bytes 10-12), 1B constant, 2B padding
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // padding
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-};
-
-static const u8 sensor_read_request[] = {
-        0x10, 0x12, 0x08, 0xaa, 0x01, 0x03, 0xa2, 0x20,		// 6B header, 2B channel
-        0x00, 0x20, 0x66, 0x60, 0xfe, 0xed, 0x00, 0x00,		// constant?
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// padding  49B
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-};
-
-static const u8 fan_set_request[] = {
-        0x10, 0x12, 0x29, 0xaa, 0x01, 0x10, 0xff, 0xff,         // 6B header, 2B channel
-        0x00, 0x10, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,         // 3B constant + 4B padding + high byte fan rpm (byte 15)
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // low byte fan RPM (byte 16) + 7B padding
-        0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // PWM percentage (byte 24), checksum? (byte 25), padding
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // padding
-        0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xed, 0x00,         // padding, checksum? (byte 45), constant (byte 46)
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // padding
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-};
-
-static const u8 fan_channels[][CHANNEL_SIZE] = {
-        {0xa0, 0xa0},
-        {0xa0, 0xc0},
-        {0xa0, 0xe0},
-        {0xa1, 0x00},
-        {0xa1, 0x20},
-        {0xa1, 0xe0},
-};
+// Limits for the background refresh interval in ms, 0 disables it.
+#define MIN_UPDATE_INTERVAL	100
+#define MAX_UPDATE_INTERVAL	60000
+
+/*
+ * Adaptive sampling: a group is read at the fastest interval while its readings move by at
+ * least these amounts between polls, or a temperature is within the margin of its max or crit.
+ * Otherwise its interval doubles up to update_interval.
+ */
+#define RATE_TEMP_DELTA		1	// degC
+#define RATE_FLOW_DELTA		20	// l/h
+#define RATE_RPM_DELTA		100
+#define RATE_TEMP_MARGIN	3000	// millidegrees
+
+/*
+ * Fan characterization: every duty step is held this long before reading the speed, the fans
+ * need a few seconds to settle. A sweep takes 11 to 21 steps.
+ */
+#define CURVE_POINTS		11
+#define CURVE_DUTY(i)		DIV_ROUND_CLOSEST((i) * 255, CURVE_POINTS - 1)
+#define CALIBRATE_SETTLE_MS	3000
+
+/*
+ * Step response: after a duty write the fan is read every STEP_POLL_MS until STEP_SAMPLES
+ * readings in a row stay within STEP_TOLERANCE rpm (or 2%, if more) of each other.
+ */
+#define STEP_POLL_MS		100
+#define STEP_SAMPLES		5
+#define STEP_TOLERANCE		30
+#define STEP_TIMEOUT_MS		15000
+
+/*
+ * Stall recovery: a fan reading under STALL_RPM, or under half the speed its curve gives for
+ * the duty, while the duty is above 0 is held at stall_boost for STALL_BOOST_MS, then returned
+ * to its duty and checked again the same way after STALL_CHECK_MS.
+ */
+#define STALL_RPM		100
+#define STALL_BOOST_MS		2000
+#define STALL_CHECK_MS		3000
+
+static bool calibrate;
+module_param(calibrate, bool, 0444);
+MODULE_PARM_DESC(calibrate, "Characterize all fans after probing, takes about a minute per fan");
+
+// Timing histograms have log2 buckets in us, the last one counts everything from about 0.5 s.
+#define JITTER_BUCKETS		20
 
 static const char fan_labels[][3] = {"F1", "F2", "F3", "F4", "F5", "F6"};
 static const char temp_labels[][3] = {"T1", "T2", "T3"};
@@ -91,15 +111,18 @@ static const char temp_labels[][3] = {"T1", "T2", "T3"};
 static const char level_label[] = "coolant level";
 static const char flow_label[] = "coolant flow (l/h)";
 
-struct ekloco_device {
-	struct hid_device *hdev;
-	struct device *hwmon_dev;
-	struct completion wait_input_report;
-	struct mutex mutex; // whenever buffer is used
-	u8 *buffer;
+// perf events, in order of config values
+enum ekloco_pmu_event {
+	EKLOCO_PMU_TEMP1,
+	EKLOCO_PMU_TEMP2,
+	EKLOCO_PMU_TEMP3,
+	EKLOCO_PMU_FLOW,
+	EKLOCO_PMU_LEVEL,
+	EKLOCO_PMU_FAN1,
+	EKLOCO_PMU_PWM1 = EKLOCO_PMU_FAN1 + NUM_FANS,
+	EKLOCO_PMU_NUM_EVENTS = EKLOCO_PMU_PWM1 + NUM_FANS,
 };
 
-
 struct sensor_result {
 	long temp[3];
 	long flow_lph;
@@ -111,395 +134,4178 @@ struct fan_read_result {
 	long pwm;
 };
 
-static int ekloco_raw_event(struct hid_device *hdev, struct hid_report *report, u8 *data, int size)
+// Channels as the poller schedules them, one request each.
+enum ekloco_poll_channel {
+	POLL_SENSORS,
+	POLL_FAN1,
+	NUM_POLL_CHANNELS = POLL_FAN1 + NUM_FANS,
+};
+
+/*
+ * Latest decoded readings of every channel, from whichever request read them last. Published
+ * under cache_seq so hwmon and IIO readers never wait for a transaction in flight.
+ */
+struct ekloco_cache {
+	struct sensor_result sensors;
+	struct fan_read_result fans[NUM_FANS];
+	bool valid[NUM_POLL_CHANNELS];
+	ktime_t time[NUM_POLL_CHANNELS];
+};
+
+struct ekloco_sample {
+	struct sensor_result sensors;
+	struct fan_read_result fans[NUM_FANS];
+	ktime_t timestamp;
+};
+
+// Channels the poller reads together, each group takes its own cadence.
+enum ekloco_rate_group {
+	RATE_SENSORS,
+	RATE_FANS,
+	NUM_RATE_GROUPS,
+};
+
+struct ekloco_rate {
+	unsigned long interval;	// ms
+	unsigned long next;	// jiffies
+};
+
+#define POLL_WEIGHT_DEFAULT	1
+#define POLL_WEIGHT_MAX		100
+
+// Speed of a fan at CURVE_DUTY(i), with the duties it starts and stops at.
+struct ekloco_fan_curve {
+	bool valid;
+	u8 spinup;	// lowest duty starting a stopped fan
+	u8 stall;	// lowest duty keeping it turning
+	u16 rpm[CURVE_POINTS];
+};
+
+struct ekloco_step {
+	bool active;
+	ktime_t start;
+	long start_rpm;
+	long min_rpm;
+	long max_rpm;
+	unsigned int samples;
+	long rpm[STEP_SAMPLES];
+	ktime_t time[STEP_SAMPLES];
+};
+
+struct ekloco_step_stats {
+	u64 count;	// settled responses
+	u64 timeouts;
+	u64 settle_sum;	// ms
+	unsigned int settle_max;
+	unsigned int settle_last;
+	long overshoot_last;
+	long rpm_last;
+};
+
+enum ekloco_stall_state {
+	STALL_NONE,
+	STALL_DETECTED,
+	STALL_BOOSTING,
+	STALL_CHECKING,
+	STALL_FAILED,	// until the next duty write
+};
+
+struct ekloco_stall {
+	enum ekloco_stall_state state;
+	long duty;	// to return to after the boost
+	long boost;	// stall_boost when detected, never below duty
+	unsigned long until;	// jiffies
+	u64 stalls;
+	u64 recovered;
+	u64 failed;
+};
+
+struct ekloco_histogram {
+	u64 count;
+	u64 min;	// us
+	u64 max;
+	u64 sum;
+	u64 sum_sq;	// of the offsets from the first value, so periods don't overflow it
+	u64 first;
+	u64 buckets[JITTER_BUCKETS];
+};
+
+enum ekloco_history_field {
+	HISTORY_LOWEST,
+	HISTORY_HIGHEST,
+	HISTORY_AVERAGE,
+};
+
+// Extremes and running average of a channel since the last reset.
+struct ekloco_history {
+	long lowest;
+	long highest;
+	s64 sum;
+	u64 count;
+};
+
+#define FILTER_SCALE		1000
+#define FILTER_EMA_DEFAULT	250	// alpha in 1/FILTER_SCALE
+#define FILTER_MEDIAN_DEFAULT	5
+#define FILTER_MEDIAN_MAX	9
+
+enum ekloco_filter_type {
+	FILTER_NONE,
+	FILTER_EMA,
+	FILTER_MEDIAN,
+};
+
+static const char * const filter_names[] = {
+	[FILTER_NONE] = "none",
+	[FILTER_EMA] = "ema",
+	[FILTER_MEDIAN] = "median",
+};
+
+/*
+ * Smoothing filter for a single channel. The output is kept in 1/FILTER_SCALE units of the raw
+ * value, so temperatures come out as millidegrees without losing precision.
+ */
+struct ekloco_filter {
+	enum ekloco_filter_type type;
+	unsigned int param;	// alpha for EMA, window size for median
+	unsigned int count;
+	unsigned int pos;
+	long window[FILTER_MEDIAN_MAX];
+	long output;
+};
+
+struct ekloco_device;
+
+/*
+ * Moves one request/response pair. xfer sends the request in the device buffer and returns with
+ * the response in its place and its length in reply_len. xfer_burst sends count requests from
+ * frames back-to-back and returns with each response in place of its request and its length in
+ * lens. frames is sent as is, so it must be kmalloc'ed like the buffer. Called with the mutex
+ * held.
+ */
+struct ekloco_transport_ops {
+	int (*xfer)(struct ekloco_device *ekloco);
+	int (*xfer_burst)(struct ekloco_device *ekloco, u8 *frames, int *lens, int count);
+};
+
+#if IS_ENABLED(CONFIG_PERF_EVENTS)
+
+/*
+ * perf_pmu_unregister() leaves open events in place, and they keep calling into their PMU. So
+ * the PMU and everything its events read live apart from the device, until the last event is
+ * closed.
+ */
+struct ekloco_pmu {
+	struct pmu pmu;
+	struct kref ref;
+	int id;
+	char name[16];
+
+	/*
+	 * Latest full sample, along with the time integral of every event value up to
+	 * integral_time. The lock is taken from perf callbacks, which may run in hardirq context.
+	 */
+	spinlock_t lock;
+	struct ekloco_sample sample;
+	bool sample_valid; // cleared when the device goes away, the counters stop there
+	u64 integral[EKLOCO_PMU_NUM_EVENTS];
+	ktime_t integral_time;
+};
+
+#endif
+
+struct ekloco_chardev;
+struct ekloco_client;
+
+struct ekloco_device {
+	struct hid_device *hdev;
+	const struct ekloco_transport_ops *transport;
+	struct ekloco_chardev *chardev;
+	struct device *hwmon_dev;
+	struct iio_dev *iio_dev;
+	struct iio_trigger *iio_trig; // fired by the poller for every sample it publishes
+	struct completion wait_input_report;
+	struct mutex mutex; // whenever buffer is used
+	u8 *buffer;
+	int reply_len;
+
+	/*
+	 * Transfer in flight, xfer_pending responses are still expected. Taken from raw_event, and
+	 * held while a response is stored, so a burst that timed out can free its frames.
+	 */
+	spinlock_t xfer_lock;
+	u8 *xfer_frames;
+	int *xfer_lens;
+	int xfer_count;
+	int xfer_pending;
+
+	/*
+	 * /dev/eklocoN client that last wrote a frame of a kind the driver doesn't send, until
+	 * reply_until. Reports no transfer takes are queued for it. Protected by xfer_lock.
+	 */
+	struct ekloco_client *reply_client;
+	unsigned long reply_until; // jiffies
+	seqcount_mutex_t cache_seq; // written with mutex held, read locklessly
+	struct ekloco_cache cache;
+	struct mutex poll_mutex; // stopping and starting the poller, sysfs stores race otherwise
+	struct delayed_work refresh_work;
+	struct delayed_work refresh_work_deferrable; // power saving mode
+	unsigned long update_interval;
+	unsigned long update_interval_min; // 0 for a fixed rate
+	unsigned long update_slack; // ms, 0 for precise timing
+	unsigned long poll_slack; // jiffies, update_slack as refresh_work_deferrable was queued with
+	unsigned long max_age; // ms, 0 to only use the cache while polling
+	unsigned long poll_wakeups;
+
+	// Low-jitter mode, the hrtimer only queues poll_timer_work.
+	bool update_hrtimer;
+	struct hrtimer poll_timer;
+	ktime_t poll_period; // update_interval as poll_timer was started with
+	struct work_struct poll_timer_work;
+
+	/*
+	 * Poller and transfer timing, for debugfs. poll_due is when the poller was supposed to
+	 * run, it's set from the hrtimer callback, so jitter_lock is irq safe.
+	 */
+	spinlock_t jitter_lock;
+	ktime_t poll_due;
+	ktime_t poll_last;
+	u64 poll_overruns;
+	struct ekloco_histogram poll_spacing;
+	struct ekloco_histogram poll_latency;
+	struct ekloco_histogram xfer_time;
+
+	// Owned by refresh_work, rate intervals are also read from sysfs.
+	struct ekloco_rate rate[NUM_RATE_GROUPS];
+	unsigned int update_budget; // requests per poll, 0 for no limit
+	unsigned int poll_weight[NUM_POLL_CHANNELS];
+	int poll_current[NUM_POLL_CHANNELS];
+	struct ekloco_sample poll_sample;
+	bool poll_valid;
+
+	// Limits in millidegrees, 0 when unset. The controller has none, they only drive sampling.
+	long temp_max[NUM_TEMP_SENSORS];
+	long temp_crit[NUM_TEMP_SENSORS];
+
+	spinlock_t sample_lock;
+
+	// Last sample the poller published, protected by sample_lock.
+	struct ekloco_sample last_sample;
+	bool last_sample_valid;
+
+	// Updated on every reading, protected by sample_lock. Flow is tracked as the extra fan.
+	struct ekloco_history temp_history[NUM_TEMP_SENSORS];
+	struct ekloco_history fan_history[NUM_FANS + 1];
+	struct ekloco_filter temp_filter[NUM_TEMP_SENSORS];
+	struct ekloco_filter fan_filter[NUM_FANS + 1];
+
+	// Protected by sample_lock, written by calibrate_work or restored from sysfs.
+	struct ekloco_fan_curve fan_curve[NUM_FANS];
+	long fan_target[NUM_FANS];
+
+	// Step response tracking, protected by sample_lock. step_work does the reading.
+	struct delayed_work step_work;
+	struct ekloco_step step[NUM_FANS];
+	struct ekloco_step_stats step_stats[NUM_FANS];
+
+	// Stall recovery, protected by sample_lock. stall_work sends the boosts.
+	struct delayed_work stall_work;
+	struct ekloco_stall stall[NUM_FANS];
+	unsigned long stall_boost; // duty, 0 when disabled
+
+	// Fans queued for and under characterization, one at a time.
+	struct work_struct calibrate_work;
+	wait_queue_head_t calibrate_wait;
+	unsigned long calibrate_pending;
+	unsigned long calibrating; // changed with mutex held, so duty writes can check it
+	bool calibrate_stop;
+
+	/*
+	 * Traffic capture for debugfs. The fifo is allocated on first use and filled from
+	 * raw_event, so capture_lock has to be irq safe. capture_mutex serializes readers and
+	 * enabling.
+	 */
+	struct dentry *debugfs;
+	struct mutex capture_mutex;
+	spinlock_t capture_lock;
+	wait_queue_head_t capture_wait;
+	DECLARE_KFIFO_PTR(capture_fifo, struct ekloco_capture_record);
+	bool capture_enabled;
+	bool capture_closing;
+	u64 capture_dropped;
+
+#if IS_ENABLED(CONFIG_PERF_EVENTS)
+	struct ekloco_pmu *pmu;
+#endif
+};
+
+static const struct genl_multicast_group ekloco_genl_mcgrps[] = {
+	{ .name = EKLOCO_GENL_MCGRP_SAMPLES },
+};
+
+// The family has no commands, it only exists to multicast samples.
+static struct genl_family ekloco_genl_family = {
+	.name = EKLOCO_GENL_NAME,
+	.version = EKLOCO_GENL_VERSION,
+	.maxattr = EKLOCO_ATTR_MAX,
+	.module = THIS_MODULE,
+	.mcgrps = ekloco_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(ekloco_genl_mcgrps),
+};
+
+static struct dentry *ekloco_debugfs_root;
+
+static void ekloco_capture(struct ekloco_device *ekloco, u8 type, u8 flags, const u8 *data,
+			   int size)
 {
-	struct ekloco_device *ekloco = hid_get_drvdata(hdev);
+	struct ekloco_capture_record record;
+	unsigned long irqflags;
 
-	// only copy buffer when requested
-	if (completion_done(&ekloco->wait_input_report))
-		return 0;
+	if (!READ_ONCE(ekloco->capture_enabled))
+		return;
 
-	memcpy(ekloco->buffer, data, min(size, BUFFER_SIZE));
-	complete(&ekloco->wait_input_report);
+	memset(&record, 0, sizeof(record));
+	record.timestamp_ns = ktime_get_ns();
+	record.type = type;
+	record.flags = flags;
+	record.len = min_t(int, size, sizeof(record.data));
+	if (data)
+		memcpy(record.data, data, record.len);
 
-	return 0;
+	// Recheck under the lock, the fifo may be going away.
+	spin_lock_irqsave(&ekloco->capture_lock, irqflags);
+	if (ekloco->capture_enabled && !kfifo_put(&ekloco->capture_fifo, record))
+		ekloco->capture_dropped++;
+	spin_unlock_irqrestore(&ekloco->capture_lock, irqflags);
 
+	wake_up_interruptible(&ekloco->capture_wait);
 }
 
-static int read_fan_speed(struct ekloco_device *ekloco, int channel, struct fan_read_result *result)
+static ssize_t capture_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-	int ret = 0;
-	unsigned long t;
-	int pwm, rpm;
+	struct ekloco_device *ekloco = file->private_data;
+	unsigned int copied;
+	int ret;
 
-	mutex_lock(&ekloco->mutex);
+	if (count < sizeof(struct ekloco_capture_record))
+		return -EINVAL;
 
-	reinit_completion(&ekloco->wait_input_report);
-	memcpy(ekloco->buffer, fan_read_request, BUFFER_SIZE);
-	memcpy(ekloco->buffer + CHANNEL_OFFSET, fan_channels[channel], CHANNEL_SIZE);
+	ret = mutex_lock_interruptible(&ekloco->capture_mutex);
+	if (ret)
+		return ret;
 
-	hid_hw_output_report(ekloco->hdev, ekloco->buffer, BUFFER_SIZE);
+	while (!kfifo_initialized(&ekloco->capture_fifo) || kfifo_is_empty(&ekloco->capture_fifo)) {
+		mutex_unlock(&ekloco->capture_mutex);
 
-	t = wait_for_completion_timeout(&ekloco->wait_input_report, msecs_to_jiffies(REQ_TIMEOUT));
-	if (!t) {
-		ret = -ETIMEDOUT;
-		goto out_unlock;
+		if (READ_ONCE(ekloco->capture_closing))
+			return -ENODEV;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(ekloco->capture_wait,
+					       READ_ONCE(ekloco->capture_closing) ||
+					       (kfifo_initialized(&ekloco->capture_fifo) &&
+						!kfifo_is_empty(&ekloco->capture_fifo)));
+		if (ret)
+			return ret;
+
+		ret = mutex_lock_interruptible(&ekloco->capture_mutex);
+		if (ret)
+			return ret;
 	}
 
-	// PWM is reported as one byte with value 0-100. Convert to more traditional 0-255
-	pwm = ekloco->buffer[FAN_READ_PWM_OFFSET];
-	result->pwm = mult_frac(pwm, 255, 100);
+	// Single reader under the mutex, no need to lock against the writers.
+	ret = kfifo_to_user(&ekloco->capture_fifo, buf, count, &copied);
+	mutex_unlock(&ekloco->capture_mutex);
 
-	// RPM value is stored as 2 bytes.
-	rpm = ekloco->buffer[FAN_READ_RPM_OFFSET];
-	rpm = (rpm<<8) + ekloco->buffer[FAN_READ_RPM_OFFSET+1];
-	result->rpm = rpm;
+	return ret ? ret : copied;
+}
+
+static const struct file_operations capture_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = capture_read,
+};
+
+static int capture_enable_get(void *data, u64 *val)
+{
+	struct ekloco_device *ekloco = data;
+
+	*val = READ_ONCE(ekloco->capture_enabled);
+	return 0;
+}
+
+static int capture_enable_set(void *data, u64 val)
+{
+	struct ekloco_device *ekloco = data;
+	unsigned long flags;
+	int ret = 0;
+
+	mutex_lock(&ekloco->capture_mutex);
+
+	if (val && !kfifo_initialized(&ekloco->capture_fifo)) {
+		ret = kfifo_alloc(&ekloco->capture_fifo, CAPTURE_RECORDS, GFP_KERNEL);
+		if (ret)
+			goto out_unlock;
+	}
+
+	// Every capture starts with an empty buffer.
+	if (val && !ekloco->capture_enabled) {
+		spin_lock_irqsave(&ekloco->capture_lock, flags);
+		kfifo_reset(&ekloco->capture_fifo);
+		ekloco->capture_dropped = 0;
+		spin_unlock_irqrestore(&ekloco->capture_lock, flags);
+	}
+
+	WRITE_ONCE(ekloco->capture_enabled, !!val);
 
 out_unlock:
-	mutex_unlock(&ekloco->mutex);
+	mutex_unlock(&ekloco->capture_mutex);
 	return ret;
 }
 
-static int set_fan_pwm(struct ekloco_device *ekloco, int channel, long target)
+DEFINE_DEBUGFS_ATTRIBUTE(capture_enable_fops, capture_enable_get, capture_enable_set, "%llu\n");
+
+static void ekloco_histogram_add(struct ekloco_histogram *hist, u64 us)
 {
-	int ret = 0;
-	unsigned long t;
+	s64 offset;
 
-	if (target > 255 || target < 0)
-		return -EINVAL;
+	if (!hist->count)
+		hist->first = us;
+	offset = us - hist->first;
 
-	mutex_lock(&ekloco->mutex);
+	if (!hist->count || us < hist->min)
+		hist->min = us;
+	if (!hist->count || us > hist->max)
+		hist->max = us;
+	hist->count++;
+	hist->sum += us;
+	hist->sum_sq += offset * offset;
+	hist->buckets[min(fls64(us), JITTER_BUCKETS - 1)]++;
+}
 
-	reinit_completion(&ekloco->wait_input_report);
-	memcpy(ekloco->buffer, fan_set_request, BUFFER_SIZE);
-	memcpy(ekloco->buffer + CHANNEL_OFFSET, fan_channels[channel], CHANNEL_SIZE);
-	ekloco->buffer[FAN_SET_PWM_OFFSET] = DIV_ROUND_CLOSEST(target * 100, 255);
+static void ekloco_histogram_show(struct seq_file *seq, const char *name,
+				  const struct ekloco_histogram *hist)
+{
+	u64 mean = 0, var = 0;
+	s64 offset;
+	int i;
 
-	hid_hw_output_report(ekloco->hdev, ekloco->buffer, BUFFER_SIZE);
+	if (hist->count) {
+		mean = div64_u64(hist->sum, hist->count);
+		offset = mean - hist->first;
+		var = div64_u64(hist->sum_sq, hist->count);
+		var = var > offset * offset ? var - offset * offset : 0;
+	}
 
-	t = wait_for_completion_timeout(&ekloco->wait_input_report, msecs_to_jiffies(REQ_TIMEOUT));
-	if (!t) {
-		ret = -ETIMEDOUT;
-		goto out_unlock;
+	seq_printf(seq, "%s: count %llu min %llu max %llu mean %llu stddev %llu us\n", name,
+		   hist->count, hist->min, hist->max, mean, int_sqrt64(var));
+
+	// Bucket i counts values below 2^i us, down to the previous bucket.
+	for (i = 0; i < JITTER_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		if (i == JITTER_BUCKETS - 1)
+			seq_printf(seq, "  >=%-8llu %llu\n", 1ULL << (i - 1), hist->buckets[i]);
+		else
+			seq_printf(seq, "  <%-9llu %llu\n", 1ULL << i, hist->buckets[i]);
 	}
+}
 
-out_unlock:
-	mutex_unlock(&ekloco->mutex);
-	return ret;
+static int jitter_show(struct seq_file *seq, void *data)
+{
+	struct ekloco_device *ekloco = seq->private;
+	struct ekloco_histogram *hist;
+	unsigned long flags;
+	u64 overruns;
+
+	// Copied out, printing under an irq safe lock would be too long.
+	hist = kmalloc_array(3, sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&ekloco->jitter_lock, flags);
+	hist[0] = ekloco->poll_spacing;
+	hist[1] = ekloco->poll_latency;
+	hist[2] = ekloco->xfer_time;
+	overruns = ekloco->poll_overruns;
+	spin_unlock_irqrestore(&ekloco->jitter_lock, flags);
+
+	ekloco_histogram_show(seq, "poll spacing", &hist[0]);
+	ekloco_histogram_show(seq, "poll latency", &hist[1]);
+	ekloco_histogram_show(seq, "transfer time", &hist[2]);
+	seq_printf(seq, "hrtimer overruns: %llu\n", overruns);
+
+	kfree(hist);
+	return 0;
 }
 
-static int read_sensors(struct ekloco_device *ekloco, struct sensor_result *result)
+DEFINE_SHOW_ATTRIBUTE(jitter);
+
+static int jitter_reset_set(void *data, u64 val)
 {
-	int ret = 0;
-	unsigned long t;
-	int flow;
+	struct ekloco_device *ekloco = data;
+	unsigned long flags;
 
-	mutex_lock(&ekloco->mutex);
+	if (val != 1)
+		return -EINVAL;
 
-	reinit_completion(&ekloco->wait_input_report);
-	memcpy(ekloco->buffer, sensor_read_request, BUFFER_SIZE);
+	spin_lock_irqsave(&ekloco->jitter_lock, flags);
+	memset(&ekloco->poll_spacing, 0, sizeof(ekloco->poll_spacing));
+	memset(&ekloco->poll_latency, 0, sizeof(ekloco->poll_latency));
+	memset(&ekloco->xfer_time, 0, sizeof(ekloco->xfer_time));
+	ekloco->poll_overruns = 0;
+	ekloco->poll_last = 0;
+	spin_unlock_irqrestore(&ekloco->jitter_lock, flags);
 
-	hid_hw_output_report(ekloco->hdev, ekloco->buffer, BUFFER_SIZE);
+	return 0;
+}
 
-	t = wait_for_completion_timeout(&ekloco->wait_input_report, msecs_to_jiffies(REQ_TIMEOUT));
-	if (!t) {
-		ret = -ETIMEDOUT;
-		goto out_unlock;
+DEFINE_DEBUGFS_ATTRIBUTE(jitter_reset_fops, NULL, jitter_reset_set, "%llu\n");
+
+static void ekloco_debugfs_init(struct ekloco_device *ekloco)
+{
+	ekloco->debugfs = debugfs_create_dir(dev_name(&ekloco->hdev->dev), ekloco_debugfs_root);
+
+	debugfs_create_file("capture", 0400, ekloco->debugfs, ekloco, &capture_fops);
+	debugfs_create_file_unsafe("capture_enable", 0600, ekloco->debugfs, ekloco,
+				   &capture_enable_fops);
+	debugfs_create_u64("capture_dropped", 0400, ekloco->debugfs, &ekloco->capture_dropped);
+	debugfs_create_file("jitter", 0400, ekloco->debugfs, ekloco, &jitter_fops);
+	debugfs_create_file_unsafe("jitter_reset", 0200, ekloco->debugfs, ekloco,
+				   &jitter_reset_fops);
+}
+
+static void ekloco_debugfs_exit(struct ekloco_device *ekloco)
+{
+	unsigned long flags;
+
+	// Blocked readers would keep debugfs removal waiting forever.
+	WRITE_ONCE(ekloco->capture_closing, true);
+	wake_up_interruptible(&ekloco->capture_wait);
+	debugfs_remove_recursive(ekloco->debugfs);
+
+	spin_lock_irqsave(&ekloco->capture_lock, flags);
+	ekloco->capture_enabled = false;
+	spin_unlock_irqrestore(&ekloco->capture_lock, flags);
+	kfifo_free(&ekloco->capture_fifo);
+}
+
+/*
+ * Header of the response to request, NULL for a kind the driver doesn't send. The controller
+ * answers some of those too, RGB commands for one, but their responses aren't documented.
+ */
+static const u8 *ekloco_response_header(const u8 *request, size_t *len)
+{
+	switch (request[REQ_KIND_OFFSET]) {
+	case REQ_KIND_READ:
+		*len = sizeof(read_response_header);
+		return read_response_header;
+	case REQ_KIND_SET:
+		*len = sizeof(set_response_header);
+		return set_response_header;
+	default:
+		return NULL;
 	}
+}
 
-	// Temperatures are reported as single-byte values in degC
-	result->temp[0] = ekloco->buffer[SENSOR_T1_OFFSET];
-	result->temp[1] = ekloco->buffer[SENSOR_T2_OFFSET];
-	result->temp[2] = ekloco->buffer[SENSOR_T3_OFFSET];
+static void ekloco_chardev_queue(struct ekloco_client *client, const u8 *data, int size);
 
-	result->level = !!ekloco->buffer[SENSOR_LEVEL_OFFSET];
+static int ekloco_raw_event(struct hid_device *hdev, struct hid_report *report, u8 *data, int size)
+{
+	struct ekloco_device *ekloco = hid_get_drvdata(hdev);
+	const u8 *header;
+	unsigned long flags;
+	bool consumed = false;
+	bool done = false;
+	u8 *frame = NULL;
+	size_t len;
+	int i = 0;
 
-	// Flow measurement has a conversion factor of 0.8 l/h
-	flow = ekloco->buffer[SENSOR_FLOW_OFFSET];
-	flow = (flow<<8) + ekloco->buffer[SENSOR_FLOW_OFFSET+1];
-	result->flow_lph = mult_frac(flow, 8, 10);
+	/*
+	 * Responses come in request order, each one goes in place of its request. It is only taken
+	 * if its header matches the kind of the request, anything else is a late reply to a
+	 * userspace frame and goes to its writer.
+	 */
+	spin_lock_irqsave(&ekloco->xfer_lock, flags);
+	if (ekloco->xfer_pending) {
+		i = ekloco->xfer_count - ekloco->xfer_pending;
+		frame = ekloco->xfer_frames + i * BUFFER_SIZE;
+		header = ekloco_response_header(frame, &len);
+		consumed = !header || (size >= len && !memcmp(data, header, len));
+	}
+	if (consumed) {
+		memcpy(frame, data, min(size, BUFFER_SIZE));
+		ekloco->xfer_lens[i] = size;
+		done = !--ekloco->xfer_pending;
+	} else if (ekloco->reply_client && time_before(jiffies, ekloco->reply_until)) {
+		ekloco_chardev_queue(ekloco->reply_client, data, size);
+	}
+	spin_unlock_irqrestore(&ekloco->xfer_lock, flags);
 
-out_unlock:
-	mutex_unlock(&ekloco->mutex);
-	return ret;
+	ekloco_capture(ekloco, EKLOCO_CAPTURE_IN, consumed ? EKLOCO_CAPTURE_F_CONSUMED : 0, data,
+		       size);
+	if (done)
+		complete(&ekloco->wait_input_report);
+
+	return 0;
 }
 
-static int ekloco_read_string(struct device *ekloco, enum hwmon_sensor_types type,
-			      u32 attr, int channel, const char **str)
+static void ekloco_history_add(struct ekloco_history *history, long val)
 {
-	switch (type) {
-	case hwmon_temp:
-		if (channel < 0 || channel >= NUM_TEMP_SENSORS)
-			break;
-		switch (attr) {
-		case hwmon_temp_label:
-			*str = temp_labels[channel];
-			return 0;
-		default:
-			break;
-		}
-		break;
-	case hwmon_fan:
-		// Coolant flow meter is exposed as an extra fan.
-		if (channel < 0 || channel >= (NUM_FANS + 1))
-			break;
-		switch (attr) {
-		case hwmon_fan_label:
-			if (channel == NUM_FANS)
-				*str = flow_label;
-			else
-				*str = fan_labels[channel];
-			return 0;
-		default:
-			break;
-		}
+	if (!history->count || val < history->lowest)
+		history->lowest = val;
+	if (!history->count || val > history->highest)
+		history->highest = val;
+	history->sum += val;
+	history->count++;
+}
+
+static int ekloco_history_get(struct ekloco_device *ekloco, struct ekloco_history *history,
+			      enum ekloco_history_field field, long *val)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	if (!history->count) {
+		ret = -ENODATA;
+		goto out_unlock;
+	}
+
+	switch (field) {
+	case HISTORY_LOWEST:
+		*val = history->lowest;
 		break;
-	case hwmon_humidity:
-		if (channel != 0)
-			break;
-		switch (attr) {
-		case hwmon_humidity_label:
-			*str = level_label;
-			return 0;
-		default:
-			break;
-		}
+	case HISTORY_HIGHEST:
+		*val = history->highest;
 		break;
-	default:
+	case HISTORY_AVERAGE:
+		*val = div64_s64(history->sum, history->count);
 		break;
 	}
 
-	return -EOPNOTSUPP;
+out_unlock:
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+	return ret;
+}
+
+static void ekloco_history_reset(struct ekloco_device *ekloco, struct ekloco_history *history,
+				 int count)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	memset(history, 0, count * sizeof(*history));
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void ekloco_filter_add(struct ekloco_filter *filter, long val)
+{
+	long sorted[FILTER_MEDIAN_MAX];
+	unsigned int n;
+
+	val *= FILTER_SCALE;
+
+	switch (filter->type) {
+	case FILTER_NONE:
+		filter->output = val;
+		break;
+	case FILTER_EMA:
+		if (!filter->count)
+			filter->output = val;
+		else
+			filter->output += div_s64((s64)(val - filter->output) * filter->param,
+						  FILTER_SCALE);
+		break;
+	case FILTER_MEDIAN:
+		filter->window[filter->pos] = val;
+		filter->pos = (filter->pos + 1) % filter->param;
+		n = min(filter->count + 1, filter->param);
+		memcpy(sorted, filter->window, n * sizeof(*sorted));
+		sort(sorted, n, sizeof(*sorted), cmp_long, NULL);
+		filter->output = sorted[n / 2];
+		break;
+	}
+
+	filter->count++;
+}
+
+// Speed the curve gives for a duty.
+static long ekloco_curve_rpm(const struct ekloco_fan_curve *curve, long duty)
+{
+	int i = duty * (CURVE_POINTS - 1) / 255;
+	long lo, hi;
+
+	if (i >= CURVE_POINTS - 1)
+		return curve->rpm[CURVE_POINTS - 1];
+
+	lo = CURVE_DUTY(i);
+	hi = CURVE_DUTY(i + 1);
+	return curve->rpm[i] + (duty - lo) * (curve->rpm[i + 1] - curve->rpm[i]) / (hi - lo);
+}
+
+// Must be called with sample_lock held. Judges both detection and recovery.
+static bool ekloco_fan_stalled(const struct ekloco_fan_curve *curve, long pwm, long rpm)
+{
+	if (rpm < STALL_RPM)
+		return true;
+
+	return curve->valid && pwm >= curve->stall && rpm < ekloco_curve_rpm(curve, pwm) / 2;
+}
+
+/*
+ * Must be called with sample_lock held. Fans that were just written to, are being
+ * characterized or already being recovered are expected to read low.
+ */
+static void ekloco_stall_check(struct ekloco_device *ekloco, int channel,
+			       const struct fan_read_result *result)
+{
+	const struct ekloco_fan_curve *curve = &ekloco->fan_curve[channel];
+	struct ekloco_stall *stall = &ekloco->stall[channel];
+	long boost = READ_ONCE(ekloco->stall_boost);
+
+	if (!boost || stall->state != STALL_NONE || !result->pwm)
+		return;
+	if (ekloco->step[channel].active || test_bit(channel, &ekloco->calibrating))
+		return;
+
+	if (!ekloco_fan_stalled(curve, result->pwm, result->rpm))
+		return;
+
+	stall->state = STALL_DETECTED;
+	stall->duty = result->pwm;
+	// A boost below the duty would only slow the fan down further.
+	stall->boost = max(boost, result->pwm);
+	stall->stalls++;
+	mod_delayed_work(system_wq, &ekloco->stall_work, 0);
+}
+
+static void ekloco_record_fan(struct ekloco_device *ekloco, int channel,
+			      const struct fan_read_result *result)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	ekloco_history_add(&ekloco->fan_history[channel], result->rpm);
+	ekloco_filter_add(&ekloco->fan_filter[channel], result->rpm);
+	ekloco_stall_check(ekloco, channel, result);
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+}
+
+static void ekloco_record_sensors(struct ekloco_device *ekloco, const struct sensor_result *result)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		// Unused ports would only pollute the history.
+		if (result->temp[i] == SENSOR_TEMP_UNUSED)
+			continue;
+		ekloco_history_add(&ekloco->temp_history[i], result->temp[i]);
+		ekloco_filter_add(&ekloco->temp_filter[i], result->temp[i]);
+	}
+	ekloco_history_add(&ekloco->fan_history[NUM_FANS], result->flow_lph);
+	ekloco_filter_add(&ekloco->fan_filter[NUM_FANS], result->flow_lph);
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+}
+
+static void ekloco_xfer_time_add(struct ekloco_device *ekloco, ktime_t start)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->jitter_lock, flags);
+	ekloco_histogram_add(&ekloco->xfer_time, ktime_us_delta(ktime_get(), start));
+	spin_unlock_irqrestore(&ekloco->jitter_lock, flags);
+}
+
+/*
+ * The controller answers pipelined requests in order, so a burst costs about one round-trip.
+ * The whole burst gets the timeout of a single request, and goes into xfer_time as one transfer.
+ */
+static int ekloco_hid_xfer_burst(struct ekloco_device *ekloco, u8 *frames, int *lens, int count)
+{
+	unsigned long timeout = REQ_TIMEOUT;
+	unsigned long flags;
+	unsigned long t;
+	ktime_t start;
+	size_t len;
+	int i;
+
+	// Only /dev/eklocoN sends those, one at a time.
+	if (!ekloco_response_header(frames, &len))
+		timeout = RAW_REPLY_TIMEOUT;
+
+	reinit_completion(&ekloco->wait_input_report);
+	spin_lock_irqsave(&ekloco->xfer_lock, flags);
+	ekloco->xfer_frames = frames;
+	ekloco->xfer_lens = lens;
+	ekloco->xfer_count = count;
+	ekloco->xfer_pending = count;
+	spin_unlock_irqrestore(&ekloco->xfer_lock, flags);
+
+	start = ktime_get();
+	for (i = 0; i < count; i++) {
+		ekloco_capture(ekloco, EKLOCO_CAPTURE_OUT, 0, frames + i * BUFFER_SIZE, BUFFER_SIZE);
+		hid_hw_output_report(ekloco->hdev, frames + i * BUFFER_SIZE, BUFFER_SIZE);
+	}
+
+	t = wait_for_completion_timeout(&ekloco->wait_input_report, msecs_to_jiffies(timeout));
+	if (!t) {
+		spin_lock_irqsave(&ekloco->xfer_lock, flags);
+		ekloco->xfer_pending = 0;
+		spin_unlock_irqrestore(&ekloco->xfer_lock, flags);
+		ekloco_capture(ekloco, EKLOCO_CAPTURE_TIMEOUT, 0, NULL, 0);
+		return -ETIMEDOUT;
+	}
+
+	ekloco_xfer_time_add(ekloco, start);
+	return 0;
+}
+
+static int ekloco_hid_xfer(struct ekloco_device *ekloco)
+{
+	return ekloco_hid_xfer_burst(ekloco, ekloco->buffer, &ekloco->reply_len, 1);
+}
+
+static const struct ekloco_transport_ops ekloco_hid_transport = {
+	.xfer = ekloco_hid_xfer,
+	.xfer_burst = ekloco_hid_xfer_burst,
+};
+
+/*
+ * Protocol encoding and decoding, working on plain frames so they don't depend on the
+ * transport.
+ */
+static void ekloco_encode_fan_read(u8 *buf, int channel)
+{
+	memcpy(buf, fan_read_request, BUFFER_SIZE);
+	memcpy(buf + CHANNEL_OFFSET, fan_channels[channel], CHANNEL_SIZE);
+}
+
+static void ekloco_decode_fan_read(const u8 *buf, struct fan_read_result *result)
+{
+	// PWM is reported as one byte with value 0-100. Convert to more traditional 0-255
+	result->pwm = mult_frac(buf[FAN_READ_PWM_OFFSET], 255, 100);
+
+	// RPM value is stored as 2 bytes.
+	result->rpm = (buf[FAN_READ_RPM_OFFSET] << 8) + buf[FAN_READ_RPM_OFFSET + 1];
+}
+
+static void ekloco_encode_fan_set(u8 *buf, int channel, long target)
+{
+	memcpy(buf, fan_set_request, BUFFER_SIZE);
+	memcpy(buf + CHANNEL_OFFSET, fan_channels[channel], CHANNEL_SIZE);
+	buf[FAN_SET_PWM_OFFSET] = DIV_ROUND_CLOSEST(target * 100, 255);
+}
+
+static void ekloco_encode_sensor_read(u8 *buf)
+{
+	memcpy(buf, sensor_read_request, BUFFER_SIZE);
+}
+
+static void ekloco_decode_sensors(const u8 *buf, struct sensor_result *result)
+{
+	int flow;
+
+	// Temperatures are reported as single-byte values in degC
+	result->temp[0] = buf[SENSOR_T1_OFFSET];
+	result->temp[1] = buf[SENSOR_T2_OFFSET];
+	result->temp[2] = buf[SENSOR_T3_OFFSET];
+
+	result->level = !!buf[SENSOR_LEVEL_OFFSET];
+
+	// Flow measurement has a conversion factor of 0.8 l/h
+	flow = (buf[SENSOR_FLOW_OFFSET] << 8) + buf[SENSOR_FLOW_OFFSET + 1];
+	result->flow_lph = mult_frac(flow, 8, 10);
+}
+
+/*
+ * Responses carry no channel, so a set can only be told apart from other traffic by its
+ * header, and from a truncated one by its length.
+ */
+static bool ekloco_check_fan_set(const u8 *buf, int len)
+{
+	return len >= BUFFER_SIZE && !memcmp(buf, set_response_header, sizeof(set_response_header));
+}
+
+// Must be called with the mutex held.
+static int read_fan_speed_locked(struct ekloco_device *ekloco, int channel,
+				 struct fan_read_result *result)
+{
+	int ret;
+
+	ekloco_encode_fan_read(ekloco->buffer, channel);
+
+	ret = ekloco->transport->xfer(ekloco);
+	if (ret < 0)
+		return ret;
+
+	ekloco_decode_fan_read(ekloco->buffer, result);
+	ekloco_record_fan(ekloco, channel, result);
+
+	write_seqcount_begin(&ekloco->cache_seq);
+	ekloco->cache.fans[channel] = *result;
+	ekloco->cache.valid[POLL_FAN1 + channel] = true;
+	ekloco->cache.time[POLL_FAN1 + channel] = ktime_get();
+	write_seqcount_end(&ekloco->cache_seq);
+
+	return 0;
+}
+
+static int read_fan_speed(struct ekloco_device *ekloco, int channel, struct fan_read_result *result)
+{
+	int ret;
+
+	mutex_lock(&ekloco->mutex);
+	ret = read_fan_speed_locked(ekloco, channel, result);
+	mutex_unlock(&ekloco->mutex);
+
+	return ret;
+}
+
+// Must be called with the mutex held.
+static int set_fan_pwm_locked(struct ekloco_device *ekloco, int channel, long target)
+{
+	int ret;
+
+	ekloco_encode_fan_set(ekloco->buffer, channel, target);
+	ret = ekloco->transport->xfer(ekloco);
+	if (!ret && !ekloco_check_fan_set(ekloco->buffer, ekloco->reply_len))
+		ret = -EPROTO;
+
+	// The cached duty is stale now, the next reader goes to the device.
+	write_seqcount_begin(&ekloco->cache_seq);
+	ekloco->cache.valid[POLL_FAN1 + channel] = false;
+	write_seqcount_end(&ekloco->cache_seq);
+
+	return ret;
+}
+
+/*
+ * Must be called with the mutex held. A new duty replaces whatever a running recovery would go
+ * back to, and the recovery only writes with the mutex held, so it can't override this one.
+ */
+static void ekloco_stall_cancel(struct ekloco_device *ekloco, unsigned long mask)
+{
+	unsigned long flags;
+	int channel;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	for_each_set_bit(channel, &mask, NUM_FANS)
+		ekloco->stall[channel].state = STALL_NONE;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+}
+
+/*
+ * Duty writes from userspace fail with -EBUSY while the fan is being characterized. The check
+ * is made under the mutex the sweep sets calibrating with, so no write lands mid-sweep.
+ */
+static int set_fan_pwm(struct ekloco_device *ekloco, int channel, long target)
+{
+	int ret;
+
+	if (target > 255 || target < 0)
+		return -EINVAL;
+
+	mutex_lock(&ekloco->mutex);
+	if (test_bit(channel, &ekloco->calibrating)) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	ekloco_stall_cancel(ekloco, BIT(channel));
+	ret = set_fan_pwm_locked(ekloco, channel, target);
+
+out_unlock:
+	mutex_unlock(&ekloco->mutex);
+	return ret;
+}
+
+/*
+ * Sets the duty of every fan in mask in one burst under a single hold of the mutex, so no other
+ * request gets between them. Every response is checked like set_fan_pwm() checks its own.
+ */
+static int set_fan_pwm_burst(struct ekloco_device *ekloco, unsigned long mask, const long *target)
+{
+	int lens[NUM_FANS];
+	u8 *frames;
+	int count = 0;
+	int channel;
+	int ret;
+	int i;
+
+	for_each_set_bit(channel, &mask, NUM_FANS) {
+		if (target[channel] > 255 || target[channel] < 0)
+			return -EINVAL;
+	}
+
+	frames = kmalloc_array(NUM_FANS, BUFFER_SIZE, GFP_KERNEL);
+	if (!frames)
+		return -ENOMEM;
+
+	for_each_set_bit(channel, &mask, NUM_FANS)
+		ekloco_encode_fan_set(frames + count++ * BUFFER_SIZE, channel, target[channel]);
+
+	mutex_lock(&ekloco->mutex);
+
+	if (mask & ekloco->calibrating) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+
+	ekloco_stall_cancel(ekloco, mask);
+	ret = ekloco->transport->xfer_burst(ekloco, frames, lens, count);
+	for (i = 0; !ret && i < count; i++) {
+		if (!ekloco_check_fan_set(frames + i * BUFFER_SIZE, lens[i]))
+			ret = -EPROTO;
+	}
+
+	write_seqcount_begin(&ekloco->cache_seq);
+	for_each_set_bit(channel, &mask, NUM_FANS)
+		ekloco->cache.valid[POLL_FAN1 + channel] = false;
+	write_seqcount_end(&ekloco->cache_seq);
+
+out_unlock:
+	mutex_unlock(&ekloco->mutex);
+
+	kfree(frames);
+	return ret;
+}
+
+static int read_sensors(struct ekloco_device *ekloco, struct sensor_result *result)
+{
+	int ret;
+
+	mutex_lock(&ekloco->mutex);
+
+	ekloco_encode_sensor_read(ekloco->buffer);
+
+	ret = ekloco->transport->xfer(ekloco);
+	if (ret < 0)
+		goto out_unlock;
+
+	ekloco_decode_sensors(ekloco->buffer, result);
+	ekloco_record_sensors(ekloco, result);
+
+	write_seqcount_begin(&ekloco->cache_seq);
+	ekloco->cache.sensors = *result;
+	ekloco->cache.valid[POLL_SENSORS] = true;
+	ekloco->cache.time[POLL_SENSORS] = ktime_get();
+	write_seqcount_end(&ekloco->cache_seq);
+
+out_unlock:
+	mutex_unlock(&ekloco->mutex);
+	return ret;
+}
+
+/*
+ * Readers are served from the cache without taking the mutex, which is held for a whole
+ * round-trip by every transaction. With max_age set, that's whenever the cached reading is
+ * recent enough, otherwise while the background poller covers the channel. Everything else
+ * asks the device, and fails if the device does. That includes every read with the defaults,
+ * no poller and no max_age, which waits for the mutex like before the cache.
+ */
+static bool ekloco_polled(struct ekloco_device *ekloco, int channel)
+{
+	return READ_ONCE(ekloco->update_interval) && READ_ONCE(ekloco->poll_weight[channel]);
+}
+
+static bool ekloco_cache_usable(struct ekloco_device *ekloco, int channel, bool valid,
+				ktime_t time)
+{
+	unsigned long max_age = READ_ONCE(ekloco->max_age);
+
+	if (!valid)
+		return false;
+	if (max_age)
+		return ktime_ms_delta(ktime_get(), time) <= max_age;
+
+	return ekloco_polled(ekloco, channel);
+}
+
+static int ekloco_get_sensors(struct ekloco_device *ekloco, struct sensor_result *result)
+{
+	unsigned int seq;
+	ktime_t time;
+	bool valid;
+
+	do {
+		seq = read_seqcount_begin(&ekloco->cache_seq);
+		valid = ekloco->cache.valid[POLL_SENSORS];
+		time = ekloco->cache.time[POLL_SENSORS];
+		*result = ekloco->cache.sensors;
+	} while (read_seqcount_retry(&ekloco->cache_seq, seq));
+
+	if (!ekloco_cache_usable(ekloco, POLL_SENSORS, valid, time))
+		return read_sensors(ekloco, result);
+
+	return 0;
+}
+
+static int ekloco_get_fan(struct ekloco_device *ekloco, int channel,
+			  struct fan_read_result *result)
+{
+	unsigned int seq;
+	ktime_t time;
+	bool valid;
+
+	do {
+		seq = read_seqcount_begin(&ekloco->cache_seq);
+		valid = ekloco->cache.valid[POLL_FAN1 + channel];
+		time = ekloco->cache.time[POLL_FAN1 + channel];
+		*result = ekloco->cache.fans[channel];
+	} while (read_seqcount_retry(&ekloco->cache_seq, seq));
+
+	if (!ekloco_cache_usable(ekloco, POLL_FAN1 + channel, valid, time))
+		return read_fan_speed(ekloco, channel, result);
+
+	return 0;
+}
+
+// Time since the last successful read of a channel, by anyone.
+static int ekloco_cache_age(struct ekloco_device *ekloco, int channel, s64 *age)
+{
+	unsigned int seq;
+	ktime_t time;
+	bool valid;
+
+	do {
+		seq = read_seqcount_begin(&ekloco->cache_seq);
+		valid = ekloco->cache.valid[channel];
+		time = ekloco->cache.time[channel];
+	} while (read_seqcount_retry(&ekloco->cache_seq, seq));
+
+	if (!valid)
+		return -ENODATA;
+
+	*age = ktime_ms_delta(ktime_get(), time);
+	return 0;
+}
+
+static void ekloco_genl_notify(struct ekloco_device *ekloco, const struct ekloco_sample *sample)
+{
+	struct ekloco_nl_sample *nl;
+	struct sk_buff *skb;
+	struct nlattr *attr;
+	void *hdr;
+	int i;
+
+	// Don't bother building messages nobody is going to read.
+	if (!genl_has_listeners(&ekloco_genl_family, &init_net, 0))
+		return;
+
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &ekloco_genl_family, 0, EKLOCO_CMD_SAMPLE);
+	if (!hdr)
+		goto out_free;
+
+	if (nla_put_string(skb, EKLOCO_ATTR_DEVICE, dev_name(&ekloco->hdev->dev)) ||
+	    nla_put_u64_64bit(skb, EKLOCO_ATTR_TIMESTAMP, ktime_to_ns(sample->timestamp),
+			      EKLOCO_ATTR_PAD))
+		goto out_free;
+
+	attr = nla_reserve(skb, EKLOCO_ATTR_SAMPLE, sizeof(*nl));
+	if (!attr)
+		goto out_free;
+
+	nl = nla_data(attr);
+	memset(nl, 0, sizeof(*nl));
+	if (!sample->sensors.level)
+		nl->alarms |= EKLOCO_ALARM_LEVEL;
+	nl->flow_lph = sample->sensors.flow_lph;
+	for (i = 0; i < NUM_TEMP_SENSORS; i++)
+		nl->temp[i] = sample->sensors.temp[i];
+	for (i = 0; i < NUM_FANS; i++) {
+		nl->rpm[i] = sample->fans[i].rpm;
+		nl->pwm[i] = sample->fans[i].pwm;
+	}
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&ekloco_genl_family, skb, 0, 0, GFP_KERNEL);
+	return;
+
+out_free:
+	nlmsg_free(skb);
+}
+
+#if IS_ENABLED(CONFIG_PERF_EVENTS)
+
+static long ekloco_sample_value(const struct ekloco_sample *sample, int event)
+{
+	switch (event) {
+	case EKLOCO_PMU_TEMP1 ... EKLOCO_PMU_TEMP3:
+		return sample->sensors.temp[event - EKLOCO_PMU_TEMP1];
+	case EKLOCO_PMU_FLOW:
+		return sample->sensors.flow_lph;
+	case EKLOCO_PMU_LEVEL:
+		return sample->sensors.level;
+	case EKLOCO_PMU_FAN1 ... EKLOCO_PMU_PWM1 - 1:
+		return sample->fans[event - EKLOCO_PMU_FAN1].rpm;
+	case EKLOCO_PMU_PWM1 ... EKLOCO_PMU_NUM_EVENTS - 1:
+		return sample->fans[event - EKLOCO_PMU_PWM1].pwm;
+	default:
+		return 0;
+	}
+}
+
+// Must be called with the PMU lock held.
+static void ekloco_pmu_integrate(struct ekloco_pmu *epmu, ktime_t now)
+{
+	s64 delta_us;
+	long val;
+	int i;
+
+	if (epmu->sample_valid) {
+		delta_us = ktime_us_delta(now, epmu->integral_time);
+		for (i = 0; i < EKLOCO_PMU_NUM_EVENTS; i++) {
+			val = ekloco_sample_value(&epmu->sample, i);
+			// Unused ports would count as 231 degC.
+			if (i <= EKLOCO_PMU_TEMP3 && val == SENSOR_TEMP_UNUSED)
+				continue;
+			epmu->integral[i] += val * delta_us;
+		}
+	}
+
+	epmu->integral_time = now;
+}
+
+static void ekloco_store_sample(struct ekloco_device *ekloco, const struct ekloco_sample *sample)
+{
+	struct ekloco_pmu *epmu = ekloco->pmu;
+	unsigned long flags;
+
+	spin_lock_irqsave(&epmu->lock, flags);
+	ekloco_pmu_integrate(epmu, ktime_get());
+	epmu->sample = *sample;
+	epmu->sample_valid = true;
+	spin_unlock_irqrestore(&epmu->lock, flags);
+}
+
+#else
+
+static void ekloco_store_sample(struct ekloco_device *ekloco, const struct ekloco_sample *sample)
+{
+}
+
+#endif
+
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+
+static void ekloco_iio_poll(struct ekloco_device *ekloco)
+{
+	struct iio_trigger *trig = READ_ONCE(ekloco->iio_trig);
+
+	if (trig)
+		iio_trigger_poll_nested(trig);
+}
+
+#else
+
+static void ekloco_iio_poll(struct ekloco_device *ekloco)
+{
+}
+
+#endif
+
+// Hands a complete sample to the PMU, netlink listeners and the IIO buffer.
+static void ekloco_publish(struct ekloco_device *ekloco, const struct ekloco_sample *sample)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	ekloco->last_sample = *sample;
+	ekloco->last_sample_valid = true;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	ekloco_store_sample(ekloco, sample);
+	ekloco_genl_notify(ekloco, sample);
+	ekloco_iio_poll(ekloco);
+}
+
+static bool ekloco_sensors_changed(const struct sensor_result *old,
+				   const struct sensor_result *new)
+{
+	int i;
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		if (new->temp[i] == SENSOR_TEMP_UNUSED || old->temp[i] == SENSOR_TEMP_UNUSED)
+			continue;
+		if (abs(new->temp[i] - old->temp[i]) >= RATE_TEMP_DELTA)
+			return true;
+	}
+
+	return abs(new->flow_lph - old->flow_lph) >= RATE_FLOW_DELTA || new->level != old->level;
+}
+
+static bool ekloco_temp_near_limit(struct ekloco_device *ekloco, const struct sensor_result *result)
+{
+	long temp, max, crit;
+	int i;
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		if (result->temp[i] == SENSOR_TEMP_UNUSED)
+			continue;
+
+		temp = result->temp[i] * 1000;
+		max = READ_ONCE(ekloco->temp_max[i]);
+		crit = READ_ONCE(ekloco->temp_crit[i]);
+		if ((max && temp >= max - RATE_TEMP_MARGIN) ||
+		    (crit && temp >= crit - RATE_TEMP_MARGIN))
+			return true;
+	}
+
+	return false;
+}
+
+static bool ekloco_fan_changed(const struct fan_read_result *old,
+			       const struct fan_read_result *new)
+{
+	return abs(new->rpm - old->rpm) >= RATE_RPM_DELTA || new->pwm != old->pwm;
+}
+
+static void ekloco_rate_update(struct ekloco_device *ekloco, struct ekloco_rate *rate, bool busy)
+{
+	unsigned long max = READ_ONCE(ekloco->update_interval);
+	unsigned long min = READ_ONCE(ekloco->update_interval_min);
+	unsigned long interval;
+
+	if (!min || min >= max)
+		interval = max;
+	else if (busy)
+		interval = min;
+	else
+		interval = clamp(rate->interval * 2, min, max);
+
+	WRITE_ONCE(rate->interval, interval);
+	rate->next = jiffies + msecs_to_jiffies(interval);
+}
+
+static int ekloco_poll_group(int channel)
+{
+	return channel == POLL_SENSORS ? RATE_SENSORS : RATE_FANS;
+}
+
+/*
+ * Chooses the channels to read in this run among those of the due groups. Without a budget, or
+ * when it covers them all, that's every due channel with a non-zero weight. Otherwise smooth
+ * weighted round-robin, as in nginx, picks budget of them one at a time, so over time each
+ * channel gets a share of the transactions that follows its weight. The first run reads every
+ * channel.
+ */
+static void ekloco_poll_pick(struct ekloco_device *ekloco, const bool *due, bool *pick)
+{
+	unsigned int budget = READ_ONCE(ekloco->update_budget);
+	unsigned int weight[NUM_POLL_CHANNELS];
+	unsigned int n = 0;
+	int total, best;
+	int i;
+
+	for (i = 0; i < NUM_POLL_CHANNELS; i++) {
+		weight[i] = due[ekloco_poll_group(i)] ? READ_ONCE(ekloco->poll_weight[i]) : 0;
+		pick[i] = !ekloco->poll_valid || weight[i];
+		n += pick[i];
+	}
+
+	if (!ekloco->poll_valid || !budget || n <= budget)
+		return;
+
+	memset(pick, 0, NUM_POLL_CHANNELS * sizeof(*pick));
+	while (budget--) {
+		total = 0;
+		best = -1;
+		for (i = 0; i < NUM_POLL_CHANNELS; i++) {
+			if (!weight[i] || pick[i])
+				continue;
+			ekloco->poll_current[i] += weight[i];
+			total += weight[i];
+			if (best < 0 || ekloco->poll_current[i] > ekloco->poll_current[best])
+				best = i;
+		}
+		ekloco->poll_current[best] -= total;
+		pick[best] = true;
+	}
+}
+
+static int ekloco_poll_sensors(struct ekloco_device *ekloco, bool *busy)
+{
+	struct ekloco_sample *sample = &ekloco->poll_sample;
+	struct sensor_result result;
+	int ret;
+
+	ret = read_sensors(ekloco, &result);
+	if (ret < 0)
+		return ret;
+
+	*busy = ekloco_temp_near_limit(ekloco, &result) ||
+		(ekloco->poll_valid && ekloco_sensors_changed(&sample->sensors, &result));
+	sample->sensors = result;
+
+	return 0;
+}
+
+static int ekloco_poll_fan(struct ekloco_device *ekloco, int channel, bool *busy)
+{
+	struct ekloco_sample *sample = &ekloco->poll_sample;
+	struct fan_read_result result;
+	int ret;
+
+	ret = read_fan_speed(ekloco, channel, &result);
+	if (ret < 0)
+		return ret;
+
+	*busy |= ekloco->poll_valid && ekloco_fan_changed(&sample->fans[channel], &result);
+	sample->fans[channel] = result;
+
+	return 0;
+}
+
+static void ekloco_poll_timing(struct ekloco_device *ekloco)
+{
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&ekloco->jitter_lock, flags);
+	if (ekloco->poll_last)
+		ekloco_histogram_add(&ekloco->poll_spacing, ktime_us_delta(now, ekloco->poll_last));
+	if (ekloco->poll_due)
+		ekloco_histogram_add(&ekloco->poll_latency,
+				     max_t(s64, ktime_us_delta(now, ekloco->poll_due), 0));
+	ekloco->poll_last = now;
+	spin_unlock_irqrestore(&ekloco->jitter_lock, flags);
+}
+
+// Records when the poller is expected to run next, delay in jiffies.
+static void ekloco_poll_due(struct ekloco_device *ekloco, unsigned long delay)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->jitter_lock, flags);
+	ekloco->poll_due = ktime_add_ns(ktime_get(), jiffies_to_nsecs(delay));
+	spin_unlock_irqrestore(&ekloco->jitter_lock, flags);
+}
+
+/*
+ * Reads the picked channels of the groups that are due and publishes the combined sample.
+ * Returns the delay until the next group is due. A due group is rescheduled even if none of
+ * its channels fit in the budget, keeping its interval.
+ */
+static unsigned long ekloco_poll(struct ekloco_device *ekloco, bool all)
+{
+	bool due[NUM_RATE_GROUPS];
+	bool busy[NUM_RATE_GROUPS] = { };
+	bool read[NUM_RATE_GROUPS] = { };
+	bool pick[NUM_POLL_CHANNELS];
+	bool failed = false;
+	unsigned long next;
+	int ret;
+	int i;
+
+	WRITE_ONCE(ekloco->poll_wakeups, ekloco->poll_wakeups + 1);
+	ekloco_poll_timing(ekloco);
+
+	for (i = 0; i < NUM_RATE_GROUPS; i++)
+		due[i] = all || !ekloco->poll_valid || time_after_eq(jiffies, ekloco->rate[i].next);
+
+	ekloco_poll_pick(ekloco, due, pick);
+
+	for (i = 0; i < NUM_POLL_CHANNELS; i++) {
+		if (!pick[i])
+			continue;
+
+		if (i == POLL_SENSORS)
+			ret = ekloco_poll_sensors(ekloco, &busy[RATE_SENSORS]);
+		else
+			ret = ekloco_poll_fan(ekloco, i - POLL_FAN1, &busy[RATE_FANS]);
+		if (ret < 0)
+			failed = true;
+		read[ekloco_poll_group(i)] = true;
+	}
+
+	for (i = 0; i < NUM_RATE_GROUPS; i++) {
+		if (!due[i])
+			continue;
+		if (read[i])
+			ekloco_rate_update(ekloco, &ekloco->rate[i], busy[i]);
+		else
+			ekloco->rate[i].next = jiffies + msecs_to_jiffies(ekloco->rate[i].interval);
+	}
+
+	if ((read[RATE_SENSORS] || read[RATE_FANS]) && !failed) {
+		ekloco->poll_valid = true;
+		ekloco->poll_sample.timestamp = ktime_get_boottime();
+		ekloco_publish(ekloco, &ekloco->poll_sample);
+	}
+
+	next = ekloco->rate[0].next;
+	for (i = 1; i < NUM_RATE_GROUPS; i++) {
+		if (time_before(ekloco->rate[i].next, next))
+			next = ekloco->rate[i].next;
+	}
+
+	return time_after(next, jiffies) ? next - jiffies : 0;
+}
+
+static void ekloco_refresh_work(struct work_struct *work)
+{
+	struct ekloco_device *ekloco = container_of(to_delayed_work(work), struct ekloco_device,
+						    refresh_work);
+	unsigned long delay;
+
+	if (!READ_ONCE(ekloco->update_interval))
+		return;
+
+	delay = ekloco_poll(ekloco, false);
+	ekloco_poll_due(ekloco, delay);
+	schedule_delayed_work(&ekloco->refresh_work, delay);
+}
+
+/*
+ * Power saving mode. The timer is deferrable, so an idle CPU isn't woken up for it, and the
+ * expiry is rounded up to a multiple of the slack so the driver's wakeups line up with each
+ * other and with anything else using the same alignment. Readings can get older than the
+ * interval while the system is idle. Both delay and slack are in jiffies, no slack leaves the
+ * delay alone.
+ */
+static unsigned long ekloco_slack_delay(unsigned long delay, unsigned long slack)
+{
+	unsigned long rem;
+
+	if (!slack)
+		return delay;
+
+	rem = (jiffies + delay) % slack;
+	if (rem)
+		delay += slack - rem;
+
+	return delay;
+}
+
+static void ekloco_refresh_work_deferrable(struct work_struct *work)
+{
+	struct ekloco_device *ekloco = container_of(to_delayed_work(work), struct ekloco_device,
+						    refresh_work_deferrable);
+	unsigned long delay;
+
+	if (!READ_ONCE(ekloco->update_interval))
+		return;
+
+	delay = ekloco_poll(ekloco, false);
+	// update_slack may already be changing, the restart requeues with the new value.
+	delay = ekloco_slack_delay(delay, ekloco->poll_slack);
+	ekloco_poll_due(ekloco, delay);
+	queue_delayed_work(system_power_efficient_wq, &ekloco->refresh_work_deferrable, delay);
+}
+
+/*
+ * Low-jitter mode. The hrtimer fires at a fixed period of update_interval and every group is
+ * read on each tick, adaptive sampling would only make the spacing uneven. USB transfers sleep,
+ * so the reading itself happens on the highpri workqueue. A tick that finds the previous one
+ * still queued is counted as an overrun.
+ */
+static enum hrtimer_restart ekloco_poll_timer_fn(struct hrtimer *timer)
+{
+	struct ekloco_device *ekloco = container_of(timer, struct ekloco_device, poll_timer);
+	unsigned long flags;
+
+	// Being stopped, forwarding would only keep the timer firing until the cancel.
+	if (!READ_ONCE(ekloco->update_interval))
+		return HRTIMER_NORESTART;
+
+	spin_lock_irqsave(&ekloco->jitter_lock, flags);
+	ekloco->poll_due = hrtimer_get_expires(timer);
+	if (!queue_work(system_highpri_wq, &ekloco->poll_timer_work))
+		ekloco->poll_overruns++;
+	spin_unlock_irqrestore(&ekloco->jitter_lock, flags);
+
+	hrtimer_forward_now(timer, ekloco->poll_period);
+	return HRTIMER_RESTART;
+}
+
+static void ekloco_poll_timer_work(struct work_struct *work)
+{
+	struct ekloco_device *ekloco = container_of(work, struct ekloco_device, poll_timer_work);
+
+	if (!READ_ONCE(ekloco->update_interval))
+		return;
+
+	ekloco_poll(ekloco, true);
+}
+
+static void ekloco_stop_poller(struct ekloco_device *ekloco)
+{
+	unsigned long flags;
+
+	hrtimer_cancel(&ekloco->poll_timer);
+	cancel_work_sync(&ekloco->poll_timer_work);
+	cancel_delayed_work_sync(&ekloco->refresh_work);
+	cancel_delayed_work_sync(&ekloco->refresh_work_deferrable);
+
+	// Spacing across a restart says nothing about the timer.
+	spin_lock_irqsave(&ekloco->jitter_lock, flags);
+	ekloco->poll_due = 0;
+	ekloco->poll_last = 0;
+	spin_unlock_irqrestore(&ekloco->jitter_lock, flags);
+}
+
+/*
+ * Restarts the poller from the slowest rate, with the new intervals and mode. Each work only
+ * requeues itself, so stopping both leaves nothing behind. The settings are read under
+ * poll_mutex, so of two racing stores the later restart sees both, and only one poller runs.
+ */
+static void ekloco_restart_poller(struct ekloco_device *ekloco)
+{
+	unsigned long interval;
+	unsigned long slack;
+	unsigned long delay;
+	int i;
+
+	mutex_lock(&ekloco->poll_mutex);
+
+	ekloco_stop_poller(ekloco);
+	interval = READ_ONCE(ekloco->update_interval);
+	slack = msecs_to_jiffies(READ_ONCE(ekloco->update_slack));
+	if (!interval)
+		goto out_unlock;
+
+	ekloco->poll_valid = false;
+	for (i = 0; i < NUM_RATE_GROUPS; i++)
+		WRITE_ONCE(ekloco->rate[i].interval, interval);
+	memset(ekloco->poll_current, 0, sizeof(ekloco->poll_current));
+
+	if (READ_ONCE(ekloco->update_hrtimer)) {
+		ekloco->poll_period = ms_to_ktime(interval);
+		hrtimer_start(&ekloco->poll_timer, ekloco->poll_period, HRTIMER_MODE_REL);
+		goto out_unlock;
+	}
+
+	delay = msecs_to_jiffies(interval);
+	if (slack) {
+		ekloco->poll_slack = slack;
+		delay = ekloco_slack_delay(delay, slack);
+		ekloco_poll_due(ekloco, delay);
+		queue_delayed_work(system_power_efficient_wq, &ekloco->refresh_work_deferrable,
+				   delay);
+	} else {
+		ekloco_poll_due(ekloco, delay);
+		schedule_delayed_work(&ekloco->refresh_work, delay);
+	}
+
+out_unlock:
+	mutex_unlock(&ekloco->poll_mutex);
+}
+
+static int ekloco_set_update_interval(struct ekloco_device *ekloco, long val)
+{
+	if (val < 0)
+		return -EINVAL;
+
+	if (val)
+		val = clamp_val(val, MIN_UPDATE_INTERVAL, MAX_UPDATE_INTERVAL);
+
+	WRITE_ONCE(ekloco->update_interval, val);
+	ekloco_restart_poller(ekloco);
+
+	return 0;
+}
+
+// Follows the response of every fan in mask to a duty that was just written.
+static void ekloco_step_start(struct ekloco_device *ekloco, unsigned long mask)
+{
+	unsigned long flags;
+	int channel;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	for_each_set_bit(channel, &mask, NUM_FANS) {
+		memset(&ekloco->step[channel], 0, sizeof(ekloco->step[channel]));
+		ekloco->step[channel].active = true;
+		ekloco->step[channel].start = ktime_get();
+	}
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	mod_delayed_work(system_wq, &ekloco->step_work, 0);
+}
+
+// Must be called with sample_lock held. Returns true while the fan is still being followed.
+static bool ekloco_step_sample(struct ekloco_step *step, struct ekloco_step_stats *stats,
+			       long rpm, ktime_t now)
+{
+	unsigned int oldest, settle;
+	long lo, hi, sum, final;
+	int i;
+
+	if (!step->samples) {
+		step->start_rpm = rpm;
+		step->min_rpm = rpm;
+		step->max_rpm = rpm;
+	}
+	step->min_rpm = min(step->min_rpm, rpm);
+	step->max_rpm = max(step->max_rpm, rpm);
+
+	step->rpm[step->samples % STEP_SAMPLES] = rpm;
+	step->time[step->samples % STEP_SAMPLES] = now;
+	step->samples++;
+
+	if (step->samples >= STEP_SAMPLES) {
+		lo = hi = sum = step->rpm[0];
+		for (i = 1; i < STEP_SAMPLES; i++) {
+			lo = min(lo, step->rpm[i]);
+			hi = max(hi, step->rpm[i]);
+			sum += step->rpm[i];
+		}
+
+		if (hi - lo <= max_t(long, STEP_TOLERANCE, hi / 50)) {
+			final = DIV_ROUND_CLOSEST(sum, STEP_SAMPLES);
+			oldest = step->samples % STEP_SAMPLES;
+			settle = ktime_ms_delta(step->time[oldest], step->start);
+
+			stats->count++;
+			stats->settle_sum += settle;
+			stats->settle_max = max(stats->settle_max, settle);
+			stats->settle_last = settle;
+			stats->rpm_last = final;
+			if (final >= step->start_rpm)
+				stats->overshoot_last = max(step->max_rpm - final, 0L);
+			else
+				stats->overshoot_last = max(final - step->min_rpm, 0L);
+			return false;
+		}
+	}
+
+	if (ktime_ms_delta(now, step->start) > STEP_TIMEOUT_MS) {
+		stats->timeouts++;
+		return false;
+	}
+
+	return true;
+}
+
+static void ekloco_step_work(struct work_struct *work)
+{
+	struct ekloco_device *ekloco = container_of(to_delayed_work(work), struct ekloco_device,
+						    step_work);
+	struct fan_read_result result;
+	unsigned long flags;
+	bool again = false;
+	bool active;
+	int channel;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		spin_lock_irqsave(&ekloco->sample_lock, flags);
+		active = ekloco->step[channel].active;
+		spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+		if (!active)
+			continue;
+
+		if (read_fan_speed(ekloco, channel, &result) < 0) {
+			again = true;
+			continue;
+		}
+
+		// A new write may have restarted the channel meanwhile, this reading still counts.
+		spin_lock_irqsave(&ekloco->sample_lock, flags);
+		if (ekloco->step[channel].active)
+			ekloco->step[channel].active =
+				ekloco_step_sample(&ekloco->step[channel], &ekloco->step_stats[channel],
+						   result.rpm, ktime_get());
+		again |= ekloco->step[channel].active;
+		spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+	}
+
+	if (again)
+		schedule_delayed_work(&ekloco->step_work, msecs_to_jiffies(STEP_POLL_MS));
+}
+
+/*
+ * Moves every stalled fan through boost, return to its duty and check. A fan that still reads
+ * low is left alone until its duty is written again, so a dead fan isn't boosted forever.
+ */
+static void ekloco_stall_work(struct work_struct *work)
+{
+	struct ekloco_device *ekloco = container_of(to_delayed_work(work), struct ekloco_device,
+						    stall_work);
+	struct ekloco_stall *stall;
+	struct fan_read_result result;
+	enum ekloco_stall_state state;
+	unsigned long flags;
+	unsigned long until;
+	bool cancelled;
+	bool again = false;
+	long boost;
+	long duty;
+	int channel;
+	int ret;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		stall = &ekloco->stall[channel];
+
+		spin_lock_irqsave(&ekloco->sample_lock, flags);
+		state = stall->state;
+		duty = stall->duty;
+		boost = stall->boost;
+		until = stall->until;
+		// Disabled since detection, or the device is going away. Nothing was written yet.
+		if (state == STALL_DETECTED && !READ_ONCE(ekloco->stall_boost))
+			state = stall->state = STALL_NONE;
+		spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+		if (state == STALL_NONE || state == STALL_FAILED)
+			continue;
+		again = true;
+		if (state != STALL_DETECTED && time_before(jiffies, until))
+			continue;
+
+		/*
+		 * Duty writes cancel the recovery with the mutex held, so holding it from the check
+		 * to the bookkeeping keeps them from coming in between.
+		 */
+		mutex_lock(&ekloco->mutex);
+
+		spin_lock_irqsave(&ekloco->sample_lock, flags);
+		cancelled = stall->state != state;
+		spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+		if (cancelled) {
+			mutex_unlock(&ekloco->mutex);
+			continue;
+		}
+
+		switch (state) {
+		case STALL_DETECTED:
+			ret = set_fan_pwm_locked(ekloco, channel, boost);
+			state = STALL_BOOSTING;
+			until = jiffies + msecs_to_jiffies(STALL_BOOST_MS);
+			break;
+		case STALL_BOOSTING:
+			ret = set_fan_pwm_locked(ekloco, channel, duty);
+			state = STALL_CHECKING;
+			until = jiffies + msecs_to_jiffies(STALL_CHECK_MS);
+			break;
+		default:
+			ret = read_fan_speed_locked(ekloco, channel, &result);
+			break;
+		}
+
+		// Retried on the next run if the device didn't answer.
+		if (!ret) {
+			spin_lock_irqsave(&ekloco->sample_lock, flags);
+			// Recovery is judged like detection, against the curve once there is one.
+			if (stall->state == STALL_CHECKING) {
+				if (ekloco_fan_stalled(&ekloco->fan_curve[channel], result.pwm,
+						       result.rpm)) {
+					state = STALL_FAILED;
+					stall->failed++;
+				} else {
+					state = STALL_NONE;
+					stall->recovered++;
+				}
+			}
+			stall->state = state;
+			stall->until = until;
+			spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+		}
+
+		mutex_unlock(&ekloco->mutex);
+	}
+
+	if (again)
+		schedule_delayed_work(&ekloco->stall_work, msecs_to_jiffies(STEP_POLL_MS));
+}
+
+/*
+ * Raises duties below the stall point of a characterized fan to it, those would stop the fan
+ * or keep it from starting. 0 still turns the fan off.
+ */
+static long ekloco_clamp_duty(struct ekloco_device *ekloco, int channel, long duty)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	if (ekloco->fan_curve[channel].valid && duty > 0 && duty < ekloco->fan_curve[channel].stall)
+		duty = ekloco->fan_curve[channel].stall;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	return duty;
+}
+
+// Interpolates the duty giving rpm from the fan's curve.
+static int ekloco_curve_duty(struct ekloco_device *ekloco, int channel, long rpm, long *duty)
+{
+	struct ekloco_fan_curve curve;
+	unsigned long flags;
+	long lo, hi;
+	int i;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	curve = ekloco->fan_curve[channel];
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	if (!curve.valid)
+		return -ENODATA;
+
+	if (rpm <= 0) {
+		*duty = 0;
+		return 0;
+	}
+
+	if (curve.rpm[0] >= rpm) {
+		*duty = curve.stall;
+		return 0;
+	}
+
+	for (i = 1; i < CURVE_POINTS; i++) {
+		if (curve.rpm[i] < rpm)
+			continue;
+
+		lo = CURVE_DUTY(i - 1);
+		hi = CURVE_DUTY(i);
+		*duty = lo + DIV_ROUND_CLOSEST((rpm - curve.rpm[i - 1]) * (hi - lo),
+					       curve.rpm[i] - curve.rpm[i - 1]);
+		*duty = max_t(long, *duty, curve.stall);
+		return 0;
+	}
+
+	*duty = 255;
+	return 0;
+}
+
+// Returns true when the sweep has to stop.
+static bool ekloco_calibrate_settle(struct ekloco_device *ekloco)
+{
+	return wait_event_timeout(ekloco->calibrate_wait, READ_ONCE(ekloco->calibrate_stop),
+				  msecs_to_jiffies(CALIBRATE_SETTLE_MS)) != 0;
+}
+
+// The sweep's own duty writes, which set_fan_pwm() would refuse.
+static int ekloco_calibrate_set(struct ekloco_device *ekloco, int channel, long duty)
+{
+	int ret;
+
+	mutex_lock(&ekloco->mutex);
+	ekloco_stall_cancel(ekloco, BIT(channel));
+	ret = set_fan_pwm_locked(ekloco, channel, duty);
+	mutex_unlock(&ekloco->mutex);
+
+	return ret;
+}
+
+static int ekloco_calibrate_step(struct ekloco_device *ekloco, int channel, long duty,
+				 long *rpm)
+{
+	struct fan_read_result result;
+	int ret;
+
+	ret = ekloco_calibrate_set(ekloco, channel, duty);
+	if (ret < 0)
+		return ret;
+
+	if (ekloco_calibrate_settle(ekloco))
+		return -EINTR;
+
+	ret = read_fan_speed(ekloco, channel, &result);
+	if (ret < 0)
+		return ret;
+
+	*rpm = result.rpm;
+	return 0;
+}
+
+/*
+ * Steps the fan down from full duty to record its curve and the lowest duty it keeps turning
+ * at, then up from standstill to find the duty it starts at, which is usually higher. The
+ * previous duty is restored afterwards.
+ */
+static int ekloco_calibrate_fan(struct ekloco_device *ekloco, int channel)
+{
+	struct ekloco_fan_curve curve = { };
+	struct fan_read_result initial;
+	unsigned long flags;
+	long rpm;
+	int ret;
+	int i;
+
+	ret = read_fan_speed(ekloco, channel, &initial);
+	if (ret < 0)
+		return ret;
+
+	for (i = CURVE_POINTS - 1; i >= 0; i--) {
+		ret = ekloco_calibrate_step(ekloco, channel, CURVE_DUTY(i), &rpm);
+		if (ret < 0)
+			goto out_restore;
+		curve.rpm[i] = min_t(long, rpm, U16_MAX);
+		if (rpm)
+			curve.stall = CURVE_DUTY(i);
+	}
+
+	// Nothing connected, or a fan that doesn't report its speed.
+	if (!curve.rpm[CURVE_POINTS - 1]) {
+		ret = -ENODEV;
+		goto out_restore;
+	}
+
+	curve.spinup = 255;
+	for (i = 1; i < CURVE_POINTS; i++) {
+		ret = ekloco_calibrate_step(ekloco, channel, CURVE_DUTY(i), &rpm);
+		if (ret < 0)
+			goto out_restore;
+		if (rpm) {
+			curve.spinup = CURVE_DUTY(i);
+			break;
+		}
+	}
+
+	curve.valid = true;
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	ekloco->fan_curve[channel] = curve;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+out_restore:
+	ekloco_calibrate_set(ekloco, channel, initial.pwm);
+	return ret;
+}
+
+static void ekloco_calibrate_work(struct work_struct *work)
+{
+	struct ekloco_device *ekloco = container_of(work, struct ekloco_device, calibrate_work);
+	bool again;
+	int channel;
+	int ret;
+
+	do {
+		again = false;
+		for (channel = 0; channel < NUM_FANS; channel++) {
+			if (READ_ONCE(ekloco->calibrate_stop))
+				return;
+			if (!test_and_clear_bit(channel, &ekloco->calibrate_pending))
+				continue;
+
+			mutex_lock(&ekloco->mutex);
+			set_bit(channel, &ekloco->calibrating);
+			mutex_unlock(&ekloco->mutex);
+
+			ret = ekloco_calibrate_fan(ekloco, channel);
+
+			mutex_lock(&ekloco->mutex);
+			clear_bit(channel, &ekloco->calibrating);
+			mutex_unlock(&ekloco->mutex);
+
+			if (ret == -ENODEV)
+				hid_info(ekloco->hdev, "F%d doesn't turn, not characterized\n",
+					 channel + 1);
+			else if (ret < 0 && ret != -EINTR)
+				hid_warn(ekloco->hdev, "F%d characterization failed: %d\n",
+					 channel + 1, ret);
+			again = true;
+		}
+	} while (again);
+}
+
+static void ekloco_calibrate(struct ekloco_device *ekloco, unsigned long mask)
+{
+	int channel;
+
+	for_each_set_bit(channel, &mask, NUM_FANS)
+		set_bit(channel, &ekloco->calibrate_pending);
+
+	queue_work(system_long_wq, &ekloco->calibrate_work);
+}
+
+static int ekloco_read_string(struct device *ekloco, enum hwmon_sensor_types type,
+			      u32 attr, int channel, const char **str)
+{
+	switch (type) {
+	case hwmon_temp:
+		if (channel < 0 || channel >= NUM_TEMP_SENSORS)
+			break;
+		switch (attr) {
+		case hwmon_temp_label:
+			*str = temp_labels[channel];
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_fan:
+		// Coolant flow meter is exposed as an extra fan.
+		if (channel < 0 || channel >= (NUM_FANS + 1))
+			break;
+		switch (attr) {
+		case hwmon_fan_label:
+			if (channel == NUM_FANS)
+				*str = flow_label;
+			else
+				*str = fan_labels[channel];
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_humidity:
+		if (channel != 0)
+			break;
+		switch (attr) {
+		case hwmon_humidity_label:
+			*str = level_label;
+			return 0;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static int ekloco_read(struct device *dev, enum hwmon_sensor_types type,
+		       u32 attr, int channel, long *val)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	unsigned long flags;
+	int ret;
+
+	switch (type) {
+	case hwmon_chip:
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			*val = READ_ONCE(ekloco->update_interval);
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_temp:
+		if (channel < 0 || channel >= NUM_TEMP_SENSORS)
+			break;
+		switch (attr) {
+		case hwmon_temp_input:
+			{
+				struct sensor_result result;
+				ret = ekloco_get_sensors(ekloco, &result);
+				if (ret < 0)
+					return ret;
+				// Temperature is already reported as degC, scale to expected unit.
+				*val = result.temp[channel] * 1000;
+			}
+			return 0;
+		case hwmon_temp_max:
+			*val = READ_ONCE(ekloco->temp_max[channel]);
+			return 0;
+		case hwmon_temp_crit:
+			*val = READ_ONCE(ekloco->temp_crit[channel]);
+			return 0;
+		case hwmon_temp_lowest:
+		case hwmon_temp_highest:
+			ret = ekloco_history_get(ekloco, &ekloco->temp_history[channel],
+						 attr == hwmon_temp_lowest ?
+						 HISTORY_LOWEST : HISTORY_HIGHEST, val);
+			if (ret < 0)
+				return ret;
+			*val *= 1000;
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_fan:
+		// Coolant flow meter is exposed as an extra fan.
+		if (channel < 0 || channel >= (NUM_FANS + 1))
+			break;
+		switch (attr) {
+		case hwmon_fan_target:
+			spin_lock_irqsave(&ekloco->sample_lock, flags);
+			*val = ekloco->fan_target[channel];
+			spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+			return 0;
+		case hwmon_fan_input:
+			if (channel == NUM_FANS) {
+				struct sensor_result result;
+				ret = ekloco_get_sensors(ekloco, &result);
+				if (ret < 0)
+					return ret;
+				*val = result.flow_lph;
+			} else {
+				struct fan_read_result result;
+				ret = ekloco_get_fan(ekloco, channel, &result);
+				if (ret < 0)
+					return ret;
+				*val = result.rpm;
+			}
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_pwm:
+		if (channel < 0 || channel >= NUM_FANS)
+			break;
+		switch (attr) {
+		case hwmon_pwm_input:
+			{
+				struct fan_read_result result;
+				ret = ekloco_get_fan(ekloco, channel, &result);
+				if (ret < 0)
+					return ret;
+				*val = result.pwm;
+			}
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_humidity:
+		if (channel != 0)
+			break;
+		switch (attr) {
+		case hwmon_humidity_alarm:
+			{
+				struct sensor_result result;
+				ret = ekloco_get_sensors(ekloco, &result);
+				if (ret < 0)
+					return ret;
+				*val = !result.level;
+			}
+			return 0;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return -EOPNOTSUPP;
+};
+
+static int ekloco_write(struct device *dev, enum hwmon_sensor_types type,
+		        u32 attr, int channel, long val)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	unsigned long flags;
+	long duty;
+	int ret;
+
+	switch (type) {
+	case hwmon_chip:
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			return ekloco_set_update_interval(ekloco, val);
+		case hwmon_chip_temp_reset_history:
+			ekloco_history_reset(ekloco, ekloco->temp_history, NUM_TEMP_SENSORS);
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_temp:
+		if (channel < 0 || channel >= NUM_TEMP_SENSORS)
+			break;
+		switch (attr) {
+		case hwmon_temp_reset_history:
+			ekloco_history_reset(ekloco, &ekloco->temp_history[channel], 1);
+			return 0;
+		case hwmon_temp_max:
+			if (val < 0 || val > 255000)
+				return -EINVAL;
+			WRITE_ONCE(ekloco->temp_max[channel], val);
+			return 0;
+		case hwmon_temp_crit:
+			if (val < 0 || val > 255000)
+				return -EINVAL;
+			WRITE_ONCE(ekloco->temp_crit[channel], val);
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_pwm:
+		if (channel < 0 || channel >= NUM_FANS)
+			break;
+		switch (attr) {
+		case hwmon_pwm_input:
+			ret = set_fan_pwm(ekloco, channel, ekloco_clamp_duty(ekloco, channel, val));
+			if (ret < 0)
+				return ret;
+			ekloco_step_start(ekloco, BIT(channel));
+			return 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_fan:
+		if (channel < 0 || channel >= NUM_FANS)
+			break;
+		switch (attr) {
+		case hwmon_fan_target:
+			ret = ekloco_curve_duty(ekloco, channel, val, &duty);
+			if (ret < 0)
+				return ret;
+			ret = set_fan_pwm(ekloco, channel, duty);
+			if (ret < 0)
+				return ret;
+			ekloco_step_start(ekloco, BIT(channel));
+			spin_lock_irqsave(&ekloco->sample_lock, flags);
+			ekloco->fan_target[channel] = val;
+			spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+			return 0;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return -EOPNOTSUPP;
+};
+
+
+static umode_t ekloco_is_visible(const void *data, enum hwmon_sensor_types type,
+			         u32 attr, int channel)
+{
+	switch (type) {
+	case hwmon_chip:
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			return 0644;
+		case hwmon_chip_temp_reset_history:
+			return 0200;
+		default:
+			break;
+		}
+		break;
+	case hwmon_temp:
+		if (channel < 0 || channel >= NUM_TEMP_SENSORS)
+			break;
+		switch (attr) {
+		case hwmon_temp_input:
+			return 0444;
+		case hwmon_temp_label:
+			return 0444;
+		case hwmon_temp_max:
+		case hwmon_temp_crit:
+			return 0644;
+		case hwmon_temp_lowest:
+			return 0444;
+		case hwmon_temp_highest:
+			return 0444;
+		case hwmon_temp_reset_history:
+			return 0200;
+		default:
+			break;
+		}
+		break;
+	case hwmon_fan:
+		// Coolant flow meter is exposed as an extra fan.
+		if (channel < 0 || channel >= (NUM_FANS + 1))
+			break;
+		switch (attr) {
+		case hwmon_fan_input:
+			return 0444;
+		case hwmon_fan_label:
+			return 0444;
+		case hwmon_fan_target:
+			return channel < NUM_FANS ? 0644 : 0;
+		default:
+			break;
+		}
+		break;
+	case hwmon_pwm:
+		if (channel < 0 || channel >= NUM_FANS)
+			break;
+		switch (attr) {
+		case hwmon_pwm_input:
+			return 0644;
+		default:
+			break;
+		}
+		break;
+	// Coolant level sensor exports as humidity.
+	case hwmon_humidity:
+		if (channel != 0)
+			break;
+		switch (attr) {
+		case hwmon_humidity_label:
+			return 0444;
+		case hwmon_humidity_alarm:
+			return 0444;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+
+static const struct hwmon_ops ekloco_hwmon_ops = {
+	.is_visible = ekloco_is_visible,
+	.read = ekloco_read,
+	.read_string = ekloco_read_string,
+	.write = ekloco_write,
+};
+
+
+static const struct hwmon_channel_info *ekloco_info[] = {
+	HWMON_CHANNEL_INFO(chip,
+			   HWMON_C_REGISTER_TZ | HWMON_C_UPDATE_INTERVAL |
+			   HWMON_C_TEMP_RESET_HISTORY),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX | HWMON_T_CRIT |
+			   HWMON_T_LOWEST | HWMON_T_HIGHEST | HWMON_T_RESET_HISTORY,
+			   HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX | HWMON_T_CRIT |
+			   HWMON_T_LOWEST | HWMON_T_HIGHEST | HWMON_T_RESET_HISTORY,
+			   HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX | HWMON_T_CRIT |
+			   HWMON_T_LOWEST | HWMON_T_HIGHEST | HWMON_T_RESET_HISTORY
+			   ),
+	HWMON_CHANNEL_INFO(fan,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
+			   HWMON_F_INPUT | HWMON_F_LABEL
+			   ),
+	HWMON_CHANNEL_INFO(pwm,
+			   HWMON_PWM_INPUT,
+			   HWMON_PWM_INPUT,
+			   HWMON_PWM_INPUT,
+			   HWMON_PWM_INPUT,
+			   HWMON_PWM_INPUT,
+			   HWMON_PWM_INPUT
+			   ),
+	// Coolant level is exposed as humidity alarm, due to lack of better options.
+	HWMON_CHANNEL_INFO(humidity,
+			   HWMON_H_LABEL | HWMON_H_ALARM
+			   ),
+	NULL
+};
+
+static const struct hwmon_chip_info ekloco_chip_info = {
+	.ops = &ekloco_hwmon_ops,
+	.info = ekloco_info,
+};
+
+/*
+ * hwmon has no history attributes for fans and no temperature average, these follow the naming
+ * of the standard temperature history attributes.
+ */
+static ssize_t temp_history_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	long val;
+	int ret;
+
+	ret = ekloco_history_get(ekloco, &ekloco->temp_history[sattr->index], sattr->nr, &val);
+	if (ret < 0)
+		return ret;
+
+	return sysfs_emit(buf, "%ld\n", val * 1000);
+}
+
+static ssize_t fan_history_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	long val;
+	int ret;
+
+	ret = ekloco_history_get(ekloco, &ekloco->fan_history[sattr->index], sattr->nr, &val);
+	if (ret < 0)
+		return ret;
+
+	return sysfs_emit(buf, "%ld\n", val);
+}
+
+static ssize_t fan_reset_history_store(struct device *dev, struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val != 1)
+		return -EINVAL;
+
+	// Index past the last channel resets all of them.
+	if (sattr->index > NUM_FANS)
+		ekloco_history_reset(ekloco, ekloco->fan_history, NUM_FANS + 1);
+	else
+		ekloco_history_reset(ekloco, &ekloco->fan_history[sattr->index], 1);
+
+	return count;
+}
+
+#define EKLOCO_FAN_HISTORY_ATTRS(n)							\
+	static SENSOR_DEVICE_ATTR_2_RO(fan##n##_lowest, fan_history, HISTORY_LOWEST, n - 1);	\
+	static SENSOR_DEVICE_ATTR_2_RO(fan##n##_highest, fan_history, HISTORY_HIGHEST, n - 1);	\
+	static SENSOR_DEVICE_ATTR_2_RO(fan##n##_average, fan_history, HISTORY_AVERAGE, n - 1);	\
+	static SENSOR_DEVICE_ATTR_WO(fan##n##_reset_history, fan_reset_history, n - 1)
+
+#define EKLOCO_FAN_HISTORY_ATTR_LIST(n)					\
+	&sensor_dev_attr_fan##n##_lowest.dev_attr.attr,			\
+	&sensor_dev_attr_fan##n##_highest.dev_attr.attr,		\
+	&sensor_dev_attr_fan##n##_average.dev_attr.attr,		\
+	&sensor_dev_attr_fan##n##_reset_history.dev_attr.attr
+
+static SENSOR_DEVICE_ATTR_2_RO(temp1_average, temp_history, HISTORY_AVERAGE, 0);
+static SENSOR_DEVICE_ATTR_2_RO(temp2_average, temp_history, HISTORY_AVERAGE, 1);
+static SENSOR_DEVICE_ATTR_2_RO(temp3_average, temp_history, HISTORY_AVERAGE, 2);
+EKLOCO_FAN_HISTORY_ATTRS(1);
+EKLOCO_FAN_HISTORY_ATTRS(2);
+EKLOCO_FAN_HISTORY_ATTRS(3);
+EKLOCO_FAN_HISTORY_ATTRS(4);
+EKLOCO_FAN_HISTORY_ATTRS(5);
+EKLOCO_FAN_HISTORY_ATTRS(6);
+EKLOCO_FAN_HISTORY_ATTRS(7);
+static SENSOR_DEVICE_ATTR_WO(fan_reset_history, fan_reset_history, NUM_FANS + 1);
+
+enum ekloco_filter_channel {
+	FILTER_TEMP,
+	FILTER_FAN,
+};
+
+static struct ekloco_filter *ekloco_filter_of(struct ekloco_device *ekloco,
+					      struct sensor_device_attribute_2 *sattr)
+{
+	if (sattr->nr == FILTER_TEMP)
+		return &ekloco->temp_filter[sattr->index];
+	return &ekloco->fan_filter[sattr->index];
+}
+
+static ssize_t filter_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct ekloco_filter *filter = ekloco_filter_of(ekloco, to_sensor_dev_attr_2(attr));
+	enum ekloco_filter_type type;
+	unsigned int param;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	type = filter->type;
+	param = filter->param;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	if (type == FILTER_NONE)
+		return sysfs_emit(buf, "%s\n", filter_names[type]);
+
+	return sysfs_emit(buf, "%s %u\n", filter_names[type], param);
+}
+
+/*
+ * Accepts "none", "ema [alpha]" with alpha in 1/1000 (1-1000) or "median [n]" with a window
+ * of 1-9 readings. Changing the filter restarts it from the next reading.
+ */
+static ssize_t filter_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct ekloco_filter *filter = ekloco_filter_of(ekloco, to_sensor_dev_attr_2(attr));
+	unsigned long flags;
+	unsigned int param;
+	char name[8];
+	int type;
+	int n;
+
+	n = sscanf(buf, "%7s %u", name, &param);
+	if (n < 1)
+		return -EINVAL;
+
+	type = match_string(filter_names, ARRAY_SIZE(filter_names), name);
+	if (type < 0)
+		return type;
+
+	switch (type) {
+	case FILTER_NONE:
+		param = 0;
+		break;
+	case FILTER_EMA:
+		if (n < 2)
+			param = FILTER_EMA_DEFAULT;
+		if (param < 1 || param > FILTER_SCALE)
+			return -EINVAL;
+		break;
+	case FILTER_MEDIAN:
+		if (n < 2)
+			param = FILTER_MEDIAN_DEFAULT;
+		if (param < 1 || param > FILTER_MEDIAN_MAX)
+			return -EINVAL;
+		break;
+	}
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	filter->type = type;
+	filter->param = param;
+	filter->count = 0;
+	filter->pos = 0;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	return count;
+}
+
+static ssize_t input_filtered_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ekloco_filter *filter = ekloco_filter_of(ekloco, sattr);
+	unsigned long flags;
+	unsigned int count;
+	long val;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	count = filter->count;
+	val = filter->output;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	if (!count)
+		return -ENODATA;
+
+	// Filtered temperature is already in millidegrees, the rest goes back to raw units.
+	if (sattr->nr == FILTER_FAN)
+		val = DIV_ROUND_CLOSEST(val, FILTER_SCALE);
+
+	return sysfs_emit(buf, "%ld\n", val);
+}
+
+#define EKLOCO_FILTER_ATTRS(type, n, nr)							\
+	static SENSOR_DEVICE_ATTR_2_RW(type##n##_filter, filter, nr, n - 1);			\
+	static SENSOR_DEVICE_ATTR_2_RO(type##n##_input_filtered, input_filtered, nr, n - 1)
+
+#define EKLOCO_FILTER_ATTR_LIST(type, n)				\
+	&sensor_dev_attr_##type##n##_filter.dev_attr.attr,		\
+	&sensor_dev_attr_##type##n##_input_filtered.dev_attr.attr
+
+EKLOCO_FILTER_ATTRS(temp, 1, FILTER_TEMP);
+EKLOCO_FILTER_ATTRS(temp, 2, FILTER_TEMP);
+EKLOCO_FILTER_ATTRS(temp, 3, FILTER_TEMP);
+EKLOCO_FILTER_ATTRS(fan, 1, FILTER_FAN);
+EKLOCO_FILTER_ATTRS(fan, 2, FILTER_FAN);
+EKLOCO_FILTER_ATTRS(fan, 3, FILTER_FAN);
+EKLOCO_FILTER_ATTRS(fan, 4, FILTER_FAN);
+EKLOCO_FILTER_ATTRS(fan, 5, FILTER_FAN);
+EKLOCO_FILTER_ATTRS(fan, 6, FILTER_FAN);
+EKLOCO_FILTER_ATTRS(fan, 7, FILTER_FAN);
+
+/*
+ * hwmon only knows a single update_interval. With update_interval_min set below it, each group
+ * of channels is polled between the two and the interval it currently uses is exported.
+ */
+static ssize_t update_interval_min_show(struct device *dev, struct device_attribute *attr,
+					char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(ekloco->update_interval_min));
+}
+
+static ssize_t update_interval_min_store(struct device *dev, struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+
+	if (val)
+		val = clamp_val(val, MIN_UPDATE_INTERVAL, MAX_UPDATE_INTERVAL);
+
+	WRITE_ONCE(ekloco->update_interval_min, val);
+	ekloco_restart_poller(ekloco);
+
+	return count;
+}
+
+static ssize_t rate_interval_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+
+	if (!READ_ONCE(ekloco->update_interval))
+		return sysfs_emit(buf, "0\n");
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(ekloco->rate[sattr->index].interval));
+}
+
+static ssize_t update_slack_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(ekloco->update_slack));
+}
+
+static ssize_t update_slack_store(struct device *dev, struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val > MAX_UPDATE_INTERVAL)
+		return -EINVAL;
+
+	WRITE_ONCE(ekloco->update_slack, val);
+	ekloco_restart_poller(ekloco);
+
+	return count;
+}
+
+static ssize_t poll_wakeups_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(ekloco->poll_wakeups));
+}
+
+static ssize_t update_hrtimer_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(ekloco->update_hrtimer));
+}
+
+static ssize_t update_hrtimer_store(struct device *dev, struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	bool val;
+	int ret;
+
+	ret = kstrtobool(buf, &val);
+	if (ret < 0)
+		return ret;
+
+	WRITE_ONCE(ekloco->update_hrtimer, val);
+	ekloco_restart_poller(ekloco);
+
+	return count;
+}
+
+static ssize_t update_budget_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ekloco->update_budget));
+}
+
+static ssize_t update_budget_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val > NUM_POLL_CHANNELS)
+		return -EINVAL;
+
+	WRITE_ONCE(ekloco->update_budget, val);
+	return count;
+}
+
+// Share of the poller's requests, 0 leaves the channel to direct reads.
+static ssize_t poll_weight_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ekloco->poll_weight[sattr->index]));
+}
+
+static ssize_t poll_weight_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val > POLL_WEIGHT_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(ekloco->poll_weight[sattr->index], val);
+	return count;
+}
+
+static ssize_t max_age_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(ekloco->max_age));
+}
+
+static ssize_t max_age_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val > MAX_UPDATE_INTERVAL)
+		return -EINVAL;
+
+	WRITE_ONCE(ekloco->max_age, val);
+	return count;
+}
+
+static ssize_t age_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	s64 age;
+	int ret;
+
+	ret = ekloco_cache_age(ekloco, sattr->index, &age);
+	if (ret < 0)
+		return ret;
+
+	return sysfs_emit(buf, "%lld\n", age);
+}
+
+/*
+ * Accepts "N:PWM" pairs for any of fans 1-6, separated by spaces, and sets them all at once.
+ * Nothing is sent unless every pair is valid.
+ */
+static ssize_t pwm_burst_store(struct device *dev, struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	long target[NUM_FANS];
+	unsigned long mask = 0;
+	unsigned int channel;
+	char *str, *pos, *tok, *field;
+	int ret = 0;
+	long pwm;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	pos = strim(str);
+	while ((tok = strsep(&pos, " \t")) != NULL) {
+		if (!*tok)
+			continue;
+		// sscanf would accept trailing garbage after either number.
+		field = strsep(&tok, ":");
+		if (!tok || kstrtouint(field, 10, &channel) || kstrtol(tok, 10, &pwm) ||
+		    channel < 1 || channel > NUM_FANS) {
+			ret = -EINVAL;
+			goto out_free;
+		}
+		target[channel - 1] = ekloco_clamp_duty(ekloco, channel - 1, pwm);
+		mask |= BIT(channel - 1);
+	}
+
+	if (!mask) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	ret = set_fan_pwm_burst(ekloco, mask, target);
+	if (!ret)
+		ekloco_step_start(ekloco, mask);
+
+out_free:
+	kfree(str);
+	return ret < 0 ? ret : count;
+}
+
+static ssize_t calibrate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+
+	return sysfs_emit(buf, "%d\n", test_bit(sattr->index, &ekloco->calibrate_pending) ||
+			  test_bit(sattr->index, &ekloco->calibrating));
+}
+
+static ssize_t calibrate_store(struct device *dev, struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val != 1)
+		return -EINVAL;
+
+	ekloco_calibrate(ekloco, BIT(sattr->index));
+	return count;
+}
+
+// "spinup stall rpm...", with the speeds at duties 0, 26, 51, ... 255.
+static ssize_t curve_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	struct ekloco_fan_curve curve;
+	unsigned long flags;
+	int len;
+	int i;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	curve = ekloco->fan_curve[sattr->index];
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	if (!curve.valid)
+		return -ENODATA;
+
+	len = sysfs_emit(buf, "%u %u", curve.spinup, curve.stall);
+	for (i = 0; i < CURVE_POINTS; i++)
+		len += sysfs_emit_at(buf, len, " %u", curve.rpm[i]);
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+// Restores a curve in the format curve_show prints, "clear" drops it.
+static ssize_t curve_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	struct ekloco_fan_curve curve = { };
+	unsigned int val[2 + CURVE_POINTS];
+	unsigned long flags;
+	char *str, *pos, *tok;
+	int ret = 0;
+	int n = 0;
+
+	if (sysfs_streq(buf, "clear"))
+		goto out_store;
+
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	pos = strim(str);
+	while ((tok = strsep(&pos, " \t")) != NULL) {
+		if (!*tok)
+			continue;
+		if (n == ARRAY_SIZE(val) || kstrtouint(tok, 10, &val[n++])) {
+			ret = -EINVAL;
+			break;
+		}
+	}
+	kfree(str);
+
+	if (ret < 0 || n != ARRAY_SIZE(val) || val[0] > 255 || val[1] > 255)
+		return -EINVAL;
+
+	curve.spinup = val[0];
+	curve.stall = val[1];
+	for (n = 0; n < CURVE_POINTS; n++) {
+		if (val[2 + n] > U16_MAX)
+			return -EINVAL;
+		curve.rpm[n] = val[2 + n];
+	}
+	curve.valid = true;
+
+out_store:
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	ekloco->fan_curve[sattr->index] = curve;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	return count;
+}
+
+static ssize_t step_response_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	struct ekloco_step_stats stats;
+	unsigned long flags;
+	u64 mean = 0;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	stats = ekloco->step_stats[sattr->index];
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	if (stats.count)
+		mean = div64_u64(stats.settle_sum, stats.count);
+
+	return sysfs_emit(buf, "count %llu timeouts %llu settle %u overshoot %ld rpm %ld "
+			  "settle_mean %llu settle_max %u\n", stats.count, stats.timeouts,
+			  stats.settle_last, stats.overshoot_last, stats.rpm_last, mean,
+			  stats.settle_max);
+}
+
+static ssize_t step_response_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	unsigned long flags;
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val != 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	memset(&ekloco->step_stats[sattr->index], 0, sizeof(ekloco->step_stats[0]));
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	return count;
+}
+
+static ssize_t stall_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	struct ekloco_stall stall;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	stall = ekloco->stall[sattr->index];
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+
+	return sysfs_emit(buf, "stalls %llu recovered %llu failed %llu\n", stall.stalls,
+			  stall.recovered, stall.failed);
+}
+
+#define EKLOCO_FAN_CONTROL_ATTRS(n)								\
+	static SENSOR_DEVICE_ATTR_RW(fan##n##_calibrate, calibrate, n - 1);		\
+	static SENSOR_DEVICE_ATTR_RW(fan##n##_curve, curve, n - 1);			\
+	static SENSOR_DEVICE_ATTR_RW(fan##n##_step_response, step_response, n - 1);	\
+	static SENSOR_DEVICE_ATTR_RO(fan##n##_stall, stall, n - 1)
+
+#define EKLOCO_FAN_CONTROL_ATTR_LIST(n)					\
+	&sensor_dev_attr_fan##n##_calibrate.dev_attr.attr,		\
+	&sensor_dev_attr_fan##n##_curve.dev_attr.attr,			\
+	&sensor_dev_attr_fan##n##_step_response.dev_attr.attr,		\
+	&sensor_dev_attr_fan##n##_stall.dev_attr.attr
+
+EKLOCO_FAN_CONTROL_ATTRS(1);
+EKLOCO_FAN_CONTROL_ATTRS(2);
+EKLOCO_FAN_CONTROL_ATTRS(3);
+EKLOCO_FAN_CONTROL_ATTRS(4);
+EKLOCO_FAN_CONTROL_ATTRS(5);
+EKLOCO_FAN_CONTROL_ATTRS(6);
+
+static ssize_t stall_boost_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(ekloco->stall_boost));
+}
+
+static ssize_t stall_boost_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 10, &val);
+	if (ret < 0)
+		return ret;
+	if (val > 255)
+		return -EINVAL;
+
+	WRITE_ONCE(ekloco->stall_boost, val);
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_interval_min);
+static DEVICE_ATTR_RW(stall_boost);
+static DEVICE_ATTR_WO(pwm_burst);
+static DEVICE_ATTR_RW(max_age);
+static SENSOR_DEVICE_ATTR_RO(sensors_age, age, POLL_SENSORS);
+static SENSOR_DEVICE_ATTR_RO(fan1_age, age, POLL_FAN1);
+static SENSOR_DEVICE_ATTR_RO(fan2_age, age, POLL_FAN1 + 1);
+static SENSOR_DEVICE_ATTR_RO(fan3_age, age, POLL_FAN1 + 2);
+static SENSOR_DEVICE_ATTR_RO(fan4_age, age, POLL_FAN1 + 3);
+static SENSOR_DEVICE_ATTR_RO(fan5_age, age, POLL_FAN1 + 4);
+static SENSOR_DEVICE_ATTR_RO(fan6_age, age, POLL_FAN1 + 5);
+static DEVICE_ATTR_RW(update_budget);
+static SENSOR_DEVICE_ATTR_RW(sensors_weight, poll_weight, POLL_SENSORS);
+static SENSOR_DEVICE_ATTR_RW(fan1_weight, poll_weight, POLL_FAN1);
+static SENSOR_DEVICE_ATTR_RW(fan2_weight, poll_weight, POLL_FAN1 + 1);
+static SENSOR_DEVICE_ATTR_RW(fan3_weight, poll_weight, POLL_FAN1 + 2);
+static SENSOR_DEVICE_ATTR_RW(fan4_weight, poll_weight, POLL_FAN1 + 3);
+static SENSOR_DEVICE_ATTR_RW(fan5_weight, poll_weight, POLL_FAN1 + 4);
+static SENSOR_DEVICE_ATTR_RW(fan6_weight, poll_weight, POLL_FAN1 + 5);
+static DEVICE_ATTR_RW(update_slack);
+static DEVICE_ATTR_RW(update_hrtimer);
+static DEVICE_ATTR_RO(poll_wakeups);
+static SENSOR_DEVICE_ATTR_RO(sensors_update_interval, rate_interval, RATE_SENSORS);
+static SENSOR_DEVICE_ATTR_RO(fans_update_interval, rate_interval, RATE_FANS);
+
+static struct attribute *ekloco_attrs[] = {
+	&dev_attr_pwm_burst.attr,
+	&dev_attr_stall_boost.attr,
+	EKLOCO_FAN_CONTROL_ATTR_LIST(1),
+	EKLOCO_FAN_CONTROL_ATTR_LIST(2),
+	EKLOCO_FAN_CONTROL_ATTR_LIST(3),
+	EKLOCO_FAN_CONTROL_ATTR_LIST(4),
+	EKLOCO_FAN_CONTROL_ATTR_LIST(5),
+	EKLOCO_FAN_CONTROL_ATTR_LIST(6),
+	&dev_attr_update_interval_min.attr,
+	&dev_attr_max_age.attr,
+	&sensor_dev_attr_sensors_age.dev_attr.attr,
+	&sensor_dev_attr_fan1_age.dev_attr.attr,
+	&sensor_dev_attr_fan2_age.dev_attr.attr,
+	&sensor_dev_attr_fan3_age.dev_attr.attr,
+	&sensor_dev_attr_fan4_age.dev_attr.attr,
+	&sensor_dev_attr_fan5_age.dev_attr.attr,
+	&sensor_dev_attr_fan6_age.dev_attr.attr,
+	&dev_attr_update_budget.attr,
+	&sensor_dev_attr_sensors_weight.dev_attr.attr,
+	&sensor_dev_attr_fan1_weight.dev_attr.attr,
+	&sensor_dev_attr_fan2_weight.dev_attr.attr,
+	&sensor_dev_attr_fan3_weight.dev_attr.attr,
+	&sensor_dev_attr_fan4_weight.dev_attr.attr,
+	&sensor_dev_attr_fan5_weight.dev_attr.attr,
+	&sensor_dev_attr_fan6_weight.dev_attr.attr,
+	&dev_attr_update_slack.attr,
+	&dev_attr_update_hrtimer.attr,
+	&dev_attr_poll_wakeups.attr,
+	&sensor_dev_attr_sensors_update_interval.dev_attr.attr,
+	&sensor_dev_attr_fans_update_interval.dev_attr.attr,
+	&sensor_dev_attr_temp1_average.dev_attr.attr,
+	&sensor_dev_attr_temp2_average.dev_attr.attr,
+	&sensor_dev_attr_temp3_average.dev_attr.attr,
+	EKLOCO_FAN_HISTORY_ATTR_LIST(1),
+	EKLOCO_FAN_HISTORY_ATTR_LIST(2),
+	EKLOCO_FAN_HISTORY_ATTR_LIST(3),
+	EKLOCO_FAN_HISTORY_ATTR_LIST(4),
+	EKLOCO_FAN_HISTORY_ATTR_LIST(5),
+	EKLOCO_FAN_HISTORY_ATTR_LIST(6),
+	EKLOCO_FAN_HISTORY_ATTR_LIST(7),
+	&sensor_dev_attr_fan_reset_history.dev_attr.attr,
+	EKLOCO_FILTER_ATTR_LIST(temp, 1),
+	EKLOCO_FILTER_ATTR_LIST(temp, 2),
+	EKLOCO_FILTER_ATTR_LIST(temp, 3),
+	EKLOCO_FILTER_ATTR_LIST(fan, 1),
+	EKLOCO_FILTER_ATTR_LIST(fan, 2),
+	EKLOCO_FILTER_ATTR_LIST(fan, 3),
+	EKLOCO_FILTER_ATTR_LIST(fan, 4),
+	EKLOCO_FILTER_ATTR_LIST(fan, 5),
+	EKLOCO_FILTER_ATTR_LIST(fan, 6),
+	EKLOCO_FILTER_ATTR_LIST(fan, 7),
+	NULL
+};
+
+ATTRIBUTE_GROUPS(ekloco);
+
+
+
+/*
+ * Kconfig selects the triggered buffer whenever IIO is enabled, and keeps the driver from being
+ * built in with IIO as a module.
+ */
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+
+#define EKLOCO_IIO_SCAN_FLOW	NUM_TEMP_SENSORS
+#define EKLOCO_IIO_SCAN_RPM	(EKLOCO_IIO_SCAN_FLOW + 1)
+#define EKLOCO_IIO_SCAN_PWM	(EKLOCO_IIO_SCAN_RPM + NUM_FANS)
+#define EKLOCO_IIO_NUM_SCAN	(EKLOCO_IIO_SCAN_PWM + NUM_FANS)
+
+#define EKLOCO_IIO_CHAN(_type, _index, _scan_index, _name, _mask) {	\
+	.type = _type,							\
+	.indexed = 1,							\
+	.channel = _index,						\
+	.extend_name = _name,						\
+	.info_mask_separate = _mask,					\
+	.scan_index = _scan_index,					\
+	.scan_type = {							\
+		.sign = 'u',						\
+		.realbits = 16,						\
+		.storagebits = 16,					\
+		.endianness = IIO_CPU,					\
+	},								\
+}
+
+#define EKLOCO_IIO_TEMP(i)						\
+	EKLOCO_IIO_CHAN(IIO_TEMP, i, i, NULL,				\
+			BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE))
+#define EKLOCO_IIO_RPM(i)						\
+	EKLOCO_IIO_CHAN(IIO_ANGL_VEL, i, EKLOCO_IIO_SCAN_RPM + i, NULL,	\
+			BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE))
+#define EKLOCO_IIO_PWM(i)						\
+	EKLOCO_IIO_CHAN(IIO_POSITIONRELATIVE, i, EKLOCO_IIO_SCAN_PWM + i, "duty", \
+			BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE))
+
+/*
+ * IIO has no channel types for coolant flow or fan duty, so flow is exported as velocity in l/h
+ * and duty as relative position, due to lack of better options. Fan speed is reported in RPM,
+ * the scale converts to the rad/s expected for angular velocity.
+ */
+static const struct iio_chan_spec ekloco_iio_channels[] = {
+	EKLOCO_IIO_TEMP(0),
+	EKLOCO_IIO_TEMP(1),
+	EKLOCO_IIO_TEMP(2),
+	EKLOCO_IIO_CHAN(IIO_VELOCITY, 0, EKLOCO_IIO_SCAN_FLOW, "flow", BIT(IIO_CHAN_INFO_RAW)),
+	EKLOCO_IIO_RPM(0),
+	EKLOCO_IIO_RPM(1),
+	EKLOCO_IIO_RPM(2),
+	EKLOCO_IIO_RPM(3),
+	EKLOCO_IIO_RPM(4),
+	EKLOCO_IIO_RPM(5),
+	EKLOCO_IIO_PWM(0),
+	EKLOCO_IIO_PWM(1),
+	EKLOCO_IIO_PWM(2),
+	EKLOCO_IIO_PWM(3),
+	EKLOCO_IIO_PWM(4),
+	EKLOCO_IIO_PWM(5),
+	IIO_CHAN_SOFT_TIMESTAMP(EKLOCO_IIO_NUM_SCAN),
+};
+
+// Every trigger reads all channels anyway, let the IIO core pick out the enabled ones.
+static const unsigned long ekloco_iio_scan_masks[] = {
+	GENMASK(EKLOCO_IIO_NUM_SCAN - 1, 0),
+	0
+};
+
+static int ekloco_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+			       int *val, int *val2, long mask)
+{
+	struct ekloco_device *ekloco = iio_device_get_drvdata(indio_dev);
+	struct sensor_result sensors;
+	struct fan_read_result fan;
+	int ret;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		switch (chan->type) {
+		case IIO_TEMP:
+			ret = ekloco_get_sensors(ekloco, &sensors);
+			if (ret < 0)
+				return ret;
+			*val = sensors.temp[chan->channel];
+			return IIO_VAL_INT;
+		case IIO_VELOCITY:
+			ret = ekloco_get_sensors(ekloco, &sensors);
+			if (ret < 0)
+				return ret;
+			*val = sensors.flow_lph;
+			return IIO_VAL_INT;
+		case IIO_ANGL_VEL:
+			ret = ekloco_get_fan(ekloco, chan->channel, &fan);
+			if (ret < 0)
+				return ret;
+			*val = fan.rpm;
+			return IIO_VAL_INT;
+		case IIO_POSITIONRELATIVE:
+			ret = ekloco_get_fan(ekloco, chan->channel, &fan);
+			if (ret < 0)
+				return ret;
+			*val = fan.pwm;
+			return IIO_VAL_INT;
+		default:
+			break;
+		}
+		break;
+	case IIO_CHAN_INFO_SCALE:
+		switch (chan->type) {
+		case IIO_TEMP:
+			// Temperature is reported as degC, IIO expects milli-degC.
+			*val = 1000;
+			return IIO_VAL_INT;
+		case IIO_ANGL_VEL:
+			// 2 * pi / 60
+			*val = 0;
+			*val2 = 104719755;
+			return IIO_VAL_INT_PLUS_NANO;
+		case IIO_POSITIONRELATIVE:
+			// PWM is stored as 0-255, scale to percent.
+			*val = 100;
+			*val2 = 255;
+			return IIO_VAL_FRACTIONAL;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Pushes the last sample the poller published, without any USB traffic. With the driver's own
+ * trigger that is the sample that fired it, any other trigger just repeats the latest one.
+ */
+static irqreturn_t ekloco_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct ekloco_device *ekloco = iio_device_get_drvdata(indio_dev);
+	struct ekloco_sample sample;
+	struct {
+		u16 chans[EKLOCO_IIO_NUM_SCAN];
+		s64 timestamp __aligned(8);
+	} scan;
+	unsigned long flags;
+	bool valid;
+	int i;
+
+	spin_lock_irqsave(&ekloco->sample_lock, flags);
+	sample = ekloco->last_sample;
+	valid = ekloco->last_sample_valid;
+	spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+	if (!valid)
+		goto out;
+
+	memset(&scan, 0, sizeof(scan));
+	for (i = 0; i < NUM_TEMP_SENSORS; i++)
+		scan.chans[i] = sample.sensors.temp[i];
+	scan.chans[EKLOCO_IIO_SCAN_FLOW] = sample.sensors.flow_lph;
+	for (i = 0; i < NUM_FANS; i++) {
+		scan.chans[EKLOCO_IIO_SCAN_RPM + i] = sample.fans[i].rpm;
+		scan.chans[EKLOCO_IIO_SCAN_PWM + i] = sample.fans[i].pwm;
+	}
+
+	// A nested poll skips the top half, so there is no stored time.
+	iio_push_to_buffers_with_timestamp(indio_dev, &scan, iio_get_time_ns(indio_dev));
+
+out:
+	iio_trigger_notify_done(indio_dev->trig);
+	return IRQ_HANDLED;
+}
+
+static const struct iio_info ekloco_iio_info = {
+	.read_raw = ekloco_iio_read_raw,
+};
+
+static int ekloco_iio_register(struct ekloco_device *ekloco)
+{
+	struct iio_trigger *trig;
+	struct iio_dev *indio_dev;
+	int ret;
+
+	indio_dev = devm_iio_device_alloc(&ekloco->hdev->dev, 0);
+	if (!indio_dev)
+		return -ENOMEM;
+
+	indio_dev->name = "ekloopconnect";
+	indio_dev->info = &ekloco_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = ekloco_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(ekloco_iio_channels);
+	indio_dev->available_scan_masks = ekloco_iio_scan_masks;
+	iio_device_set_drvdata(indio_dev, ekloco);
+
+	/*
+	 * Fired from the poller, so the buffer gets every sample at the update_interval rate. It
+	 * outlives the IIO device until the driver detaches, by which time the poller is stopped.
+	 */
+	trig = devm_iio_trigger_alloc(&ekloco->hdev->dev, "%s-dev%d", indio_dev->name,
+				      iio_device_id(indio_dev));
+	if (!trig)
+		return -ENOMEM;
+
+	iio_trigger_set_drvdata(trig, ekloco);
+	ret = devm_iio_trigger_register(&ekloco->hdev->dev, trig);
+	if (ret)
+		return ret;
+
+	ret = iio_triggered_buffer_setup(indio_dev, NULL, ekloco_iio_trigger_handler, NULL);
+	if (ret)
+		return ret;
+
+	indio_dev->trig = iio_trigger_get(trig);
+	WRITE_ONCE(ekloco->iio_trig, trig);
+
+	ret = iio_device_register(indio_dev);
+	if (ret) {
+		iio_triggered_buffer_cleanup(indio_dev);
+		return ret;
+	}
+
+	ekloco->iio_dev = indio_dev;
+	return 0;
+}
+
+static void ekloco_iio_unregister(struct ekloco_device *ekloco)
+{
+	iio_device_unregister(ekloco->iio_dev);
+	iio_triggered_buffer_cleanup(ekloco->iio_dev);
+}
+
+#else
+
+static int ekloco_iio_register(struct ekloco_device *ekloco)
+{
+	return 0;
+}
+
+static void ekloco_iio_unregister(struct ekloco_device *ekloco)
+{
+}
+
+#endif
+
+
+#if IS_ENABLED(CONFIG_PERF_EVENTS)
+
+static DEFINE_IDA(ekloco_pmu_ida);
+
+/*
+ * The readings are gauges, which don't fit the perf model of counting events. Instead, every
+ * event counts the time integral of its value in value*us, the scale turns that into value*s.
+ * With perf stat -I 1000, every interval then shows the average value over that second.
+ */
+#define EKLOCO_PMU_EVENT(_name, _id, _unit)						\
+	PMU_EVENT_ATTR_STRING(_name, ekloco_pmu_event_##_name, "event=" __stringify(_id));	\
+	PMU_EVENT_ATTR_STRING(_name.unit, ekloco_pmu_unit_##_name, _unit);			\
+	PMU_EVENT_ATTR_STRING(_name.scale, ekloco_pmu_scale_##_name, "1e-6")
+
+#define EKLOCO_PMU_EVENT_ATTRS(_name)		\
+	&ekloco_pmu_event_##_name.attr.attr,	\
+	&ekloco_pmu_unit_##_name.attr.attr,	\
+	&ekloco_pmu_scale_##_name.attr.attr
+
+EKLOCO_PMU_EVENT(temp1, 0x00, "degC*s");
+EKLOCO_PMU_EVENT(temp2, 0x01, "degC*s");
+EKLOCO_PMU_EVENT(temp3, 0x02, "degC*s");
+EKLOCO_PMU_EVENT(flow, 0x03, "l/h*s");
+EKLOCO_PMU_EVENT(level, 0x04, "s");
+EKLOCO_PMU_EVENT(fan1, 0x05, "rpm*s");
+EKLOCO_PMU_EVENT(fan2, 0x06, "rpm*s");
+EKLOCO_PMU_EVENT(fan3, 0x07, "rpm*s");
+EKLOCO_PMU_EVENT(fan4, 0x08, "rpm*s");
+EKLOCO_PMU_EVENT(fan5, 0x09, "rpm*s");
+EKLOCO_PMU_EVENT(fan6, 0x0a, "rpm*s");
+EKLOCO_PMU_EVENT(pwm1, 0x0b, "pwm*s");
+EKLOCO_PMU_EVENT(pwm2, 0x0c, "pwm*s");
+EKLOCO_PMU_EVENT(pwm3, 0x0d, "pwm*s");
+EKLOCO_PMU_EVENT(pwm4, 0x0e, "pwm*s");
+EKLOCO_PMU_EVENT(pwm5, 0x0f, "pwm*s");
+EKLOCO_PMU_EVENT(pwm6, 0x10, "pwm*s");
+
+static struct attribute *ekloco_pmu_event_attrs[] = {
+	EKLOCO_PMU_EVENT_ATTRS(temp1),
+	EKLOCO_PMU_EVENT_ATTRS(temp2),
+	EKLOCO_PMU_EVENT_ATTRS(temp3),
+	EKLOCO_PMU_EVENT_ATTRS(flow),
+	EKLOCO_PMU_EVENT_ATTRS(level),
+	EKLOCO_PMU_EVENT_ATTRS(fan1),
+	EKLOCO_PMU_EVENT_ATTRS(fan2),
+	EKLOCO_PMU_EVENT_ATTRS(fan3),
+	EKLOCO_PMU_EVENT_ATTRS(fan4),
+	EKLOCO_PMU_EVENT_ATTRS(fan5),
+	EKLOCO_PMU_EVENT_ATTRS(fan6),
+	EKLOCO_PMU_EVENT_ATTRS(pwm1),
+	EKLOCO_PMU_EVENT_ATTRS(pwm2),
+	EKLOCO_PMU_EVENT_ATTRS(pwm3),
+	EKLOCO_PMU_EVENT_ATTRS(pwm4),
+	EKLOCO_PMU_EVENT_ATTRS(pwm5),
+	EKLOCO_PMU_EVENT_ATTRS(pwm6),
+	NULL
+};
+
+static const struct attribute_group ekloco_pmu_events_group = {
+	.name = "events",
+	.attrs = ekloco_pmu_event_attrs,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *ekloco_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL
+};
+
+static const struct attribute_group ekloco_pmu_format_group = {
+	.name = "format",
+	.attrs = ekloco_pmu_format_attrs,
+};
+
+// The values don't depend on the CPU, make perf open every event only once.
+static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(0));
+}
+
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *ekloco_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL
+};
+
+static const struct attribute_group ekloco_pmu_cpumask_group = {
+	.attrs = ekloco_pmu_cpumask_attrs,
+};
+
+static const struct attribute_group *ekloco_pmu_attr_groups[] = {
+	&ekloco_pmu_events_group,
+	&ekloco_pmu_format_group,
+	&ekloco_pmu_cpumask_group,
+	NULL
+};
+
+static u64 ekloco_pmu_read_counter(struct ekloco_pmu *epmu, int event)
+{
+	unsigned long flags;
+	u64 val;
+
+	spin_lock_irqsave(&epmu->lock, flags);
+	ekloco_pmu_integrate(epmu, ktime_get());
+	val = epmu->integral[event];
+	spin_unlock_irqrestore(&epmu->lock, flags);
+
+	return val;
+}
+
+static void ekloco_pmu_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct ekloco_pmu, ref));
+}
+
+static void ekloco_pmu_event_destroy(struct perf_event *event)
+{
+	struct ekloco_pmu *epmu = container_of(event->pmu, struct ekloco_pmu, pmu);
+
+	kref_put(&epmu->ref, ekloco_pmu_release);
+}
+
+static void ekloco_pmu_event_update(struct perf_event *event)
+{
+	struct ekloco_pmu *epmu = container_of(event->pmu, struct ekloco_pmu, pmu);
+	u64 prev, now;
+
+	now = ekloco_pmu_read_counter(epmu, event->attr.config);
+	prev = local64_xchg(&event->hw.prev_count, now);
+	local64_add(now - prev, &event->count);
+}
+
+static int ekloco_pmu_event_init(struct perf_event *event)
+{
+	struct ekloco_pmu *epmu = container_of(event->pmu, struct ekloco_pmu, pmu);
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	if (event->attr.config >= EKLOCO_PMU_NUM_EVENTS)
+		return -EINVAL;
+
+	// Values only change at the refresh rate, sampling makes no sense.
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK)
+		return -EINVAL;
+
+	if (event->cpu < 0)
+		return -EINVAL;
+
+	kref_get(&epmu->ref);
+	event->destroy = ekloco_pmu_event_destroy;
+
+	return 0;
+}
+
+static void ekloco_pmu_event_start(struct perf_event *event, int flags)
+{
+	struct ekloco_pmu *epmu = container_of(event->pmu, struct ekloco_pmu, pmu);
+
+	local64_set(&event->hw.prev_count, ekloco_pmu_read_counter(epmu, event->attr.config));
+}
+
+static void ekloco_pmu_event_stop(struct perf_event *event, int flags)
+{
+	if (flags & PERF_EF_UPDATE)
+		ekloco_pmu_event_update(event);
+}
+
+static int ekloco_pmu_event_add(struct perf_event *event, int flags)
+{
+	if (flags & PERF_EF_START)
+		ekloco_pmu_event_start(event, flags);
+
+	return 0;
+}
+
+static void ekloco_pmu_event_del(struct perf_event *event, int flags)
+{
+	ekloco_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+static int ekloco_pmu_register(struct ekloco_device *ekloco)
+{
+	struct ekloco_pmu *epmu;
+	int ret;
+
+	epmu = kzalloc(sizeof(*epmu), GFP_KERNEL);
+	if (!epmu)
+		return -ENOMEM;
+
+	kref_init(&epmu->ref);
+	spin_lock_init(&epmu->lock);
+
+	epmu->id = ida_alloc(&ekloco_pmu_ida, GFP_KERNEL);
+	if (epmu->id < 0) {
+		ret = epmu->id;
+		goto out_free;
+	}
+
+	// perf event names are "pmu/event/", keep the common case of a single controller short.
+	if (epmu->id)
+		snprintf(epmu->name, sizeof(epmu->name), "ekloco_%d", epmu->id);
+	else
+		snprintf(epmu->name, sizeof(epmu->name), "ekloco");
+
+	epmu->pmu = (struct pmu) {
+		.module = THIS_MODULE,
+		.task_ctx_nr = perf_invalid_context,
+		.attr_groups = ekloco_pmu_attr_groups,
+		.event_init = ekloco_pmu_event_init,
+		.add = ekloco_pmu_event_add,
+		.del = ekloco_pmu_event_del,
+		.start = ekloco_pmu_event_start,
+		.stop = ekloco_pmu_event_stop,
+		.read = ekloco_pmu_event_update,
+		.capabilities = PERF_PMU_CAP_NO_INTERRUPT | PERF_PMU_CAP_NO_EXCLUDE,
+	};
+
+	ret = perf_pmu_register(&epmu->pmu, epmu->name, -1);
+	if (ret)
+		goto out_ida_free;
+
+	ekloco->pmu = epmu;
+	return 0;
+
+out_ida_free:
+	ida_free(&ekloco_pmu_ida, epmu->id);
+out_free:
+	kfree(epmu);
+	return ret;
+}
+
+// Must be called once nothing stores samples anymore.
+static void ekloco_pmu_unregister(struct ekloco_device *ekloco)
+{
+	struct ekloco_pmu *epmu = ekloco->pmu;
+	unsigned long flags;
+
+	spin_lock_irqsave(&epmu->lock, flags);
+	ekloco_pmu_integrate(epmu, ktime_get());
+	epmu->sample_valid = false;
+	spin_unlock_irqrestore(&epmu->lock, flags);
+
+	perf_pmu_unregister(&epmu->pmu);
+	ida_free(&ekloco_pmu_ida, epmu->id);
+	kref_put(&epmu->ref, ekloco_pmu_release);
+}
+
+#else
+
+static int ekloco_pmu_register(struct ekloco_device *ekloco)
+{
+	return 0;
+}
+
+static void ekloco_pmu_unregister(struct ekloco_device *ekloco)
+{
+}
+
+#endif
+
+
+/*
+ * hidraw compatible character device multiplexing userspace traffic, such as OpenRGB's RGB
+ * requests, with the driver's own. Every write is sent under the device mutex and its reply is
+ * queued for the writer only, so userspace never sees the driver's replies.
+ *
+ * Fan and sensor requests are always answered, so they are sent as a normal transaction. Other
+ * frames, RGB commands among them, may never get a reply: the write only waits
+ * RAW_REPLY_TIMEOUT for one and succeeds either way, like a hidraw write. A reply that comes
+ * later is told apart from the driver's by its header, and still queued for the writer as long
+ * as it comes within REQ_TIMEOUT and nobody wrote such a frame since. A frame that is never
+ * answered just leaves nothing to read.
+ *
+ * Open files can outlive the controller, so the device is refcounted separately and loses its
+ * controller pointer on removal.
+ */
+struct ekloco_chardev {
+	struct miscdevice misc;
+	struct kref kref;
+	struct mutex lock; // protects ekloco, serializes writers
+	struct ekloco_device *ekloco;
+	wait_queue_head_t wait; // shared by all readers, replies are rare
+	int id;
+	char name[16];
+};
+
+struct ekloco_report {
+	u8 data[BUFFER_SIZE];
+};
+
+struct ekloco_client {
+	struct ekloco_chardev *chardev;
+	spinlock_t lock; // protects replies, filled from raw_event
+	DECLARE_KFIFO(replies, struct ekloco_report, CHARDEV_REPLIES);
+};
+
+static DEFINE_IDA(ekloco_chardev_ida);
+
+// Called with xfer_lock held, or from the writer.
+static void ekloco_chardev_queue(struct ekloco_client *client, const u8 *data, int size)
+{
+	struct ekloco_report reply = { };
+	unsigned long flags;
+
+	memcpy(reply.data, data, min(size, BUFFER_SIZE));
+
+	// A reader that fell behind loses the newest reply, the same as with hidraw.
+	spin_lock_irqsave(&client->lock, flags);
+	kfifo_put(&client->replies, reply);
+	spin_unlock_irqrestore(&client->lock, flags);
+	wake_up_interruptible(&client->chardev->wait);
+}
+
+static void ekloco_chardev_forget(struct ekloco_device *ekloco, struct ekloco_client *client)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ekloco->xfer_lock, flags);
+	if (!client || ekloco->reply_client == client)
+		ekloco->reply_client = NULL;
+	spin_unlock_irqrestore(&ekloco->xfer_lock, flags);
+}
+
+/*
+ * Returns 1 with the reply in response, 0 if a frame of a kind the driver doesn't send got none
+ * within RAW_REPLY_TIMEOUT.
+ */
+static int ekloco_raw_transaction(struct ekloco_device *ekloco, struct ekloco_client *client,
+				  const u8 *request, u8 *response)
+{
+	unsigned long flags;
+	bool known;
+	size_t len;
+	int ret;
+
+	known = ekloco_response_header(request, &len);
+
+	mutex_lock(&ekloco->mutex);
+
+	// Set before sending, a reply can come right after the wait.
+	if (!known) {
+		spin_lock_irqsave(&ekloco->xfer_lock, flags);
+		ekloco->reply_client = client;
+		ekloco->reply_until = jiffies + msecs_to_jiffies(REQ_TIMEOUT);
+		spin_unlock_irqrestore(&ekloco->xfer_lock, flags);
+	}
+
+	memcpy(ekloco->buffer, request, BUFFER_SIZE);
+	ret = ekloco->transport->xfer(ekloco);
+	if (!ret) {
+		memcpy(response, ekloco->buffer, BUFFER_SIZE);
+		ret = 1;
+	} else if (ret == -ETIMEDOUT && !known) {
+		ret = 0;
+	}
+
+	mutex_unlock(&ekloco->mutex);
+	return ret;
+}
+
+static void ekloco_chardev_release_kref(struct kref *kref)
+{
+	struct ekloco_chardev *chardev = container_of(kref, struct ekloco_chardev, kref);
+
+	ida_free(&ekloco_chardev_ida, chardev->id);
+	kfree(chardev);
+}
+
+static int ekloco_chardev_open(struct inode *inode, struct file *file)
+{
+	struct ekloco_chardev *chardev = container_of(file->private_data, struct ekloco_chardev,
+						      misc);
+	struct ekloco_client *client;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	client->chardev = chardev;
+	spin_lock_init(&client->lock);
+	INIT_KFIFO(client->replies);
+
+	// misc_open holds the misc lock, so the device can't be deregistered under us.
+	kref_get(&chardev->kref);
+	file->private_data = client;
+
+	return stream_open(inode, file);
+}
+
+static int ekloco_chardev_release(struct inode *inode, struct file *file)
+{
+	struct ekloco_client *client = file->private_data;
+	struct ekloco_chardev *chardev = client->chardev;
+
+	// Late replies must not be queued for a freed client.
+	mutex_lock(&chardev->lock);
+	if (chardev->ekloco)
+		ekloco_chardev_forget(chardev->ekloco, client);
+	mutex_unlock(&chardev->lock);
+
+	kref_put(&chardev->kref, ekloco_chardev_release_kref);
+	kfree(client);
+
+	return 0;
+}
+
+static ssize_t ekloco_chardev_write(struct file *file, const char __user *buf, size_t count,
+				    loff_t *ppos)
+{
+	struct ekloco_client *client = file->private_data;
+	struct ekloco_chardev *chardev = client->chardev;
+	struct ekloco_report request = { };
+	struct ekloco_report reply;
+	size_t offset = 0;
+	u8 first;
+	int ret;
+
+	if (!count || count > BUFFER_SIZE + 1)
+		return -EINVAL;
+
+	// Like usbhid, a leading report number 0 is not part of the report.
+	if (get_user(first, buf))
+		return -EFAULT;
+	if (!first)
+		offset = 1;
+	if (count - offset > BUFFER_SIZE)
+		return -EINVAL;
+
+	if (copy_from_user(request.data, buf + offset, count - offset))
+		return -EFAULT;
+
+	ret = mutex_lock_interruptible(&chardev->lock);
+	if (ret)
+		return ret;
+
+	if (!chardev->ekloco)
+		ret = -ENODEV;
+	else
+		ret = ekloco_raw_transaction(chardev->ekloco, client, request.data, reply.data);
+
+	mutex_unlock(&chardev->lock);
+	if (ret < 0)
+		return ret;
+
+	if (ret)
+		ekloco_chardev_queue(client, reply.data, BUFFER_SIZE);
+
+	return count;
+}
+
+static ssize_t ekloco_chardev_read(struct file *file, char __user *buf, size_t count,
+				   loff_t *ppos)
+{
+	struct ekloco_client *client = file->private_data;
+	struct ekloco_report reply;
+	bool got;
+	int ret;
+
+	for (;;) {
+		spin_lock_irq(&client->lock);
+		got = kfifo_get(&client->replies, &reply);
+		spin_unlock_irq(&client->lock);
+		if (got)
+			break;
+
+		if (!READ_ONCE(client->chardev->ekloco))
+			return -ENODEV;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(client->chardev->wait,
+					       !kfifo_is_empty(&client->replies) ||
+					       !READ_ONCE(client->chardev->ekloco));
+		if (ret)
+			return ret;
+	}
+
+	count = min_t(size_t, count, BUFFER_SIZE);
+	if (copy_to_user(buf, reply.data, count))
+		return -EFAULT;
+
+	return count;
+}
+
+static __poll_t ekloco_chardev_poll(struct file *file, poll_table *wait)
+{
+	struct ekloco_client *client = file->private_data;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(file, &client->chardev->wait, wait);
+
+	if (!kfifo_is_empty(&client->replies))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (!READ_ONCE(client->chardev->ekloco))
+		mask |= EPOLLHUP | EPOLLERR;
+
+	return mask;
 }
 
-static int ekloco_read(struct device *dev, enum hwmon_sensor_types type,
-		       u32 attr, int channel, long *val)
+static int ekloco_chardev_copy_string(void __user *arg, unsigned int len, const char *str)
 {
-	struct ekloco_device *ekloco = dev_get_drvdata(dev);
-	int ret;
+	len = min_t(unsigned int, len, strlen(str) + 1);
+	if (copy_to_user(arg, str, len))
+		return -EFAULT;
 
-	switch (type) {
-	case hwmon_temp:
-		if (channel < 0 || channel >= NUM_TEMP_SENSORS)
-			break;
-		switch (attr) {
-		case hwmon_temp_input:
-			{
-				struct sensor_result result;
-				ret = read_sensors(ekloco, &result);
-				if (ret < 0)
-					return ret;
-				// Temperature is already reported as degC, scale to expected unit.
-				*val = result.temp[channel] * 1000;
-			}
-			return 0;
-		default:
-			break;
-		}
-		break;
-	case hwmon_fan:
-		// Coolant flow meter is exposed as an extra fan.
-		if (channel < 0 || channel >= (NUM_FANS + 1))
-			break;
-		switch (attr) {
-		case hwmon_fan_input:
-			if (channel == NUM_FANS) {
-				struct sensor_result result;
-				ret = read_sensors(ekloco, &result);
-				if (ret < 0)
-					return ret;
-				*val = result.flow_lph;
-			} else {
-				struct fan_read_result result;
-				ret = read_fan_speed(ekloco, channel, &result);
-				if (ret < 0)
-					return ret;
-				*val = result.rpm;
-			}
-			return 0;
-		default:
-			break;
-		}
-		break;
-	case hwmon_pwm:
-		if (channel < 0 || channel >= NUM_FANS)
-			break;
-		switch (attr) {
-		case hwmon_pwm_input:
-			{
-				struct fan_read_result result;
-				ret = read_fan_speed(ekloco, channel, &result);
-				if (ret < 0)
-					return ret;
-				*val = result.pwm;
-			}
-			return 0;
-		default:
-			break;
+	return len;
+}
+
+// The identification ioctls hidapi and OpenRGB use to find and describe a device.
+static long ekloco_chardev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct ekloco_client *client = file->private_data;
+	struct ekloco_chardev *chardev = client->chardev;
+	void __user *user_arg = (void __user *)arg;
+	struct hidraw_devinfo info;
+	struct hid_device *hdev;
+	unsigned int len = _IOC_SIZE(cmd);
+	u32 size;
+	long ret;
+
+	ret = mutex_lock_interruptible(&chardev->lock);
+	if (ret)
+		return ret;
+
+	if (!chardev->ekloco) {
+		ret = -ENODEV;
+		goto out_unlock;
+	}
+	hdev = chardev->ekloco->hdev;
+
+	switch (cmd) {
+	case HIDIOCGRDESCSIZE:
+		ret = put_user(hdev->rsize, (int __user *)user_arg);
+		goto out_unlock;
+	case HIDIOCGRDESC:
+		if (get_user(size, (u32 __user *)user_arg)) {
+			ret = -EFAULT;
+			goto out_unlock;
 		}
-		break;
-	case hwmon_humidity:
-		if (channel != 0)
-			break;
-		switch (attr) {
-		case hwmon_humidity_alarm:
-			{
-				struct sensor_result result;
-				ret = read_sensors(ekloco, &result);
-				if (ret < 0)
-					return ret;
-				*val = !result.level;
-			}
-			return 0;
-		default:
-			break;
+		if (size > HID_MAX_DESCRIPTOR_SIZE) {
+			ret = -EINVAL;
+			goto out_unlock;
 		}
-		break;
-	default:
-		break;
+		size = min_t(u32, size, hdev->rsize);
+		if (copy_to_user(user_arg + offsetof(struct hidraw_report_descriptor, value),
+				 hdev->rdesc, size))
+			ret = -EFAULT;
+		goto out_unlock;
+	case HIDIOCGRAWINFO:
+		info.bustype = hdev->bus;
+		info.vendor = hdev->vendor;
+		info.product = hdev->product;
+		if (copy_to_user(user_arg, &info, sizeof(info)))
+			ret = -EFAULT;
+		goto out_unlock;
 	}
 
-	return -EOPNOTSUPP;
+	if (_IOC_TYPE(cmd) != 'H' || _IOC_DIR(cmd) != _IOC_READ) {
+		ret = -ENOTTY;
+		goto out_unlock;
+	}
+
+	if (_IOC_NR(cmd) == _IOC_NR(HIDIOCGRAWNAME(0)))
+		ret = ekloco_chardev_copy_string(user_arg, len, hdev->name);
+	else if (_IOC_NR(cmd) == _IOC_NR(HIDIOCGRAWPHYS(0)))
+		ret = ekloco_chardev_copy_string(user_arg, len, hdev->phys);
+	else
+		ret = -ENOTTY;
+
+out_unlock:
+	mutex_unlock(&chardev->lock);
+	return ret;
+}
+
+static const struct file_operations ekloco_chardev_fops = {
+	.owner = THIS_MODULE,
+	.open = ekloco_chardev_open,
+	.release = ekloco_chardev_release,
+	.read = ekloco_chardev_read,
+	.write = ekloco_chardev_write,
+	.poll = ekloco_chardev_poll,
+	.unlocked_ioctl = ekloco_chardev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
-static int ekloco_write(struct device *dev, enum hwmon_sensor_types type,
-		        u32 attr, int channel, long val)
+static int ekloco_chardev_register(struct ekloco_device *ekloco)
 {
-	struct ekloco_device *ekloco = dev_get_drvdata(dev);
+	struct ekloco_chardev *chardev;
+	int ret;
 
-	switch (type) {
-	case hwmon_pwm:
-		if (channel < 0 || channel >= NUM_FANS)
-			break;
-		switch (attr) {
-		case hwmon_pwm_input:
-			return set_fan_pwm(ekloco, channel, val);
-		default:
-			break;
-		}
-		break;
-	default:
-		break;
+	chardev = kzalloc(sizeof(*chardev), GFP_KERNEL);
+	if (!chardev)
+		return -ENOMEM;
+
+	chardev->id = ida_alloc(&ekloco_chardev_ida, GFP_KERNEL);
+	if (chardev->id < 0) {
+		ret = chardev->id;
+		goto out_free;
 	}
 
-	return -EOPNOTSUPP;
-};
+	kref_init(&chardev->kref);
+	mutex_init(&chardev->lock);
+	init_waitqueue_head(&chardev->wait);
+	chardev->ekloco = ekloco;
+	snprintf(chardev->name, sizeof(chardev->name), "ekloco%d", chardev->id);
 
+	chardev->misc.minor = MISC_DYNAMIC_MINOR;
+	chardev->misc.name = chardev->name;
+	chardev->misc.fops = &ekloco_chardev_fops;
+	chardev->misc.parent = &ekloco->hdev->dev;
+	chardev->misc.mode = 0600;
 
-static umode_t ekloco_is_visible(const void *data, enum hwmon_sensor_types type,
-			         u32 attr, int channel)
-{
-	switch (type) {
-	case hwmon_temp:
-		if (channel < 0 || channel >= NUM_TEMP_SENSORS)
-			break;
-		switch (attr) {
-		case hwmon_temp_input:
-			return 0444;
-		case hwmon_temp_label:
-			return 0444;
-		default:
-			break;
-		}
-		break;
-	case hwmon_fan:
-		// Coolant flow meter is exposed as an extra fan.
-		if (channel < 0 || channel >= (NUM_FANS + 1))
-			break;
-		switch (attr) {
-		case hwmon_fan_input:
-			return 0444;
-		case hwmon_fan_label:
-			return 0444;
-		default:
-			break;
-		}
-		break;
-	case hwmon_pwm:
-		if (channel < 0 || channel >= NUM_FANS)
-			break;
-		switch (attr) {
-		case hwmon_pwm_input:
-			return 0644;
-		default:
-			break;
-		}
-		break;
-	// Coolant level sensor exports as humidity.
-	case hwmon_humidity:
-		if (channel != 0)
-			break;
-		switch (attr) {
-		case hwmon_humidity_label:
-			return 0444;
-		case hwmon_humidity_alarm:
-			return 0444;
-		default:
-			break;
-		}
-		break;
-	default:
-		break;
-	}
+	ret = misc_register(&chardev->misc);
+	if (ret)
+		goto out_ida_free;
 
+	ekloco->chardev = chardev;
 	return 0;
+
+out_ida_free:
+	ida_free(&ekloco_chardev_ida, chardev->id);
+out_free:
+	kfree(chardev);
+	return ret;
 }
 
+static void ekloco_chardev_unregister(struct ekloco_device *ekloco)
+{
+	struct ekloco_chardev *chardev = ekloco->chardev;
 
-static const struct hwmon_ops ekloco_hwmon_ops = {
-	.is_visible = ekloco_is_visible,
-	.read = ekloco_read,
-	.read_string = ekloco_read_string,
-	.write = ekloco_write,
-};
+	misc_deregister(&chardev->misc);
 
+	// Waits for a write in flight, later calls on open files fail with -ENODEV.
+	mutex_lock(&chardev->lock);
+	WRITE_ONCE(chardev->ekloco, NULL);
+	ekloco_chardev_forget(ekloco, NULL);
+	mutex_unlock(&chardev->lock);
+	wake_up_interruptible_all(&chardev->wait);
 
-static const struct hwmon_channel_info *ekloco_info[] = {
-	HWMON_CHANNEL_INFO(chip,
-			   HWMON_C_REGISTER_TZ),
-	HWMON_CHANNEL_INFO(temp,
-			   HWMON_T_INPUT | HWMON_T_LABEL,
-			   HWMON_T_INPUT | HWMON_T_LABEL,
-			   HWMON_T_INPUT | HWMON_T_LABEL
-			   ),
-	HWMON_CHANNEL_INFO(fan,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL,
-			   HWMON_F_INPUT | HWMON_F_LABEL
-			   ),
-	HWMON_CHANNEL_INFO(pwm,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT
-			   ),
-	// Coolant level is exposed as humidity alarm, due to lack of better options.
-	HWMON_CHANNEL_INFO(humidity,
-			   HWMON_H_LABEL | HWMON_H_ALARM
-			   ),
-	NULL
-};
+	kref_put(&chardev->kref, ekloco_chardev_release_kref);
+}
 
-static const struct hwmon_chip_info ekloco_chip_info = {
-	.ops = &ekloco_hwmon_ops,
-	.info = ekloco_info,
-};
 
+/*
+ * The controller exposes 2 interfaces, we only talk to interface 0. Emulated controllers (uhid)
+ * have no USB interface and are always treated as interface 0.
+ */
+static bool ekloco_is_control_interface(struct hid_device *hdev)
+{
+	struct usb_interface *usbif;
+
+	if (!hid_is_usb(hdev))
+		return true;
+
+	usbif = to_usb_interface(hdev->dev.parent);
+	return usbif->cur_altsetting->desc.bInterfaceNumber == 0;
+}
+
+// Everything not tied to the transport, shared with the KUnit tests.
+static void ekloco_device_init(struct ekloco_device *ekloco)
+{
+	int i;
+
+	mutex_init(&ekloco->mutex);
+	mutex_init(&ekloco->poll_mutex);
+	seqcount_mutex_init(&ekloco->cache_seq, &ekloco->mutex);
+	mutex_init(&ekloco->capture_mutex);
+	spin_lock_init(&ekloco->sample_lock);
+	spin_lock_init(&ekloco->capture_lock);
+	spin_lock_init(&ekloco->jitter_lock);
+	spin_lock_init(&ekloco->xfer_lock);
+	init_waitqueue_head(&ekloco->capture_wait);
+	init_completion(&ekloco->wait_input_report);
+	INIT_DELAYED_WORK(&ekloco->refresh_work, ekloco_refresh_work);
+	INIT_DEFERRABLE_WORK(&ekloco->refresh_work_deferrable, ekloco_refresh_work_deferrable);
+	INIT_WORK(&ekloco->poll_timer_work, ekloco_poll_timer_work);
+	INIT_WORK(&ekloco->calibrate_work, ekloco_calibrate_work);
+	INIT_DELAYED_WORK(&ekloco->step_work, ekloco_step_work);
+	INIT_DELAYED_WORK(&ekloco->stall_work, ekloco_stall_work);
+	init_waitqueue_head(&ekloco->calibrate_wait);
+	for (i = 0; i < NUM_POLL_CHANNELS; i++)
+		ekloco->poll_weight[i] = POLL_WEIGHT_DEFAULT;
+	hrtimer_setup(&ekloco->poll_timer, ekloco_poll_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+}
+
+/*
+ * Counterpart of ekloco_device_init(), cancels every work and timer. Must be called once there
+ * are no more sysfs writers, so the poller and characterization can't be restarted anymore.
+ */
+static void ekloco_device_stop(struct ekloco_device *ekloco)
+{
+	unsigned long flags;
+	bool boosting;
+	long duty;
+	int channel;
+
+	mutex_lock(&ekloco->poll_mutex);
+	WRITE_ONCE(ekloco->update_interval, 0);
+	ekloco_stop_poller(ekloco);
+	mutex_unlock(&ekloco->poll_mutex);
+	WRITE_ONCE(ekloco->calibrate_stop, true);
+	wake_up_all(&ekloco->calibrate_wait);
+	cancel_work_sync(&ekloco->calibrate_work);
+	cancel_delayed_work_sync(&ekloco->step_work);
+	WRITE_ONCE(ekloco->stall_boost, 0);
+	cancel_delayed_work_sync(&ekloco->stall_work);
+
+	// A fan left mid-boost would stay at the boost duty.
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		spin_lock_irqsave(&ekloco->sample_lock, flags);
+		boosting = ekloco->stall[channel].state == STALL_BOOSTING;
+		duty = ekloco->stall[channel].duty;
+		spin_unlock_irqrestore(&ekloco->sample_lock, flags);
+		if (boosting)
+			set_fan_pwm(ekloco, channel, duty);
+	}
+}
 
 static int ekloco_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	struct ekloco_device *ekloco;
 	int ret;
 
-	// The controller exposes 2 interfaces, we only talk to interface 0.
-	struct usb_interface *usbif = to_usb_interface(hdev->dev.parent);
-	if (usbif->cur_altsetting->desc.bInterfaceNumber != 0) {
+	if (!ekloco_is_control_interface(hdev)) {
 		hid_set_drvdata(hdev, NULL);
 		return 0;
 	}
@@ -525,22 +4331,47 @@ static int ekloco_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		goto out_hw_stop;
 
 	ekloco->hdev = hdev;
+	ekloco->transport = &ekloco_hid_transport;
 	hid_set_drvdata(hdev, ekloco);
-	mutex_init(&ekloco->mutex);
-	init_completion(&ekloco->wait_input_report);
+	ekloco_device_init(ekloco);
+
+	ekloco_debugfs_init(ekloco);
 
 	hid_device_io_start(hdev);
 
+	// Before anything that can start refreshing, every sample is handed to the PMU.
+	ret = ekloco_pmu_register(ekloco);
+	if (ret)
+		goto out_debugfs_exit;
+
 	ekloco->hwmon_dev = hwmon_device_register_with_info(&hdev->dev, "ekloopconnect",
-							 ekloco, &ekloco_chip_info, 0);
+							 ekloco, &ekloco_chip_info, ekloco_groups);
 	if (IS_ERR(ekloco->hwmon_dev)) {
 		ret = PTR_ERR(ekloco->hwmon_dev);
-		goto out_hw_close;
+		goto out_pmu_unregister;
 	}
 
+	ret = ekloco_iio_register(ekloco);
+	if (ret)
+		goto out_hwmon_unregister;
+
+	ret = ekloco_chardev_register(ekloco);
+	if (ret)
+		goto out_iio_unregister;
+
+	if (calibrate)
+		ekloco_calibrate(ekloco, GENMASK(NUM_FANS - 1, 0));
+
 	return 0;
 
-out_hw_close:
+out_iio_unregister:
+	ekloco_iio_unregister(ekloco);
+out_hwmon_unregister:
+	hwmon_device_unregister(ekloco->hwmon_dev);
+out_pmu_unregister:
+	ekloco_pmu_unregister(ekloco);
+out_debugfs_exit:
+	ekloco_debugfs_exit(ekloco);
 	hid_hw_close(hdev);
 out_hw_stop:
 	hid_hw_stop(hdev);
@@ -550,12 +4381,16 @@ out_hw_stop:
 static void ekloco_remove(struct hid_device *hdev)
 {
 	struct ekloco_device *ekloco = hid_get_drvdata(hdev);
-	struct usb_interface *usbif = to_usb_interface(hdev->dev.parent);
-	if (usbif->cur_altsetting->desc.bInterfaceNumber != 0) {
+	if (!ekloco_is_control_interface(hdev)) {
 		return;
 	}
 
+	ekloco_chardev_unregister(ekloco);
+	ekloco_iio_unregister(ekloco);
 	hwmon_device_unregister(ekloco->hwmon_dev);
+	ekloco_device_stop(ekloco);
+	ekloco_pmu_unregister(ekloco);
+	ekloco_debugfs_exit(ekloco);
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
 }
@@ -578,12 +4413,28 @@ MODULE_LICENSE("GPL");
 
 static int __init ekloco_init(void)
 {
-	return hid_register_driver(&ekloco_driver);
+	int ret;
+
+	ret = genl_register_family(&ekloco_genl_family);
+	if (ret)
+		return ret;
+
+	ekloco_debugfs_root = debugfs_create_dir("ek-loop-connect", NULL);
+
+	ret = hid_register_driver(&ekloco_driver);
+	if (ret) {
+		debugfs_remove_recursive(ekloco_debugfs_root);
+		genl_unregister_family(&ekloco_genl_family);
+	}
+
+	return ret;
 }
 
 static void __exit ekloco_exit(void)
 {
 	hid_unregister_driver(&ekloco_driver);
+	debugfs_remove_recursive(ekloco_debugfs_root);
+	genl_unregister_family(&ekloco_genl_family);
 }
 
 /*
@@ -592,3 +4443,7 @@ static void __exit ekloco_exit(void)
  */
 late_initcall(ekloco_init);
 module_exit(ekloco_exit);
+
+#if IS_ENABLED(CONFIG_SENSORS_EK_LOOP_CONNECT_KUNIT_TEST)
+#include "ek-loop-connect_kunit.c"
+#endif
@@ -0,0 +1,651 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ek-loop-connect_kunit.c - KUnit tests for the EK Loop Connect driver
+ *
+ * Included at the end of ek-loop-connect.c, so the static protocol, cache and poller functions
+ * can be tested as they are. A fake transport answers requests the way the controller does, so
+ * neither hardware nor a USB stack is needed. With module/ copied or linked to
+ * drivers/hwmon/ek-loop-connect in a kernel tree and hooked into its Kconfig and Makefile as
+ * README.md describes, from the top of that tree:
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/hwmon/ek-loop-connect
+ *
+ * The bench cases time the hot paths per operation and print the results. Their limits are far
+ * above what any machine needs and only catch gross regressions, compare the printed numbers
+ * between runs for anything finer.
+ */
+
+#include <kunit/test.h>
+
+#define TEST_BENCH_OPS		10000
+#define TEST_BENCH_LIMIT_NS	20000
+
+// Controller state the fake transport answers from, in wire units.
+struct ekloco_fake {
+	struct ekloco_device ekloco;
+	struct hid_device hdev;
+	u8 pwm[NUM_FANS];	// 0-100
+	u16 rpm[NUM_FANS];
+	u8 temp[NUM_TEMP_SENSORS];
+	u16 flow_raw;		// l/h divided by 0.8
+	u8 level;
+	int error;		// returned by transfers instead of answering
+	int reply_len;		// of every response, BUFFER_SIZE if 0
+	bool set_as_read;	// answers sets like reads, as a response to another request would
+	unsigned int xfers;
+	unsigned int requests;
+
+	// Results of the bench loops, kept in memory so the work isn't optimized away.
+	struct fan_read_result fan_result;
+	struct sensor_result sensor_result;
+	u8 frame[BUFFER_SIZE];
+};
+
+static struct ekloco_fake *ekloco_to_fake(struct ekloco_device *ekloco)
+{
+	return container_of(ekloco, struct ekloco_fake, ekloco);
+}
+
+static int ekloco_fake_channel(const u8 *req)
+{
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		if (!memcmp(req + CHANNEL_OFFSET, fan_channels[i], CHANNEL_SIZE))
+			return i;
+	}
+
+	return -1;
+}
+
+static void ekloco_fake_put_be16(u8 *buf, u16 val)
+{
+	buf[0] = val >> 8;
+	buf[1] = val & 0xff;
+}
+
+// Replaces the request in buf with the controller's response, see protocol.md.
+static void ekloco_fake_respond(struct ekloco_fake *fake, u8 *buf)
+{
+	static const int temp_offsets[NUM_TEMP_SENSORS] = {
+		SENSOR_T1_OFFSET, SENSOR_T2_OFFSET, SENSOR_T3_OFFSET
+	};
+	u8 req[BUFFER_SIZE];
+	int channel;
+	int i;
+
+	memcpy(req, buf, BUFFER_SIZE);
+	memset(buf, 0, BUFFER_SIZE);
+	fake->requests++;
+
+	if (req[REQ_KIND_OFFSET] == REQ_KIND_SET && !fake->set_as_read) {
+		channel = ekloco_fake_channel(req);
+		if (channel >= 0)
+			fake->pwm[channel] = req[FAN_SET_PWM_OFFSET];
+		memcpy(buf, set_response_header, sizeof(set_response_header));
+		memcpy(buf + SET_RESPONSE_TRAILER_OFFSET, set_response_trailer,
+		       sizeof(set_response_trailer));
+		return;
+	}
+
+	memcpy(buf, read_response_header, sizeof(read_response_header));
+	memcpy(buf + READ_RESPONSE_TRAILER_OFFSET, read_response_trailer,
+	       sizeof(read_response_trailer));
+
+	if (!memcmp(req + CHANNEL_OFFSET, sensor_channel, CHANNEL_SIZE)) {
+		for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+			memcpy(buf + temp_offsets[i] - sizeof(sensor_port_prefix), sensor_port_prefix,
+			       sizeof(sensor_port_prefix));
+			buf[temp_offsets[i]] = fake->temp[i];
+		}
+		ekloco_fake_put_be16(buf + SENSOR_FLOW_OFFSET, fake->flow_raw);
+		memcpy(buf + SENSOR_LEVEL_OFFSET - sizeof(sensor_port_prefix), sensor_port_prefix,
+		       sizeof(sensor_port_prefix));
+		buf[SENSOR_LEVEL_OFFSET] = fake->level;
+		return;
+	}
+
+	channel = ekloco_fake_channel(req);
+	if (channel < 0)
+		return;
+
+	ekloco_fake_put_be16(buf + FAN_READ_RPM_OFFSET, fake->rpm[channel]);
+	buf[FAN_READ_PWM_OFFSET] = fake->pwm[channel];
+}
+
+static int ekloco_fake_xfer(struct ekloco_device *ekloco)
+{
+	struct ekloco_fake *fake = ekloco_to_fake(ekloco);
+
+	fake->xfers++;
+	if (fake->error)
+		return fake->error;
+
+	ekloco_fake_respond(fake, ekloco->buffer);
+	ekloco->reply_len = fake->reply_len ?: BUFFER_SIZE;
+	return 0;
+}
+
+static int ekloco_fake_xfer_burst(struct ekloco_device *ekloco, u8 *frames, int *lens, int count)
+{
+	struct ekloco_fake *fake = ekloco_to_fake(ekloco);
+	int i;
+
+	fake->xfers++;
+	if (fake->error)
+		return fake->error;
+
+	for (i = 0; i < count; i++) {
+		ekloco_fake_respond(fake, frames + i * BUFFER_SIZE);
+		lens[i] = fake->reply_len ?: BUFFER_SIZE;
+	}
+
+	return 0;
+}
+
+static const struct ekloco_transport_ops ekloco_fake_transport = {
+	.xfer = ekloco_fake_xfer,
+	.xfer_burst = ekloco_fake_xfer_burst,
+};
+
+static int ekloco_test_init(struct kunit *test)
+{
+	struct ekloco_fake *fake;
+	struct ekloco_device *ekloco;
+	int i;
+
+	fake = kunit_kzalloc(test, sizeof(*fake), GFP_KERNEL);
+	if (!fake)
+		return -ENOMEM;
+	ekloco = &fake->ekloco;
+
+	ekloco->buffer = kunit_kzalloc(test, BUFFER_SIZE, GFP_KERNEL);
+	if (!ekloco->buffer)
+		return -ENOMEM;
+
+#if IS_ENABLED(CONFIG_PERF_EVENTS)
+	// Samples go to a PMU that is never registered.
+	ekloco->pmu = kunit_kzalloc(test, sizeof(*ekloco->pmu), GFP_KERNEL);
+	if (!ekloco->pmu)
+		return -ENOMEM;
+	spin_lock_init(&ekloco->pmu->lock);
+#endif
+
+	fake->hdev.dev.init_name = "ekloco-kunit";
+	ekloco->hdev = &fake->hdev;
+	ekloco->transport = &ekloco_fake_transport;
+	ekloco_device_init(ekloco);
+
+	for (i = 0; i < NUM_FANS; i++) {
+		fake->rpm[i] = 600 + 100 * i;
+		fake->pwm[i] = 40;
+	}
+	fake->temp[0] = 30;
+	fake->temp[1] = 35;
+	fake->temp[2] = SENSOR_TEMP_UNUSED;
+	fake->flow_raw = 250;
+	fake->level = SENSOR_LEVEL_OPTIMAL;
+
+	test->priv = fake;
+	return 0;
+}
+
+// Cases queue the poller, step and stall works, none may outlive the fake.
+static void ekloco_test_exit(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+
+	ekloco_device_stop(&fake->ekloco);
+}
+
+static void ekloco_test_encode_fan_read(struct kunit *test)
+{
+	u8 buf[BUFFER_SIZE];
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		ekloco_encode_fan_read(buf, i);
+		KUNIT_EXPECT_MEMEQ(test, buf, fan_read_request, CHANNEL_OFFSET);
+		KUNIT_EXPECT_MEMEQ(test, buf + CHANNEL_OFFSET, fan_channels[i], CHANNEL_SIZE);
+		KUNIT_EXPECT_MEMEQ(test, buf + CHANNEL_OFFSET + CHANNEL_SIZE,
+				   fan_read_request + CHANNEL_OFFSET + CHANNEL_SIZE,
+				   BUFFER_SIZE - CHANNEL_OFFSET - CHANNEL_SIZE);
+	}
+}
+
+static void ekloco_test_encode_fan_set(struct kunit *test)
+{
+	// hwmon duty to the percentage the controller takes, rounded to the closest
+	static const struct {
+		long pwm;
+		u8 percent;
+	} cases[] = {
+		{ 0, 0 }, { 1, 0 }, { 2, 1 }, { 128, 50 }, { 254, 100 }, { 255, 100 },
+	};
+	u8 buf[BUFFER_SIZE];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		ekloco_encode_fan_set(buf, 3, cases[i].pwm);
+		KUNIT_EXPECT_EQ_MSG(test, buf[FAN_SET_PWM_OFFSET], cases[i].percent,
+				    "pwm %ld", cases[i].pwm);
+		KUNIT_EXPECT_EQ(test, buf[REQ_KIND_OFFSET], REQ_KIND_SET);
+		KUNIT_EXPECT_MEMEQ(test, buf + CHANNEL_OFFSET, fan_channels[3], CHANNEL_SIZE);
+	}
+}
+
+static void ekloco_test_decode_fan_read(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct fan_read_result result;
+	u8 buf[BUFFER_SIZE];
+
+	fake->rpm[1] = 0x1234;
+	fake->pwm[1] = 100;
+	ekloco_encode_fan_read(buf, 1);
+	ekloco_fake_respond(fake, buf);
+	ekloco_decode_fan_read(buf, &result);
+	KUNIT_EXPECT_EQ(test, result.rpm, 0x1234);
+	KUNIT_EXPECT_EQ(test, result.pwm, 255);
+
+	fake->pwm[1] = 50;
+	ekloco_encode_fan_read(buf, 1);
+	ekloco_fake_respond(fake, buf);
+	ekloco_decode_fan_read(buf, &result);
+	KUNIT_EXPECT_EQ(test, result.pwm, 127);
+}
+
+static void ekloco_test_decode_sensors(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct sensor_result result;
+	u8 buf[BUFFER_SIZE];
+
+	fake->flow_raw = 500;
+	ekloco_encode_sensor_read(buf);
+	ekloco_fake_respond(fake, buf);
+	ekloco_decode_sensors(buf, &result);
+	KUNIT_EXPECT_EQ(test, result.temp[0], 30);
+	KUNIT_EXPECT_EQ(test, result.temp[1], 35);
+	KUNIT_EXPECT_EQ(test, result.temp[2], SENSOR_TEMP_UNUSED);
+	// 0.8 l/h per unit
+	KUNIT_EXPECT_EQ(test, result.flow_lph, 400);
+	KUNIT_EXPECT_TRUE(test, result.level);
+
+	fake->level = 0;
+	ekloco_encode_sensor_read(buf);
+	ekloco_fake_respond(fake, buf);
+	ekloco_decode_sensors(buf, &result);
+	KUNIT_EXPECT_FALSE(test, result.level);
+}
+
+static void ekloco_test_read_fan(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	struct fan_read_result result;
+	long val;
+	s64 age;
+
+	KUNIT_EXPECT_EQ(test, ekloco_cache_age(ekloco, POLL_FAN1 + 2, &age), -ENODATA);
+
+	KUNIT_ASSERT_EQ(test, read_fan_speed(ekloco, 2, &result), 0);
+	KUNIT_EXPECT_EQ(test, result.rpm, 800);
+	KUNIT_EXPECT_EQ(test, result.pwm, 102);
+	KUNIT_EXPECT_EQ(test, fake->xfers, 1);
+
+	KUNIT_EXPECT_TRUE(test, ekloco->cache.valid[POLL_FAN1 + 2]);
+	KUNIT_EXPECT_EQ(test, ekloco->cache.fans[2].rpm, 800);
+	KUNIT_EXPECT_EQ(test, ekloco_cache_age(ekloco, POLL_FAN1 + 2, &age), 0);
+
+	KUNIT_ASSERT_EQ(test, ekloco_history_get(ekloco, &ekloco->fan_history[2],
+						 HISTORY_HIGHEST, &val), 0);
+	KUNIT_EXPECT_EQ(test, val, 800);
+}
+
+static void ekloco_test_set_fan(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	long target[NUM_FANS] = { 0, 0, 0, 0, 255, 0 };
+	struct fan_read_result result;
+
+	KUNIT_ASSERT_EQ(test, read_fan_speed(ekloco, 4, &result), 0);
+	KUNIT_ASSERT_EQ(test, set_fan_pwm(ekloco, 4, 128), 0);
+	KUNIT_EXPECT_EQ(test, fake->pwm[4], 50);
+	// The cached duty is stale now.
+	KUNIT_EXPECT_FALSE(test, ekloco->cache.valid[POLL_FAN1 + 4]);
+
+	KUNIT_EXPECT_EQ(test, set_fan_pwm(ekloco, 4, 256), -EINVAL);
+	KUNIT_EXPECT_EQ(test, set_fan_pwm(ekloco, 4, -1), -EINVAL);
+
+	// Nothing gets into a characterization sweep.
+	set_bit(4, &ekloco->calibrating);
+	KUNIT_EXPECT_EQ(test, set_fan_pwm(ekloco, 4, 255), -EBUSY);
+	KUNIT_EXPECT_EQ(test, set_fan_pwm_burst(ekloco, BIT(1) | BIT(4), target), -EBUSY);
+	clear_bit(4, &ekloco->calibrating);
+	KUNIT_EXPECT_EQ(test, fake->pwm[4], 50);
+	KUNIT_EXPECT_EQ(test, fake->xfers, 2);
+}
+
+static void ekloco_test_set_fan_burst(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	long target[NUM_FANS] = { 255, 0, 51, 0, 0, 0 };
+
+	KUNIT_ASSERT_EQ(test, set_fan_pwm_burst(ekloco, BIT(0) | BIT(2), target), 0);
+	KUNIT_EXPECT_EQ(test, fake->xfers, 1);
+	KUNIT_EXPECT_EQ(test, fake->requests, 2);
+	KUNIT_EXPECT_EQ(test, fake->pwm[0], 100);
+	KUNIT_EXPECT_EQ(test, fake->pwm[1], 40);
+	KUNIT_EXPECT_EQ(test, fake->pwm[2], 20);
+}
+
+static void ekloco_test_set_fan_reply(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	long target[NUM_FANS] = { 255, 0, 51, 0, 0, 0 };
+
+	fake->set_as_read = true;
+	KUNIT_EXPECT_EQ(test, set_fan_pwm(ekloco, 0, 255), -EPROTO);
+	KUNIT_EXPECT_EQ(test, set_fan_pwm_burst(ekloco, BIT(0) | BIT(2), target), -EPROTO);
+
+	fake->set_as_read = false;
+	fake->reply_len = sizeof(set_response_header);
+	KUNIT_EXPECT_EQ(test, set_fan_pwm(ekloco, 0, 255), -EPROTO);
+	KUNIT_EXPECT_EQ(test, set_fan_pwm_burst(ekloco, BIT(0) | BIT(2), target), -EPROTO);
+
+	fake->reply_len = 0;
+	KUNIT_EXPECT_EQ(test, set_fan_pwm_burst(ekloco, BIT(0) | BIT(2), target), 0);
+}
+
+static void ekloco_test_xfer_error(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	struct sensor_result result;
+	long val;
+
+	fake->error = -ETIMEDOUT;
+	KUNIT_EXPECT_EQ(test, read_sensors(ekloco, &result), -ETIMEDOUT);
+	KUNIT_EXPECT_FALSE(test, ekloco->cache.valid[POLL_SENSORS]);
+	KUNIT_EXPECT_EQ(test, ekloco_history_get(ekloco, &ekloco->temp_history[0],
+						 HISTORY_LOWEST, &val), -ENODATA);
+}
+
+static void ekloco_test_cache(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	struct sensor_result result;
+
+	// Not polled and no max_age, every reader goes to the device.
+	KUNIT_ASSERT_EQ(test, ekloco_get_sensors(ekloco, &result), 0);
+	KUNIT_ASSERT_EQ(test, ekloco_get_sensors(ekloco, &result), 0);
+	KUNIT_EXPECT_EQ(test, fake->xfers, 2);
+
+	ekloco->max_age = 60000;
+	fake->temp[0] = 40;
+	KUNIT_ASSERT_EQ(test, ekloco_get_sensors(ekloco, &result), 0);
+	KUNIT_EXPECT_EQ(test, fake->xfers, 2);
+	KUNIT_EXPECT_EQ(test, result.temp[0], 30);
+
+	// Unused ports stay out of the history.
+	KUNIT_EXPECT_EQ(test, ekloco->temp_history[0].count, 2);
+	KUNIT_EXPECT_EQ(test, ekloco->temp_history[2].count, 0);
+}
+
+static void ekloco_test_poll(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	int i;
+
+	// The first run reads every channel.
+	ekloco_poll(ekloco, true);
+	KUNIT_EXPECT_EQ(test, fake->requests, NUM_POLL_CHANNELS);
+	KUNIT_EXPECT_TRUE(test, ekloco->poll_valid);
+	KUNIT_EXPECT_EQ(test, ekloco->poll_sample.sensors.temp[1], 35);
+	for (i = 0; i < NUM_FANS; i++)
+		KUNIT_EXPECT_EQ(test, ekloco->poll_sample.fans[i].rpm, 600 + 100 * i);
+
+	// With a budget, later runs only read that many.
+	ekloco->update_budget = 3;
+	ekloco_poll(ekloco, true);
+	KUNIT_EXPECT_EQ(test, fake->requests, NUM_POLL_CHANNELS + 3);
+
+	// Channels with weight 0 are never polled.
+	ekloco->update_budget = 0;
+	for (i = POLL_FAN1; i < NUM_POLL_CHANNELS; i++)
+		ekloco->poll_weight[i] = 0;
+	ekloco_poll(ekloco, true);
+	KUNIT_EXPECT_EQ(test, fake->requests, NUM_POLL_CHANNELS + 4);
+}
+
+static void ekloco_test_stall(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	struct ekloco_fan_curve *curve = &ekloco->fan_curve[1];
+	struct ekloco_stall *stall = &ekloco->stall[1];
+	struct fan_read_result result;
+	int i;
+
+	ekloco->stall_boost = 255;
+	curve->valid = true;
+	curve->stall = 51;
+	for (i = 0; i < CURVE_POINTS; i++)
+		curve->rpm[i] = 2000 * i / (CURVE_POINTS - 1);
+
+	// Above STALL_RPM but under half of the 1200 rpm the curve gives for 60%.
+	fake->pwm[1] = 60;
+	fake->rpm[1] = 300;
+	stall->state = STALL_CHECKING;
+	stall->until = jiffies - 1;
+	ekloco_stall_work(&ekloco->stall_work.work);
+	KUNIT_EXPECT_EQ(test, stall->state, STALL_FAILED);
+	KUNIT_EXPECT_EQ(test, stall->failed, 1);
+
+	fake->rpm[1] = 1000;
+	stall->state = STALL_CHECKING;
+	ekloco_stall_work(&ekloco->stall_work.work);
+	KUNIT_EXPECT_EQ(test, stall->state, STALL_NONE);
+	KUNIT_EXPECT_EQ(test, stall->recovered, 1);
+
+	// The boost never goes below the duty, and nothing is written once it's disabled.
+	fake->rpm[1] = 50;
+	ekloco->stall_boost = 20;
+	KUNIT_ASSERT_EQ(test, read_fan_speed(ekloco, 1, &result), 0);
+	KUNIT_EXPECT_EQ(test, stall->state, STALL_DETECTED);
+	KUNIT_EXPECT_EQ(test, stall->boost, 153);
+	ekloco->stall_boost = 0;
+	ekloco_stall_work(&ekloco->stall_work.work);
+	KUNIT_EXPECT_EQ(test, stall->state, STALL_NONE);
+	KUNIT_EXPECT_EQ(test, fake->pwm[1], 60);
+	ekloco->stall_boost = 255;
+
+	// A duty written during a recovery ends it, the boost doesn't override it.
+	stall->state = STALL_DETECTED;
+	KUNIT_ASSERT_EQ(test, set_fan_pwm(ekloco, 1, 128), 0);
+	ekloco_stall_work(&ekloco->stall_work.work);
+	KUNIT_EXPECT_EQ(test, fake->pwm[1], 50);
+	KUNIT_EXPECT_EQ(test, stall->state, STALL_NONE);
+}
+
+static void ekloco_test_filter(struct kunit *test)
+{
+	static const long values[] = { 10, 50, 20, 40, 30 };
+	struct ekloco_filter filter = { .type = FILTER_MEDIAN, .param = 5 };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(values); i++)
+		ekloco_filter_add(&filter, values[i]);
+	KUNIT_EXPECT_EQ(test, filter.output, 30 * FILTER_SCALE);
+
+	filter = (struct ekloco_filter) { .type = FILTER_EMA, .param = FILTER_SCALE / 2 };
+	ekloco_filter_add(&filter, 100);
+	ekloco_filter_add(&filter, 200);
+	KUNIT_EXPECT_EQ(test, filter.output, 150 * FILTER_SCALE);
+}
+
+static void ekloco_test_slack_delay(struct kunit *test)
+{
+	unsigned long delay;
+
+	KUNIT_EXPECT_EQ(test, ekloco_slack_delay(7, 0), 7);
+
+	delay = ekloco_slack_delay(7, 10);
+	KUNIT_EXPECT_GE(test, delay, 7);
+	KUNIT_EXPECT_LT(test, delay, 17);
+	// jiffies may have moved on since, but not by a whole round of slack
+	KUNIT_EXPECT_LE(test, (jiffies + delay) % 10, 1);
+}
+
+static void ekloco_bench_report(struct kunit *test, const char *name, u64 start, u64 limit)
+{
+	u64 per_op = div_u64(ktime_get_ns() - start, TEST_BENCH_OPS);
+
+	kunit_info(test, "%s: %llu ns/op\n", name, per_op);
+	KUNIT_EXPECT_LT_MSG(test, per_op, limit, "%s", name);
+}
+
+static void ekloco_bench_codec(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	u8 fan_response[BUFFER_SIZE];
+	u8 sensor_response[BUFFER_SIZE];
+	u64 start;
+	int i;
+
+	ekloco_encode_fan_read(fan_response, 0);
+	ekloco_fake_respond(fake, fan_response);
+	ekloco_encode_sensor_read(sensor_response);
+	ekloco_fake_respond(fake, sensor_response);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++) {
+		ekloco_encode_fan_read(fake->frame, i % NUM_FANS);
+		barrier();
+	}
+	ekloco_bench_report(test, "encode fan read", start, TEST_BENCH_LIMIT_NS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++) {
+		ekloco_encode_fan_set(fake->frame, i % NUM_FANS, i & 0xff);
+		barrier();
+	}
+	ekloco_bench_report(test, "encode fan set", start, TEST_BENCH_LIMIT_NS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++) {
+		ekloco_decode_fan_read(fan_response, &fake->fan_result);
+		barrier();
+	}
+	ekloco_bench_report(test, "decode fan read", start, TEST_BENCH_LIMIT_NS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++) {
+		ekloco_decode_sensors(sensor_response, &fake->sensor_result);
+		barrier();
+	}
+	ekloco_bench_report(test, "decode sensors", start, TEST_BENCH_LIMIT_NS);
+}
+
+// A whole request through the mutex, transport, history, filters and cache publishing.
+static void ekloco_bench_request(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	u64 start;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++)
+		KUNIT_ASSERT_EQ(test, read_fan_speed(ekloco, i % NUM_FANS, &fake->fan_result), 0);
+	ekloco_bench_report(test, "read fan", start, TEST_BENCH_LIMIT_NS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++)
+		KUNIT_ASSERT_EQ(test, read_sensors(ekloco, &fake->sensor_result), 0);
+	ekloco_bench_report(test, "read sensors", start, TEST_BENCH_LIMIT_NS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++)
+		KUNIT_ASSERT_EQ(test, set_fan_pwm(ekloco, i % NUM_FANS, i & 0xff), 0);
+	ekloco_bench_report(test, "set fan", start, TEST_BENCH_LIMIT_NS);
+}
+
+// The lockless path every hwmon, IIO and perf reader takes while the cache is usable.
+static void ekloco_bench_cached(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	unsigned int xfers;
+	u64 start;
+	int i;
+
+	ekloco->max_age = 60000;
+	ekloco_poll(ekloco, true);
+	xfers = fake->xfers;
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++)
+		KUNIT_ASSERT_EQ(test, ekloco_get_fan(ekloco, i % NUM_FANS, &fake->fan_result), 0);
+	ekloco_bench_report(test, "cached fan", start, TEST_BENCH_LIMIT_NS);
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++)
+		KUNIT_ASSERT_EQ(test, ekloco_get_sensors(ekloco, &fake->sensor_result), 0);
+	ekloco_bench_report(test, "cached sensors", start, TEST_BENCH_LIMIT_NS);
+
+	KUNIT_EXPECT_EQ(test, fake->xfers, xfers);
+}
+
+// A full poller run, one request per channel.
+static void ekloco_bench_poll(struct kunit *test)
+{
+	struct ekloco_fake *fake = test->priv;
+	struct ekloco_device *ekloco = &fake->ekloco;
+	u64 start;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++)
+		ekloco_poll(ekloco, true);
+	ekloco_bench_report(test, "poll", start, NUM_POLL_CHANNELS * TEST_BENCH_LIMIT_NS);
+
+	KUNIT_EXPECT_EQ(test, fake->requests, TEST_BENCH_OPS * NUM_POLL_CHANNELS);
+}
+
+static struct kunit_case ekloco_test_cases[] = {
+	KUNIT_CASE(ekloco_test_encode_fan_read),
+	KUNIT_CASE(ekloco_test_encode_fan_set),
+	KUNIT_CASE(ekloco_test_decode_fan_read),
+	KUNIT_CASE(ekloco_test_decode_sensors),
+	KUNIT_CASE(ekloco_test_read_fan),
+	KUNIT_CASE(ekloco_test_set_fan),
+	KUNIT_CASE(ekloco_test_set_fan_burst),
+	KUNIT_CASE(ekloco_test_set_fan_reply),
+	KUNIT_CASE(ekloco_test_xfer_error),
+	KUNIT_CASE(ekloco_test_cache),
+	KUNIT_CASE(ekloco_test_poll),
+	KUNIT_CASE(ekloco_test_stall),
+	KUNIT_CASE(ekloco_test_filter),
+	KUNIT_CASE(ekloco_test_slack_delay),
+	KUNIT_CASE(ekloco_bench_codec),
+	KUNIT_CASE(ekloco_bench_request),
+	KUNIT_CASE(ekloco_bench_cached),
+	KUNIT_CASE(ekloco_bench_poll),
+	{ }
+};
+
+static struct kunit_suite ekloco_test_suite = {
+	.name = "ek-loop-connect",
+	.init = ekloco_test_init,
+	.exit = ekloco_test_exit,
+	.test_cases = ekloco_test_cases,
+};
+
+kunit_test_suite(ekloco_test_suite);
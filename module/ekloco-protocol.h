@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * ekloco-protocol.h - frame layout of the EK Loop Connect, see protocol.md
+ * Copyright (C) 2021 Pavel Herrmann <pavelherr@gmail.com>
+ *
+ * Shared between the driver and the userspace tools, so only plain types from linux/types.h.
+ */
+
+#ifndef _EKLOCO_PROTOCOL_H
+#define _EKLOCO_PROTOCOL_H
+
+#include <linux/types.h>
+
+#define USB_VENDOR_ID_EK		0x0483
+#define USB_PRODUCT_ID_EK_LOOP_CONNECT	0x5750
+
+#define BUFFER_SIZE		63
+#define CHANNEL_OFFSET		6
+#define CHANNEL_SIZE		2
+
+#define NUM_FANS		6
+#define NUM_TEMP_SENSORS	3
+
+// Specific byte offsets from response buffers
+#define FAN_READ_RPM_OFFSET 12
+#define FAN_READ_PWM_OFFSET 21
+#define FAN_SET_PWM_OFFSET 24
+#define SENSOR_T1_OFFSET 11
+#define SENSOR_T2_OFFSET 15
+#define SENSOR_T3_OFFSET 19
+#define SENSOR_FLOW_OFFSET 22
+#define SENSOR_LEVEL_OFFSET 27
+
+// Temperature reported for ports without a sensor attached
+#define SENSOR_TEMP_UNUSED 0xe7
+
+// Coolant level reading when the level is fine, 0 otherwise
+#define SENSOR_LEVEL_OPTIMAL 0x64
+
+// Byte 2 of a request tells reads from sets
+#define REQ_KIND_OFFSET 2
+#define REQ_KIND_READ 0x08
+#define REQ_KIND_SET 0x29
+
+// Constant bytes of responses
+#define READ_RESPONSE_TRAILER_OFFSET 40
+#define SET_RESPONSE_TRAILER_OFFSET 7
+
+static const __u8 fan_read_request[] = {
+        0x10, 0x12, 0x08, 0xaa, 0x01, 0x03, 0xff, 0xff,         // 6B header, 2B channel
+        0x00, 0x20, 0x66, 0xff, 0xff, 0xed, 0x00, 0x00,         // 2B constant, 3B checksum? (bytes 10-12), 1B constant, 2B padding
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // padding
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const __u8 sensor_read_request[] = {
+        0x10, 0x12, 0x08, 0xaa, 0x01, 0x03, 0xa2, 0x20,		// 6B header, 2B channel
+        0x00, 0x20, 0x66, 0x60, 0xfe, 0xed, 0x00, 0x00,		// constant?
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,		// padding  49B
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const __u8 fan_set_request[] = {
+        0x10, 0x12, 0x29, 0xaa, 0x01, 0x10, 0xff, 0xff,         // 6B header, 2B channel
+        0x00, 0x10, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,         // 3B constant + 4B padding + high byte fan rpm (byte 15)
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // low byte fan RPM (byte 16) + 7B padding
+        0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // PWM percentage (byte 24), checksum? (byte 25), padding
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // padding
+        0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xed, 0x00,         // padding, checksum? (byte 45), constant (byte 46)
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,         // padding
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static const __u8 read_response_header[] = {0x10, 0x12, 0x27, 0xaa, 0x01, 0x03, 0x00, 0x20};
+static const __u8 read_response_trailer[] = {0xaa, 0xbb, 0xff, 0xed};
+static const __u8 set_response_header[] = {0x10, 0x12, 0x06};
+static const __u8 set_response_trailer[] = {0xaa, 0xbb, 0x65, 0xed};
+
+// Precedes every reading in a sensor response
+static const __u8 sensor_port_prefix[] = {0x00, 0x01, 0x00};
+
+static const __u8 sensor_channel[CHANNEL_SIZE] = {0xa2, 0x20};
+
+static const __u8 fan_channels[][CHANNEL_SIZE] = {
+        {0xa0, 0xa0},
+        {0xa0, 0xc0},
+        {0xa0, 0xe0},
+        {0xa1, 0x00},
+        {0xa1, 0x20},
+        {0xa1, 0xe0},
+};
+
+#endif /* _EKLOCO_PROTOCOL_H */
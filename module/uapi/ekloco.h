@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * ekloco.h - userspace interface of the EK Loop Connect driver
+ * Copyright (C) 2021 Pavel Herrmann <pavelherr@gmail.com>
+ */
+
+#ifndef _UAPI_EKLOCO_H
+#define _UAPI_EKLOCO_H
+
+#include <linux/types.h>
+
+/*
+ * Generic netlink family. Every refresh of the driver multicasts an EKLOCO_CMD_SAMPLE message to
+ * the "samples" group, carrying the HID device name, a CLOCK_BOOTTIME timestamp in ns and
+ * a struct ekloco_nl_sample.
+ */
+#define EKLOCO_GENL_NAME		"ekloco"
+#define EKLOCO_GENL_VERSION		1
+#define EKLOCO_GENL_MCGRP_SAMPLES	"samples"
+
+enum ekloco_genl_cmd {
+	EKLOCO_CMD_UNSPEC,
+	EKLOCO_CMD_SAMPLE,
+	__EKLOCO_CMD_MAX,
+};
+#define EKLOCO_CMD_MAX (__EKLOCO_CMD_MAX - 1)
+
+enum ekloco_genl_attr {
+	EKLOCO_ATTR_UNSPEC,
+	EKLOCO_ATTR_PAD,
+	EKLOCO_ATTR_DEVICE,		/* string */
+	EKLOCO_ATTR_TIMESTAMP,		/* u64 */
+	EKLOCO_ATTR_SAMPLE,		/* struct ekloco_nl_sample */
+	__EKLOCO_ATTR_MAX,
+};
+#define EKLOCO_ATTR_MAX (__EKLOCO_ATTR_MAX - 1)
+
+#define EKLOCO_NUM_FANS			6
+#define EKLOCO_NUM_TEMP_SENSORS		3
+
+/* Alarm bits */
+#define EKLOCO_ALARM_LEVEL		(1 << 0)
+
+struct ekloco_nl_sample {
+	__u32 alarms;
+	__u32 flow_lph;
+	__s16 temp[EKLOCO_NUM_TEMP_SENSORS];	/* degC, 0xe7 when the port is not used */
+	__u16 rpm[EKLOCO_NUM_FANS];
+	__u8 pwm[EKLOCO_NUM_FANS];		/* 0-255 */
+};
+
+/*
+ * Traffic capture, read from debugfs ek-loop-connect/<device>/capture as a stream of these
+ * records while capture_enable is set. Timestamps are CLOCK_MONOTONIC in ns.
+ */
+enum ekloco_capture_type {
+	EKLOCO_CAPTURE_OUT = 1,		/* request sent to the device */
+	EKLOCO_CAPTURE_IN,		/* input report received */
+	EKLOCO_CAPTURE_TIMEOUT,		/* no response to the last request, len is 0 */
+};
+
+/* Capture flags */
+#define EKLOCO_CAPTURE_F_CONSUMED	(1 << 0)	/* IN report completed a request */
+
+struct ekloco_capture_record {
+	__u64 timestamp_ns;
+	__u8 type;
+	__u8 flags;
+	__u16 len;
+	__u32 reserved;
+	__u8 data[64];
+};
+
+#endif /* _UAPI_EKLOCO_H */
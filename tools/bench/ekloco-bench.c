@@ -0,0 +1,649 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ekloco-bench.c - latency and throughput benchmark of the EK Loop Connect hwmon interface
+ *
+ * Walks every readable attribute of the hwmon device once, then reads attributes from a number of
+ * threads for a fixed time, optionally mixed with pwm writes, and reports latency percentiles and
+ * throughput as JSON. Works the same against a real controller and the uhid emulator.
+ *
+ * When the driver's debugfs capture is available, the requests and reports it sees during the run
+ * are counted to get the number of USB frames behind each attribute access.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uapi/ekloco.h"
+
+#define HWMON_NAME		"ekloopconnect"
+#define HWMON_CLASS		"/sys/class/hwmon"
+#define DEBUGFS_DIR		"/sys/kernel/debug/ek-loop-connect"
+
+#define MAX_ATTRS		256
+#define NUM_PWM			6
+#define DIR_LEN			256
+
+struct attr {
+	char name[64];
+};
+
+// Latencies in ns, grown as needed.
+struct samples {
+	uint64_t *ns;
+	size_t len;
+	size_t size;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	struct samples reads;
+	struct samples writes;
+	unsigned long errors;
+};
+
+struct frame_counter {
+	pthread_t thread;
+	int fd;
+	volatile sig_atomic_t done;
+	unsigned long out;
+	unsigned long in;
+	unsigned long timeouts;
+};
+
+static char hwmon_dir[DIR_LEN];
+static struct attr attrs[MAX_ATTRS];
+static unsigned int num_attrs;
+static const char *hammer_attr;
+static unsigned int write_pct;
+static char pwm_initial[NUM_PWM][16];
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int samples_add(struct samples *s, uint64_t ns)
+{
+	uint64_t *tmp;
+
+	if (s->len == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		tmp = realloc(s->ns, s->size * sizeof(*s->ns));
+		if (!tmp)
+			return -1;
+		s->ns = tmp;
+	}
+
+	s->ns[s->len++] = ns;
+	return 0;
+}
+
+static int samples_merge(struct samples *dst, const struct samples *src)
+{
+	size_t i;
+
+	for (i = 0; i < src->len; i++)
+		if (samples_add(dst, src->ns[i]))
+			return -1;
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted samples, in microseconds.
+static double percentile(const struct samples *s, double p)
+{
+	size_t rank;
+
+	if (!s->len)
+		return 0;
+
+	rank = p / 100 * s->len;
+	if (rank >= s->len)
+		rank = s->len - 1;
+
+	return s->ns[rank] / 1000.0;
+}
+
+static void print_latency(FILE *out, const char *name, struct samples *s)
+{
+	qsort(s->ns, s->len, sizeof(*s->ns), cmp_u64);
+	fprintf(out, "\"%s\": {\"count\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+		"\"max\": %.1f}", name, s->len, percentile(s, 50), percentile(s, 99),
+		percentile(s, 99.9), percentile(s, 100));
+}
+
+static int attr_path(char *buf, size_t size, const char *name)
+{
+	int ret;
+
+	ret = snprintf(buf, size, "%s/%s", hwmon_dir, name);
+	return ret < 0 || (size_t)ret >= size ? -1 : 0;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int write_file(const char *path, const char *val)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	len = write(fd, val, strlen(val));
+	close(fd);
+
+	return len < 0 ? -1 : 0;
+}
+
+static int find_hwmon(void)
+{
+	char path[PATH_MAX];
+	char name[64];
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(HWMON_CLASS);
+	if (!dir) {
+		perror(HWMON_CLASS);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/name", HWMON_CLASS, de->d_name);
+		if (read_file(path, name, sizeof(name)) || strcmp(name, HWMON_NAME))
+			continue;
+
+		snprintf(hwmon_dir, sizeof(hwmon_dir), "%s/%.64s", HWMON_CLASS, de->d_name);
+		closedir(dir);
+		return 0;
+	}
+
+	closedir(dir);
+	fprintf(stderr, "no %s hwmon device found\n", HWMON_NAME);
+	return -1;
+}
+
+// Collects the readable attributes, the ones the driver exports through ekloco_info and its groups.
+static int scan_attrs(void)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(hwmon_dir);
+	if (!dir) {
+		perror(hwmon_dir);
+		return -1;
+	}
+
+	while ((de = readdir(dir)) && num_attrs < MAX_ATTRS) {
+		if (!strcmp(de->d_name, "uevent") || strlen(de->d_name) >= sizeof(attrs[0].name))
+			continue;
+		if (attr_path(path, sizeof(path), de->d_name) || lstat(path, &st) ||
+		    !S_ISREG(st.st_mode) || !(st.st_mode & S_IRUSR))
+			continue;
+
+		strcpy(attrs[num_attrs].name, de->d_name);
+		num_attrs++;
+	}
+
+	closedir(dir);
+
+	if (!num_attrs) {
+		fprintf(stderr, "%s: no readable attributes\n", hwmon_dir);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Times a full read of an already open attribute, sysfs regenerates the value at offset 0.
+static int timed_read(int fd, uint64_t *ns)
+{
+	char buf[128];
+	uint64_t start;
+	ssize_t len;
+
+	start = now_ns();
+	len = pread(fd, buf, sizeof(buf), 0);
+	*ns = now_ns() - start;
+
+	return len < 0 ? -1 : 0;
+}
+
+/*
+ * Writes the duty a pwm channel had when the run started, so the benchmark costs the same
+ * transactions as a fan controller without changing the cooling.
+ */
+static int timed_write(unsigned int channel, uint64_t *ns)
+{
+	char path[PATH_MAX];
+	char name[16];
+	uint64_t start;
+	int ret;
+
+	snprintf(name, sizeof(name), "pwm%u", channel + 1);
+	if (attr_path(path, sizeof(path), name))
+		return -1;
+
+	start = now_ns();
+	ret = write_file(path, pwm_initial[channel]);
+	*ns = now_ns() - start;
+
+	return ret;
+}
+
+static void walk(FILE *out, unsigned int iterations)
+{
+	char path[PATH_MAX];
+	struct samples s = { 0 };
+	unsigned int i, n;
+	unsigned long errors;
+	uint64_t ns;
+	int fd;
+
+	fprintf(out, "  \"walk\": [");
+	for (i = 0; i < num_attrs && !stop; i++) {
+		s.len = 0;
+		errors = 0;
+
+		attr_path(path, sizeof(path), attrs[i].name);
+		fd = open(path, O_RDONLY);
+		for (n = 0; n < iterations && fd >= 0; n++) {
+			if (timed_read(fd, &ns))
+				errors++;
+			else
+				samples_add(&s, ns);
+		}
+		if (fd >= 0)
+			close(fd);
+		else
+			errors = iterations;
+
+		fprintf(out, "%s\n    {\"attr\": \"%s\", \"errors\": %lu, ", i ? "," : "",
+			attrs[i].name, errors);
+		print_latency(out, "latency_us", &s);
+		fprintf(out, "}");
+	}
+	fprintf(out, "\n  ],\n");
+
+	free(s.ns);
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	char path[PATH_MAX];
+	int fds[MAX_ATTRS];
+	unsigned int count;
+	unsigned int i, op = 0;
+	unsigned int seed = w->id + 1;
+	uint64_t ns;
+	int ret;
+
+	count = hammer_attr ? 1 : num_attrs;
+	for (i = 0; i < count; i++) {
+		attr_path(path, sizeof(path), hammer_attr ? hammer_attr : attrs[i].name);
+		fds[i] = open(path, O_RDONLY);
+	}
+
+	// Every thread starts at a different attribute so they don't move in lockstep.
+	i = w->id % count;
+
+	while (!stop) {
+		if (write_pct && (unsigned int)rand_r(&seed) % 100 < write_pct) {
+			ret = timed_write(op++ % NUM_PWM, &ns);
+			if (ret)
+				w->errors++;
+			else if (samples_add(&w->writes, ns))
+				break;
+			continue;
+		}
+
+		if (fds[i] < 0 || timed_read(fds[i], &ns))
+			w->errors++;
+		else if (samples_add(&w->reads, ns))
+			break;
+
+		if (++i == count)
+			i = 0;
+	}
+
+	for (i = 0; i < count; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+
+	return NULL;
+}
+
+static void *frame_counter_run(void *arg)
+{
+	struct frame_counter *fc = arg;
+	struct ekloco_capture_record records[64];
+	ssize_t len;
+	ssize_t i;
+
+	for (;;) {
+		len = read(fc->fd, records, sizeof(records));
+		if (len < 0 && errno == EAGAIN) {
+			if (fc->done)
+				break;
+			usleep(10000);
+			continue;
+		}
+		if (len <= 0)
+			break;
+
+		for (i = 0; i < len / (ssize_t)sizeof(records[0]); i++) {
+			if (records[i].type == EKLOCO_CAPTURE_OUT)
+				fc->out++;
+			else if (records[i].type == EKLOCO_CAPTURE_IN)
+				fc->in++;
+			else if (records[i].type == EKLOCO_CAPTURE_TIMEOUT)
+				fc->timeouts++;
+		}
+	}
+
+	return NULL;
+}
+
+// The debugfs directory is named after the HID device the hwmon device belongs to.
+static int capture_dir(char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+	const char *hid;
+
+	if (attr_path(path, sizeof(path), "device") || !realpath(path, target))
+		return -1;
+
+	hid = strrchr(target, '/');
+	if (!hid)
+		return -1;
+
+	if ((size_t)snprintf(buf, size, "%s%s", DEBUGFS_DIR, hid) >= size)
+		return -1;
+
+	return access(buf, F_OK);
+}
+
+static int start_frame_counter(struct frame_counter *fc, const char *dir)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/capture_enable", dir);
+	if (write_file(path, "1"))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/capture", dir);
+	fc->fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (fc->fd < 0)
+		goto err;
+
+	if (pthread_create(&fc->thread, NULL, frame_counter_run, fc))
+		goto err_close;
+
+	return 0;
+
+err_close:
+	close(fc->fd);
+err:
+	snprintf(path, sizeof(path), "%s/capture_enable", dir);
+	write_file(path, "0");
+	return -1;
+}
+
+static void stop_frame_counter(struct frame_counter *fc, const char *dir)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/capture_enable", dir);
+	write_file(path, "0");
+
+	// Nothing is recorded anymore, the counter drains what is left and exits.
+	fc->done = 1;
+	pthread_join(fc->thread, NULL);
+	close(fc->fd);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -H, --hwmon=DIR       hwmon device directory (default: the first %s)\n"
+		"  -a, --attr=NAME       read only NAME instead of all readable attributes\n"
+		"  -j, --threads=N       reading threads (default 1)\n"
+		"  -d, --duration=SECS   length of the concurrent run (default 10)\n"
+		"  -w, --write=PCT       make PCT percent of operations pwmN writes, rewriting the\n"
+		"                        duty each channel had at the start (default 0)\n"
+		"  -n, --iterations=N    reads of every attribute in the walk (default 10), 0 skips it\n"
+		"      --no-capture      don't count USB frames through debugfs\n"
+		"  -o, --output=FILE     write the JSON report to FILE (default stdout)\n",
+		prog, HWMON_NAME);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "hwmon", required_argument, NULL, 'H' },
+		{ "attr", required_argument, NULL, 'a' },
+		{ "threads", required_argument, NULL, 'j' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "write", required_argument, NULL, 'w' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "no-capture", no_argument, NULL, 'C' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	char path[PATH_MAX];
+	char debugfs[DIR_LEN];
+	struct samples reads = { 0 }, writes = { 0 };
+	struct frame_counter fc = { 0 };
+	struct worker *workers;
+	unsigned int threads = 1;
+	unsigned int iterations = 10;
+	unsigned long errors = 0;
+	double duration = 10;
+	bool capture = true;
+	bool counting = false;
+	uint64_t start, elapsed;
+	FILE *out = stdout;
+	char *end;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "H:a:j:d:w:n:o:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'H':
+			snprintf(hwmon_dir, sizeof(hwmon_dir), "%s", optarg);
+			break;
+		case 'a':
+			hammer_attr = optarg;
+			break;
+		case 'j':
+			threads = strtoul(optarg, &end, 0);
+			if (end == optarg || *end || !threads || threads > 1024)
+				goto bad_arg;
+			break;
+		case 'd':
+			duration = strtod(optarg, &end);
+			if (end == optarg || *end || duration <= 0)
+				goto bad_arg;
+			break;
+		case 'w':
+			write_pct = strtoul(optarg, &end, 0);
+			if (end == optarg || *end || write_pct > 100)
+				goto bad_arg;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, &end, 0);
+			if (end == optarg || *end)
+				goto bad_arg;
+			break;
+		case 'C':
+			capture = false;
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!hwmon_dir[0] && find_hwmon())
+		return 1;
+	if (scan_attrs())
+		return 1;
+
+	for (i = 0; i < NUM_PWM && write_pct; i++) {
+		snprintf(path, sizeof(path), "%s/pwm%u", hwmon_dir, i + 1);
+		if (read_file(path, pwm_initial[i], sizeof(pwm_initial[i]))) {
+			perror(path);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	fprintf(out, "{\n  \"hwmon\": \"%s\",\n  \"threads\": %u,\n  \"duration\": %.3f,\n"
+		"  \"write_pct\": %u,\n  \"attr\": ", hwmon_dir, threads, duration, write_pct);
+	fprintf(out, hammer_attr ? "\"%s\",\n" : "null,\n", hammer_attr);
+
+	if (iterations)
+		walk(out, iterations);
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+
+	if (capture && !capture_dir(debugfs, sizeof(debugfs)))
+		counting = !start_frame_counter(&fc, debugfs);
+	if (capture && !counting)
+		fprintf(stderr, "debugfs capture not available, not counting frames\n");
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+			perror("pthread_create");
+			stop = 1;
+			threads = i;
+			break;
+		}
+	}
+
+	while (!stop && now_ns() - start < duration * 1e9)
+		usleep(10000);
+	stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		samples_merge(&reads, &workers[i].reads);
+		samples_merge(&writes, &workers[i].writes);
+		errors += workers[i].errors;
+		free(workers[i].reads.ns);
+		free(workers[i].writes.ns);
+	}
+	elapsed = now_ns() - start;
+
+	if (counting)
+		stop_frame_counter(&fc, debugfs);
+
+	fprintf(out, "  \"elapsed\": %.3f,\n  \"reads\": %zu,\n  \"writes\": %zu,\n"
+		"  \"errors\": %lu,\n  \"ops_per_sec\": %.1f,\n  ", elapsed / 1e9, reads.len,
+		writes.len, errors, (reads.len + writes.len) / (elapsed / 1e9));
+	print_latency(out, "read_us", &reads);
+	fprintf(out, ",\n  ");
+	print_latency(out, "write_us", &writes);
+	fprintf(out, ",\n");
+
+	if (counting && reads.len + writes.len)
+		fprintf(out, "  \"frames\": {\"out\": %lu, \"in\": %lu, \"timeouts\": %lu, "
+			"\"per_op\": %.3f}\n", fc.out, fc.in, fc.timeouts,
+			(double)(fc.out + fc.in) / (reads.len + writes.len));
+	else
+		fprintf(out, "  \"frames\": null\n");
+	fprintf(out, "}\n");
+
+	free(reads.ns);
+	free(writes.ns);
+	free(workers);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+
+bad_arg:
+	fprintf(stderr, "invalid argument: %s\n", optarg);
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,1274 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ekloco-emu.c - uhid based emulator of the EK Loop Connect
+ *
+ * Creates a HID device with the vendor and product ID of the controller and answers fan read,
+ * fan set and sensor read requests the way the controller does (see protocol.md), so the
+ * driver can be exercised without hardware.
+ *
+ * Faults can be injected to see how the driver copes with a misbehaving controller or another
+ * program talking to it: dropped, delayed and duplicated replies, unsolicited reports resembling
+ * OpenRGB traffic and periods without any answer. Faults can be changed over time by a script.
+ *
+ * In plant mode, temperatures, flow and fan speeds come from a thermal model of the loop driven by
+ * the duties the host writes, to compare fan control strategies without hardware.
+ *
+ * A traffic capture taken through the driver's debugfs interface can be replayed: every request
+ * of the driver is answered with the reports that followed the matching request in the capture,
+ * with the recorded timing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/uhid.h>
+
+#include "ekloco-protocol.h"
+#include "plant.h"
+#include "uapi/ekloco.h"
+
+// Replies waiting for their delay to pass. The controller answers in order, so does the queue.
+#define MAX_PENDING		64
+
+#define MAX_SCRIPT_LINES	256
+
+// Plant model update and log interval
+#define PLANT_TICK_NS		100000000ULL
+
+// Vendor defined collection with one 63 byte input and output report, no report IDs.
+static const uint8_t report_descriptor[] = {
+	0x06, 0x00, 0xff,	// Usage Page (Vendor Defined 0xFF00)
+	0x09, 0x01,		// Usage (0x01)
+	0xa1, 0x01,		// Collection (Application)
+	0x15, 0x00,		//   Logical Minimum (0)
+	0x26, 0xff, 0x00,	//   Logical Maximum (255)
+	0x75, 0x08,		//   Report Size (8)
+	0x95, BUFFER_SIZE,	//   Report Count (63)
+	0x09, 0x02,		//   Usage (0x02)
+	0x81, 0x02,		//   Input (Data,Var,Abs)
+	0x95, BUFFER_SIZE,	//   Report Count (63)
+	0x09, 0x03,		//   Usage (0x03)
+	0x91, 0x02,		//   Output (Data,Var,Abs)
+	0xc0,			// End Collection
+};
+
+struct emu_state {
+	uint8_t pwm[NUM_FANS];		// 0-100, as sent by the host
+	unsigned int rpm_max[NUM_FANS];	// speed at 100% duty
+	uint8_t temp[NUM_TEMP_SENSORS];	// degC, SENSOR_TEMP_UNUSED for empty ports
+	unsigned int flow_raw;		// l/h divided by 0.8
+	uint8_t level;
+};
+
+struct emu_stats {
+	unsigned long fan_reads;
+	unsigned long fan_sets;
+	unsigned long sensor_reads;
+	unsigned long unknown;
+	unsigned long dropped;
+	unsigned long stalled;
+	unsigned long duplicated;
+	unsigned long foreign;
+	unsigned long overflow;
+	unsigned long replayed;
+	unsigned long mismatched;
+};
+
+enum delay_type {
+	DELAY_FIXED,
+	DELAY_UNIFORM,
+	DELAY_NORMAL,
+	DELAY_EXP,
+};
+
+// Response latency distribution, parameters in microseconds.
+struct delay_dist {
+	enum delay_type type;
+	double a;	// fixed value, minimum, mean
+	double b;	// maximum, standard deviation
+};
+
+struct faults {
+	double drop;		// probability of not answering a request
+	double duplicate;	// probability of sending a reply twice
+	double foreign_rate;	// unsolicited reports per second
+	struct delay_dist delay;
+	double stall_secs;	// how long SIGUSR1 stops all answers
+};
+
+struct pending_reply {
+	uint64_t due_ns;
+	uint8_t data[BUFFER_SIZE];
+};
+
+struct script_line {
+	uint64_t at_ns;
+	char key[16];
+	char value[64];
+};
+
+static const char * const script_keys[] = {"drop", "duplicate", "delay", "foreign", "stall", "load"};
+
+/*
+ * Control performance of T1 against a setpoint, measured from the last load change. Settled
+ * means staying within the band from that point on.
+ */
+struct plant_metrics {
+	double setpoint;
+	double band;
+	uint64_t since_ns;
+	bool reached;
+	double overshoot;
+	uint64_t last_outside_ns;
+	double t1_sum;
+	double t1_max;
+	unsigned long ticks;
+};
+
+static struct emu_state state;
+static struct emu_stats stats;
+static struct faults faults = {
+	.stall_secs = 5,
+};
+static bool tagged;
+static bool verbose;
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t stall_requested;
+
+static struct pending_reply pending[MAX_PENDING];
+static unsigned int pending_head;
+static unsigned int pending_count;
+
+static struct script_line script[MAX_SCRIPT_LINES];
+static unsigned int script_len;
+static unsigned int script_pos;
+
+static uint64_t start_ns;
+static uint64_t stall_until_ns;
+static uint64_t next_foreign_ns;
+
+static bool plant_mode;
+static struct plant_params plant_params;
+static struct plant plant;
+static struct plant_metrics metrics = {
+	.setpoint = NAN,
+	.band = 0.5,
+};
+static struct ekloco_capture_record *replay;
+static size_t replay_len;
+static size_t replay_pos;
+
+static uint64_t plant_time_ns;
+static uint64_t next_tick_ns;
+static FILE *plant_log;
+
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1) {
+		stall_requested = 1;
+		return;
+	}
+	stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Uniform in (0, 1), never exactly 0 so it is safe to take the logarithm.
+static double uniform(void)
+{
+	return (random() + 1.0) / (RAND_MAX + 2.0);
+}
+
+static bool chance(double probability)
+{
+	return probability > 0 && uniform() < probability;
+}
+
+static double sample_delay_us(const struct delay_dist *dist)
+{
+	double val;
+
+	switch (dist->type) {
+	case DELAY_UNIFORM:
+		val = dist->a + (dist->b - dist->a) * uniform();
+		break;
+	case DELAY_NORMAL:
+		// Box-Muller
+		val = dist->a + dist->b * sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+		break;
+	case DELAY_EXP:
+		val = -dist->a * log(uniform());
+		break;
+	case DELAY_FIXED:
+	default:
+		val = dist->a;
+		break;
+	}
+
+	return val < 0 ? 0 : val;
+}
+
+/*
+ * Parses "US", "uniform:MIN,MAX", "normal:MEAN,STDDEV" or "exp:MEAN", all in microseconds.
+ */
+static int parse_delay(const char *arg, struct delay_dist *dist)
+{
+	char name[16];
+	double a, b;
+
+	if (sscanf(arg, "%15[a-z]:%lf,%lf", name, &a, &b) == 3) {
+		if (!strcmp(name, "uniform") && a <= b)
+			dist->type = DELAY_UNIFORM;
+		else if (!strcmp(name, "normal"))
+			dist->type = DELAY_NORMAL;
+		else
+			return -1;
+	} else if (sscanf(arg, "%15[a-z]:%lf", name, &a) == 2 && !strcmp(name, "exp")) {
+		dist->type = DELAY_EXP;
+		b = 0;
+	} else if (sscanf(arg, "%lf", &a) == 1) {
+		dist->type = DELAY_FIXED;
+		b = 0;
+	} else {
+		return -1;
+	}
+
+	if (a < 0 || b < 0)
+		return -1;
+
+	dist->a = a;
+	dist->b = b;
+	return 0;
+}
+
+static int parse_percent(const char *arg, double *probability)
+{
+	char *end;
+	double val;
+
+	val = strtod(arg, &end);
+	if (end == arg || *end || val < 0 || val > 100)
+		return -1;
+
+	*probability = val / 100;
+	return 0;
+}
+
+static uint64_t foreign_interval_ns(void)
+{
+	return -log(uniform()) / faults.foreign_rate * 1e9;
+}
+
+static void start_stall(double secs)
+{
+	stall_until_ns = now_ns() + secs * 1e9;
+	if (verbose)
+		fprintf(stderr, "not answering for %.1f s\n", secs);
+}
+
+/*
+ * Applies a single fault setting, shared by the command line and scripts. Returns -1 for
+ * unknown keys or invalid values.
+ */
+static int apply_fault(const char *key, const char *value)
+{
+	char *end;
+	double val;
+
+	if (!strcmp(key, "drop"))
+		return parse_percent(value, &faults.drop);
+	if (!strcmp(key, "duplicate"))
+		return parse_percent(value, &faults.duplicate);
+	if (!strcmp(key, "delay"))
+		return parse_delay(value, &faults.delay);
+
+	val = strtod(value, &end);
+	if (end == value || *end || val < 0)
+		return -1;
+
+	if (!strcmp(key, "foreign")) {
+		faults.foreign_rate = val;
+		next_foreign_ns = val ? now_ns() + foreign_interval_ns() : 0;
+		return 0;
+	}
+	if (!strcmp(key, "stall")) {
+		start_stall(val);
+		return 0;
+	}
+	if (!strcmp(key, "load")) {
+		plant_params.load_w = val;
+		plant.p.load_w = val;
+		metrics.since_ns = now_ns();
+		metrics.reached = false;
+		metrics.overshoot = 0;
+		metrics.last_outside_ns = metrics.since_ns;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Script lines look like "SECONDS KEY=VALUE", applied at the given time after start. Lines have
+ * to be in chronological order, empty lines and lines starting with # are ignored.
+ */
+static bool valid_script_key(const char *key)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(script_keys) / sizeof(script_keys[0]); i++)
+		if (!strcmp(key, script_keys[i]))
+			return true;
+
+	return false;
+}
+
+static int load_script(const char *path)
+{
+	char line[128];
+	double at, prev = 0;
+	FILE *f;
+	int n = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct script_line *sl = &script[script_len];
+
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (script_len == MAX_SCRIPT_LINES ||
+		    sscanf(line, "%lf %15[a-z]=%63s", &at, sl->key, sl->value) != 3 || at < prev ||
+		    !valid_script_key(sl->key)) {
+			fprintf(stderr, "%s:%d: invalid script line\n", path, n);
+			fclose(f);
+			return -1;
+		}
+
+		sl->at_ns = at * 1e9;
+		prev = at;
+		script_len++;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void run_script(uint64_t now)
+{
+	while (script_pos < script_len && start_ns + script[script_pos].at_ns <= now) {
+		struct script_line *sl = &script[script_pos++];
+
+		if (verbose)
+			fprintf(stderr, "script: %s=%s\n", sl->key, sl->value);
+		if (apply_fault(sl->key, sl->value))
+			fprintf(stderr, "script: invalid setting %s=%s\n", sl->key, sl->value);
+	}
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret;
+
+	ret = write(fd, ev, sizeof(*ev));
+	if (ret < 0) {
+		perror("uhid write");
+		return -errno;
+	}
+	if (ret != sizeof(*ev)) {
+		fprintf(stderr, "uhid write: short write (%zd of %zu)\n", ret, sizeof(*ev));
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int uhid_create(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "EK Loop Connect (emulated)");
+	memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+	ev.u.create2.rd_size = sizeof(report_descriptor);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = USB_VENDOR_ID_EK;
+	ev.u.create2.product = USB_PRODUCT_ID_EK_LOOP_CONNECT;
+
+	return uhid_write(fd, &ev);
+}
+
+static void uhid_destroy(int fd)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(fd, &ev);
+}
+
+static int uhid_send_input(int fd, const uint8_t *data, size_t size)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = size;
+	memcpy(ev.u.input2.data, data, size);
+
+	return uhid_write(fd, &ev);
+}
+
+static void put_be16(uint8_t *buf, unsigned int val)
+{
+	buf[0] = (val >> 8) & 0xff;
+	buf[1] = val & 0xff;
+}
+
+static int fan_channel(const uint8_t *req)
+{
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++)
+		if (!memcmp(req + CHANNEL_OFFSET, fan_channels[i], CHANNEL_SIZE))
+			return i;
+
+	return -1;
+}
+
+/*
+ * In tagged mode the speed encodes the channel and duty, so a reply delivered to the wrong request
+ * is easy to spot on the host side.
+ */
+static unsigned int fan_rpm(int channel)
+{
+	if (tagged)
+		return (channel + 1) * 1000 + state.pwm[channel];
+
+	if (plant_mode)
+		return lround(plant.rpm[channel]);
+
+	return state.rpm_max[channel] * state.pwm[channel] / 100;
+}
+
+static void build_fan_read(int channel, uint8_t *resp)
+{
+	memcpy(resp, read_response_header, sizeof(read_response_header));
+	put_be16(resp + FAN_READ_RPM_OFFSET, fan_rpm(channel));
+	resp[FAN_READ_PWM_OFFSET] = state.pwm[channel];
+	memcpy(resp + READ_RESPONSE_TRAILER_OFFSET, read_response_trailer, sizeof(read_response_trailer));
+}
+
+static void build_fan_set(uint8_t *resp)
+{
+	memcpy(resp, set_response_header, sizeof(set_response_header));
+	memcpy(resp + SET_RESPONSE_TRAILER_OFFSET, set_response_trailer, sizeof(set_response_trailer));
+}
+
+static void build_sensor_read(uint8_t *resp)
+{
+	static const int temp_offsets[NUM_TEMP_SENSORS] = {
+		SENSOR_T1_OFFSET, SENSOR_T2_OFFSET, SENSOR_T3_OFFSET
+	};
+	double temp[NUM_TEMP_SENSORS];
+	double flow;
+	int i;
+
+	if (plant_mode) {
+		plant_temps(&plant, state.pwm, temp);
+		for (i = 0; i < NUM_TEMP_SENSORS; i++)
+			state.temp[i] = temp[i] > 254 ? 254 : lround(temp[i]);
+		flow = plant_flow(&plant, state.pwm);
+		state.flow_raw = lround(flow / 0.8);
+	}
+
+	memcpy(resp, read_response_header, sizeof(read_response_header));
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		memcpy(resp + temp_offsets[i] - 3, sensor_port_prefix, sizeof(sensor_port_prefix));
+		resp[temp_offsets[i]] = state.temp[i];
+	}
+	put_be16(resp + SENSOR_FLOW_OFFSET, state.flow_raw);
+	memcpy(resp + SENSOR_LEVEL_OFFSET - 3, sensor_port_prefix, sizeof(sensor_port_prefix));
+	resp[SENSOR_LEVEL_OFFSET] = state.level;
+	memcpy(resp + READ_RESPONSE_TRAILER_OFFSET, read_response_trailer, sizeof(read_response_trailer));
+}
+
+/*
+ * Builds the response to a request. Returns false for requests the controller doesn't answer,
+ * like unknown channels or the RGB requests only OpenRGB knows about.
+ */
+static bool handle_request(const uint8_t *req, size_t size, uint8_t *resp)
+{
+	int channel;
+
+	memset(resp, 0, BUFFER_SIZE);
+	if (size < BUFFER_SIZE)
+		return false;
+
+	switch (req[REQ_KIND_OFFSET]) {
+	case REQ_KIND_READ:
+		if (!memcmp(req + CHANNEL_OFFSET, sensor_channel, sizeof(sensor_channel))) {
+			stats.sensor_reads++;
+			build_sensor_read(resp);
+			return true;
+		}
+		channel = fan_channel(req);
+		if (channel < 0)
+			break;
+		stats.fan_reads++;
+		build_fan_read(channel, resp);
+		return true;
+	case REQ_KIND_SET:
+		channel = fan_channel(req);
+		if (channel < 0)
+			break;
+		stats.fan_sets++;
+		state.pwm[channel] = req[FAN_SET_PWM_OFFSET] > 100 ? 100 : req[FAN_SET_PWM_OFFSET];
+		if (verbose)
+			fprintf(stderr, "F%d set to %u%%\n", channel + 1, state.pwm[channel]);
+		build_fan_set(resp);
+		return true;
+	default:
+		break;
+	}
+
+	stats.unknown++;
+	return false;
+}
+
+static void plant_advance(uint64_t now)
+{
+	plant_step(&plant, (now - plant_time_ns) / 1e9, state.pwm, state.rpm_max);
+	plant_time_ns = now;
+}
+
+static void plant_tick(uint64_t now)
+{
+	double temp[NUM_TEMP_SENSORS];
+	unsigned long requests;
+	int i;
+
+	plant_advance(now);
+	plant_temps(&plant, state.pwm, temp);
+
+	metrics.ticks++;
+	metrics.t1_sum += temp[0];
+	if (metrics.ticks == 1 || temp[0] > metrics.t1_max)
+		metrics.t1_max = temp[0];
+
+	if (!isnan(metrics.setpoint)) {
+		// The loop starts cold, overshoot counts once T1 got to the setpoint.
+		if (temp[0] >= metrics.setpoint)
+			metrics.reached = true;
+		if (metrics.reached && temp[0] - metrics.setpoint > metrics.overshoot)
+			metrics.overshoot = temp[0] - metrics.setpoint;
+		if (fabs(temp[0] - metrics.setpoint) > metrics.band)
+			metrics.last_outside_ns = now;
+	}
+
+	if (!plant_log)
+		return;
+
+	requests = stats.fan_reads + stats.fan_sets + stats.sensor_reads;
+	fprintf(plant_log, "%.3f,%.1f,%.2f,%.2f,%.2f,%.1f", (now - start_ns) / 1e9, plant.p.load_w,
+		temp[0], temp[1], temp[2], plant_flow(&plant, state.pwm));
+	for (i = 0; i < NUM_FANS; i++)
+		fprintf(plant_log, ",%u", state.pwm[i]);
+	for (i = 0; i < NUM_FANS; i++)
+		fprintf(plant_log, ",%.0f", plant.rpm[i]);
+	fprintf(plant_log, ",%lu,%.3f\n", requests, plant.fan_energy_j);
+}
+
+static void plant_log_header(void)
+{
+	int i;
+
+	fprintf(plant_log, "time,load,t1,t2,t3,flow");
+	for (i = 0; i < NUM_FANS; i++)
+		fprintf(plant_log, ",duty%d", i + 1);
+	for (i = 0; i < NUM_FANS; i++)
+		fprintf(plant_log, ",rpm%d", i + 1);
+	fprintf(plant_log, ",requests,fan_energy\n");
+}
+
+static void plant_summary(uint64_t now)
+{
+	double secs = (now - start_ns) / 1e9;
+	unsigned long requests = stats.fan_reads + stats.fan_sets + stats.sensor_reads;
+
+	if (secs <= 0 || !metrics.ticks)
+		return;
+
+	fprintf(stderr, "run time: %.1f s, transactions per minute: %.1f\n",
+		secs, requests * 60 / secs);
+	fprintf(stderr, "fan energy: %.1f J, average fan power: %.2f W\n",
+		plant.fan_energy_j, plant.fan_energy_j / secs);
+	fprintf(stderr, "T1 mean: %.2f C, max: %.2f C\n",
+		metrics.t1_sum / metrics.ticks, metrics.t1_max);
+
+	if (isnan(metrics.setpoint))
+		return;
+
+	fprintf(stderr, "setpoint %.1f C: overshoot %.2f C, ", metrics.setpoint, metrics.overshoot);
+	if (metrics.last_outside_ns + PLANT_TICK_NS >= now)
+		fprintf(stderr, "not settled within %.1f C\n", metrics.band);
+	else
+		fprintf(stderr, "settled within %.1f C after %.1f s\n", metrics.band,
+			(metrics.last_outside_ns - metrics.since_ns) / 1e9);
+}
+
+static void queue_reply(const uint8_t *data, uint64_t due_ns)
+{
+	struct pending_reply *reply;
+	unsigned int last;
+
+	if (pending_count == MAX_PENDING) {
+		stats.overflow++;
+		return;
+	}
+
+	// Replies leave in order, a short delay can't overtake a long one.
+	if (pending_count) {
+		last = (pending_head + pending_count - 1) % MAX_PENDING;
+		if (due_ns < pending[last].due_ns)
+			due_ns = pending[last].due_ns;
+	}
+
+	reply = &pending[(pending_head + pending_count) % MAX_PENDING];
+	reply->due_ns = due_ns;
+	memcpy(reply->data, data, BUFFER_SIZE);
+	pending_count++;
+}
+
+static int send_due_replies(int fd, uint64_t now)
+{
+	int ret;
+
+	while (pending_count && pending[pending_head].due_ns <= now) {
+		ret = uhid_send_input(fd, pending[pending_head].data, BUFFER_SIZE);
+		if (ret)
+			return ret;
+		pending_head = (pending_head + 1) % MAX_PENDING;
+		pending_count--;
+	}
+
+	return 0;
+}
+
+/*
+ * The RGB protocol isn't described, but OpenRGB's requests get acknowledged the same way fan set
+ * requests are. Vary the checksum byte so not every foreign report looks identical.
+ */
+static int send_foreign(int fd)
+{
+	uint8_t report[BUFFER_SIZE];
+
+	build_fan_set(report);
+	report[9] = random() & 0xff;
+	stats.foreign++;
+
+	return uhid_send_input(fd, report, sizeof(report));
+}
+
+static int load_capture(const char *path, struct ekloco_capture_record **records, size_t *len)
+{
+	struct ekloco_capture_record record;
+	struct ekloco_capture_record *tmp;
+	size_t size = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	*records = NULL;
+	*len = 0;
+	while (fread(&record, sizeof(record), 1, f) == 1) {
+		if (record.len > sizeof(record.data)) {
+			fprintf(stderr, "%s: invalid record %zu\n", path, *len);
+			goto err;
+		}
+
+		if (*len == size) {
+			size = size ? size * 2 : 1024;
+			tmp = realloc(*records, size * sizeof(**records));
+			if (!tmp) {
+				perror("realloc");
+				goto err;
+			}
+			*records = tmp;
+		}
+		(*records)[(*len)++] = record;
+	}
+
+	if (ferror(f)) {
+		perror(path);
+		goto err;
+	}
+
+	fclose(f);
+	return 0;
+
+err:
+	free(*records);
+	fclose(f);
+	return -1;
+}
+
+static int dump_capture(const char *path)
+{
+	static const char * const types[] = {
+		[EKLOCO_CAPTURE_OUT] = "out",
+		[EKLOCO_CAPTURE_IN] = "in",
+		[EKLOCO_CAPTURE_TIMEOUT] = "timeout",
+	};
+	struct ekloco_capture_record *records;
+	const char *type;
+	size_t len, i;
+	int j;
+
+	if (load_capture(path, &records, &len))
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		const struct ekloco_capture_record *r = &records[i];
+
+		type = r->type < sizeof(types) / sizeof(types[0]) && types[r->type] ?
+		       types[r->type] : "?";
+		printf("%12.6f %-7s %c", (r->timestamp_ns - records[0].timestamp_ns) / 1e9, type,
+		       r->flags & EKLOCO_CAPTURE_F_CONSUMED ? '*' : ' ');
+		for (j = 0; j < r->len; j++)
+			printf(" %02x", r->data[j]);
+		printf("\n");
+	}
+
+	free(records);
+	return 0;
+}
+
+/*
+ * Answers a request with the input reports recorded between the next captured request and the
+ * one after it, at the same offsets. The driver is expected to repeat its captured requests, a
+ * different one is counted but answered anyway, so the replay stays in step.
+ */
+static void replay_output(const uint8_t *data, size_t size, uint64_t now)
+{
+	uint8_t resp[BUFFER_SIZE];
+	const struct ekloco_capture_record *out;
+	const struct ekloco_capture_record *r;
+
+	while (replay_pos < replay_len && replay[replay_pos].type != EKLOCO_CAPTURE_OUT)
+		replay_pos++;
+	if (replay_pos == replay_len) {
+		if (verbose)
+			fprintf(stderr, "replay: end of capture\n");
+		stats.unknown++;
+		return;
+	}
+
+	out = &replay[replay_pos++];
+	if (size < out->len || memcmp(data, out->data, out->len)) {
+		stats.mismatched++;
+		if (verbose)
+			fprintf(stderr, "replay: request differs from record %zu\n",
+				(size_t)(out - replay));
+	}
+
+	for (; replay_pos < replay_len; replay_pos++) {
+		r = &replay[replay_pos];
+		if (r->type == EKLOCO_CAPTURE_OUT)
+			break;
+		if (r->type != EKLOCO_CAPTURE_IN)
+			continue;
+
+		memset(resp, 0, sizeof(resp));
+		memcpy(resp, r->data, r->len < BUFFER_SIZE ? r->len : BUFFER_SIZE);
+		queue_reply(resp, now + (r->timestamp_ns - out->timestamp_ns));
+		stats.replayed++;
+	}
+}
+
+static void handle_output(const uint8_t *data, size_t size, uint64_t now)
+{
+	uint8_t resp[BUFFER_SIZE];
+	uint64_t due;
+
+	if (replay) {
+		replay_output(data, size, now);
+		return;
+	}
+
+	if (plant_mode)
+		plant_advance(now);
+
+	if (!handle_request(data, size, resp))
+		return;
+
+	if (now < stall_until_ns) {
+		stats.stalled++;
+		return;
+	}
+
+	if (chance(faults.drop)) {
+		stats.dropped++;
+		return;
+	}
+
+	due = now + sample_delay_us(&faults.delay) * 1000;
+	queue_reply(resp, due);
+
+	if (chance(faults.duplicate)) {
+		stats.duplicated++;
+		queue_reply(resp, due);
+	}
+}
+
+static int handle_event(int fd)
+{
+	struct uhid_event ev;
+	ssize_t ret;
+
+	ret = read(fd, &ev, sizeof(ev));
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		perror("uhid read");
+		return -errno;
+	}
+
+	switch (ev.type) {
+	case UHID_START:
+		if (verbose)
+			fprintf(stderr, "device started\n");
+		break;
+	case UHID_STOP:
+		if (verbose)
+			fprintf(stderr, "device stopped\n");
+		break;
+	case UHID_OPEN:
+		if (verbose)
+			fprintf(stderr, "device opened\n");
+		break;
+	case UHID_CLOSE:
+		if (verbose)
+			fprintf(stderr, "device closed\n");
+		break;
+	case UHID_OUTPUT:
+		handle_output(ev.u.output.data, ev.u.output.size, now_ns());
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+// Time until the next timed event in ms, -1 if there is none.
+static int next_timeout(uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+
+	if (pending_count)
+		next = pending[pending_head].due_ns;
+	if (next_foreign_ns && next_foreign_ns < next)
+		next = next_foreign_ns;
+	if (script_pos < script_len && start_ns + script[script_pos].at_ns < next)
+		next = start_ns + script[script_pos].at_ns;
+	if (plant_mode && next_tick_ns < next)
+		next = next_tick_ns;
+
+	if (next == UINT64_MAX)
+		return -1;
+	if (next <= now)
+		return 0;
+
+	return (next - now + 999999) / 1000000;
+}
+
+static int run_timers(int fd)
+{
+	uint64_t now = now_ns();
+	int ret;
+
+	if (stall_requested) {
+		stall_requested = 0;
+		start_stall(faults.stall_secs);
+	}
+
+	run_script(now);
+
+	if (plant_mode && next_tick_ns <= now) {
+		plant_tick(now);
+		next_tick_ns += PLANT_TICK_NS;
+	}
+
+	if (next_foreign_ns && next_foreign_ns <= now) {
+		ret = send_foreign(fd);
+		if (ret)
+			return ret;
+		next_foreign_ns = now + foreign_interval_ns();
+	}
+
+	return send_due_replies(fd, now);
+}
+
+static int parse_list(const char *arg, unsigned int *vals, int count, unsigned int max)
+{
+	char *end;
+	int n = 0;
+	int i;
+
+	for (;;) {
+		if (n == count)
+			return -1;
+		vals[n++] = strtoul(arg, &end, 0);
+		if (end == arg || vals[n - 1] > max)
+			return -1;
+		if (*end != ',')
+			break;
+		arg = end + 1;
+	}
+
+	if (*end)
+		return -1;
+
+	// A single value applies to all channels, otherwise every channel needs one.
+	if (n == 1)
+		for (i = 1; i < count; i++)
+			vals[i] = vals[0];
+	else if (n != count)
+		return -1;
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -d, --delay=SPEC      response latency in microseconds, either a fixed value or\n"
+		"                        uniform:MIN,MAX, normal:MEAN,STDDEV or exp:MEAN (default 0)\n"
+		"  -t, --temp=T1,T2,T3   temperatures in degC, 231 (0xe7) for unused ports\n"
+		"                        (default 30,32,231)\n"
+		"  -f, --flow=LPH        coolant flow in l/h (default 200)\n"
+		"  -l, --level=N         level sensor byte, 100 optimal, 0 warning (default 100)\n"
+		"  -r, --rpm-max=R[,..]  fan speed at 100%% duty, one value or one per fan\n"
+		"                        (default 2000)\n"
+		"  -p, --pwm=P[,..]      initial duty in percent (default 50)\n"
+		"      --tagged          encode channel and duty in fan speeds to detect replies\n"
+		"                        delivered to the wrong request\n"
+		"\n"
+		"Faults:\n"
+		"      --drop=PCT        don't answer PCT percent of requests\n"
+		"      --duplicate=PCT   send PCT percent of replies twice\n"
+		"      --foreign=RATE    send RATE unsolicited OpenRGB-like reports per second\n"
+		"      --stall=SECS      stop answering for SECS after SIGUSR1 (default 5)\n"
+		"      --script=FILE     change faults over time, lines of \"SECONDS KEY=VALUE\"\n"
+		"                        with keys drop, duplicate, delay, foreign, stall and load\n"
+		"      --seed=N          seed for random faults\n"
+		"\n"
+		"Plant model:\n"
+		"      --plant           derive readings from a thermal model of the loop\n"
+		"      --load=W          heat load (default 200), also a script key\n"
+		"      --ambient=C       ambient temperature (default 25)\n"
+		"      --pump=N          fan channel driving the pump, flow is fixed otherwise\n"
+		"      --flow-max=LPH    pump flow at full duty (default 300)\n"
+		"      --setpoint=C      report overshoot and settling of T1 against C\n"
+		"      --band=C          settling band around the setpoint (default 0.5)\n"
+		"      --log=FILE        write the model state as CSV every 100 ms\n"
+		"\n"
+		"Replay:\n"
+		"      --replay=FILE     answer with the reports of a driver capture\n"
+		"      --dump=FILE       print a driver capture and exit\n"
+		"  -v, --verbose         log device events\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "delay", required_argument, NULL, 'd' },
+		{ "temp", required_argument, NULL, 't' },
+		{ "flow", required_argument, NULL, 'f' },
+		{ "level", required_argument, NULL, 'l' },
+		{ "rpm-max", required_argument, NULL, 'r' },
+		{ "pwm", required_argument, NULL, 'p' },
+		{ "tagged", no_argument, NULL, 'T' },
+		{ "drop", required_argument, NULL, 'D' },
+		{ "duplicate", required_argument, NULL, 'U' },
+		{ "foreign", required_argument, NULL, 'F' },
+		{ "stall", required_argument, NULL, 'S' },
+		{ "script", required_argument, NULL, 'X' },
+		{ "seed", required_argument, NULL, 'R' },
+		{ "plant", no_argument, NULL, 'P' },
+		{ "load", required_argument, NULL, 'W' },
+		{ "ambient", required_argument, NULL, 'A' },
+		{ "pump", required_argument, NULL, 'M' },
+		{ "flow-max", required_argument, NULL, 'O' },
+		{ "setpoint", required_argument, NULL, 'E' },
+		{ "band", required_argument, NULL, 'B' },
+		{ "log", required_argument, NULL, 'G' },
+		{ "replay", required_argument, NULL, 'Y' },
+		{ "dump", required_argument, NULL, 'Z' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	const char *script_path = NULL;
+	const char *log_path = NULL;
+	const char *replay_path = NULL;
+	char *end;
+	unsigned int vals[NUM_FANS];
+	struct pollfd pfd;
+	int timeout;
+	int opt;
+	int ret;
+	int fd;
+	int i;
+
+	state.temp[0] = 30;
+	state.temp[1] = 32;
+	state.temp[2] = SENSOR_TEMP_UNUSED;
+	state.flow_raw = 200 * 10 / 8;
+	state.level = SENSOR_LEVEL_OPTIMAL;
+	plant_defaults(&plant_params);
+	for (i = 0; i < NUM_FANS; i++) {
+		state.rpm_max[i] = 2000;
+		state.pwm[i] = 50;
+	}
+
+	while ((opt = getopt_long(argc, argv, "d:t:f:l:r:p:vh", options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (parse_delay(optarg, &faults.delay))
+				goto bad_arg;
+			break;
+		case 't':
+			if (parse_list(optarg, vals, NUM_TEMP_SENSORS, 255))
+				goto bad_arg;
+			for (i = 0; i < NUM_TEMP_SENSORS; i++)
+				state.temp[i] = vals[i];
+			break;
+		case 'f':
+			if (parse_list(optarg, vals, 1, 52428))
+				goto bad_arg;
+			state.flow_raw = vals[0] * 10 / 8;
+			plant_params.flow_fixed = vals[0];
+			break;
+		case 'l':
+			if (parse_list(optarg, vals, 1, 255))
+				goto bad_arg;
+			state.level = vals[0];
+			break;
+		case 'r':
+			if (parse_list(optarg, vals, NUM_FANS, 65535))
+				goto bad_arg;
+			for (i = 0; i < NUM_FANS; i++)
+				state.rpm_max[i] = vals[i];
+			break;
+		case 'p':
+			if (parse_list(optarg, vals, NUM_FANS, 100))
+				goto bad_arg;
+			for (i = 0; i < NUM_FANS; i++)
+				state.pwm[i] = vals[i];
+			break;
+		case 'T':
+			tagged = true;
+			break;
+		case 'D':
+			if (parse_percent(optarg, &faults.drop))
+				goto bad_arg;
+			break;
+		case 'U':
+			if (parse_percent(optarg, &faults.duplicate))
+				goto bad_arg;
+			break;
+		case 'F':
+			faults.foreign_rate = strtod(optarg, &end);
+			if (end == optarg || *end || faults.foreign_rate < 0)
+				goto bad_arg;
+			break;
+		case 'S':
+			faults.stall_secs = strtod(optarg, &end);
+			if (end == optarg || *end || faults.stall_secs < 0)
+				goto bad_arg;
+			break;
+		case 'X':
+			script_path = optarg;
+			break;
+		case 'R':
+			srandom(strtoul(optarg, NULL, 0));
+			break;
+		case 'P':
+			plant_mode = true;
+			break;
+		case 'W':
+			plant_params.load_w = strtod(optarg, &end);
+			if (end == optarg || *end || plant_params.load_w < 0)
+				goto bad_arg;
+			break;
+		case 'A':
+			plant_params.ambient_c = strtod(optarg, &end);
+			if (end == optarg || *end)
+				goto bad_arg;
+			break;
+		case 'M':
+			if (parse_list(optarg, vals, 1, NUM_FANS) || vals[0] < 1)
+				goto bad_arg;
+			plant_params.pump = vals[0] - 1;
+			break;
+		case 'O':
+			plant_params.flow_max = strtod(optarg, &end);
+			if (end == optarg || *end || plant_params.flow_max < 0)
+				goto bad_arg;
+			break;
+		case 'E':
+			metrics.setpoint = strtod(optarg, &end);
+			if (end == optarg || *end)
+				goto bad_arg;
+			break;
+		case 'B':
+			metrics.band = strtod(optarg, &end);
+			if (end == optarg || *end || metrics.band <= 0)
+				goto bad_arg;
+			break;
+		case 'G':
+			log_path = optarg;
+			break;
+		case 'Y':
+			replay_path = optarg;
+			break;
+		case 'Z':
+			return dump_capture(optarg) ? 1 : 0;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (script_path && load_script(script_path))
+		return 1;
+
+	if (replay_path) {
+		if (load_capture(replay_path, &replay, &replay_len))
+			return 1;
+		if (!replay_len) {
+			fprintf(stderr, "%s: empty capture\n", replay_path);
+			return 1;
+		}
+	}
+
+	if (log_path) {
+		plant_log = fopen(log_path, "w");
+		if (!plant_log) {
+			perror(log_path);
+			return 1;
+		}
+		plant_log_header();
+	}
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("open /dev/uhid");
+		return 1;
+	}
+
+	ret = uhid_create(fd);
+	if (ret) {
+		close(fd);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGUSR1, on_signal);
+
+	start_ns = now_ns();
+	if (plant_mode) {
+		plant_init(&plant, &plant_params);
+		plant_time_ns = start_ns;
+		next_tick_ns = start_ns;
+		metrics.since_ns = start_ns;
+		metrics.last_outside_ns = start_ns;
+	}
+	if (faults.foreign_rate)
+		next_foreign_ns = start_ns + foreign_interval_ns();
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		ret = run_timers(fd);
+		if (ret)
+			break;
+
+		timeout = next_timeout(now_ns());
+		ret = poll(&pfd, 1, stall_requested ? 0 : timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (pfd.revents & POLLIN) {
+			ret = handle_event(fd);
+			if (ret)
+				break;
+		}
+	}
+
+	uhid_destroy(fd);
+	close(fd);
+
+	fprintf(stderr, "fan reads: %lu, fan sets: %lu, sensor reads: %lu, unanswered: %lu\n",
+		stats.fan_reads, stats.fan_sets, stats.sensor_reads, stats.unknown);
+	fprintf(stderr, "dropped: %lu, stalled: %lu, duplicated: %lu, foreign: %lu, overflow: %lu\n",
+		stats.dropped, stats.stalled, stats.duplicated, stats.foreign, stats.overflow);
+	if (replay)
+		fprintf(stderr, "replayed: %lu, mismatched requests: %lu, records left: %zu\n",
+			stats.replayed, stats.mismatched, replay_len - replay_pos);
+	if (plant_mode)
+		plant_summary(now_ns());
+	if (plant_log)
+		fclose(plant_log);
+	free(replay);
+
+	return 0;
+
+bad_arg:
+	fprintf(stderr, "invalid argument: %s\n", optarg);
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * plant.c - thermal model of a water cooling loop for the EK Loop Connect emulator
+ *
+ * The loop is a single thermal mass heated by a constant load and cooled by a radiator. The
+ * radiator conductance grows with the speed of every fan not driving the pump and drops when
+ * the flow gets low. Fans follow their duty with a first order lag and stall below a minimum
+ * duty, with the usual hysteresis between starting and stopping.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "plant.h"
+
+#define WATER_CP		4186	// J/(kg K)
+#define FLOW_REF		60	// l/h, flow at which the radiator reaches ~63% of its capacity
+#define MIN_FLOW		1	// l/h
+#define MAX_STEP		0.01	// s
+
+void plant_defaults(struct plant_params *params)
+{
+	params->load_w = 200;
+	params->ambient_c = 25;
+	params->heat_capacity = 2500;
+	params->ua_idle = 2;
+	params->ua_fan = 6;
+	params->fan_tau = 2;
+	params->fan_power_w = 2;
+	params->start_duty = 30;
+	params->stop_duty = 20;
+	params->pump = -1;
+	params->flow_max = 300;
+	params->flow_fixed = 200;
+}
+
+void plant_init(struct plant *plant, const struct plant_params *params)
+{
+	memset(plant, 0, sizeof(*plant));
+	plant->p = *params;
+	plant->coolant_c = params->ambient_c;
+}
+
+double plant_flow(const struct plant *plant, const unsigned char *duty)
+{
+	if (plant->p.pump < 0)
+		return plant->p.flow_fixed;
+
+	return plant->p.flow_max * duty[plant->p.pump] / 100;
+}
+
+static double conductance(const struct plant *plant, const unsigned char *duty,
+			  const unsigned int *rpm_max)
+{
+	double ua = plant->p.ua_idle;
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		if (i == plant->p.pump || !rpm_max[i])
+			continue;
+		// Heat transfer grows sub-linearly with airflow.
+		ua += plant->p.ua_fan * pow(plant->rpm[i] / rpm_max[i], 0.8);
+	}
+
+	return ua * (1 - exp(-plant_flow(plant, duty) / FLOW_REF));
+}
+
+static void step_fans(struct plant *plant, double dt, const unsigned char *duty,
+		      const unsigned int *rpm_max)
+{
+	double target;
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		if (plant->running[i] && duty[i] < plant->p.stop_duty)
+			plant->running[i] = false;
+		else if (!plant->running[i] && duty[i] >= plant->p.start_duty)
+			plant->running[i] = true;
+
+		target = plant->running[i] ? rpm_max[i] * duty[i] / 100.0 : 0;
+		plant->rpm[i] += (target - plant->rpm[i]) * (1 - exp(-dt / plant->p.fan_tau));
+
+		if (rpm_max[i])
+			plant->fan_energy_j += plant->p.fan_power_w *
+					       pow(plant->rpm[i] / rpm_max[i], 3) * dt;
+	}
+}
+
+void plant_step(struct plant *plant, double dt, const unsigned char *duty,
+		const unsigned int *rpm_max)
+{
+	double step;
+	double ua;
+
+	// Small steps keep the explicit integration stable with a fast radiator.
+	while (dt > 0) {
+		step = dt < MAX_STEP ? dt : MAX_STEP;
+		step_fans(plant, step, duty, rpm_max);
+		ua = conductance(plant, duty, rpm_max);
+		plant->coolant_c += (plant->p.load_w - ua * (plant->coolant_c - plant->p.ambient_c)) *
+				    step / plant->p.heat_capacity;
+		dt -= step;
+	}
+}
+
+void plant_temps(const struct plant *plant, const unsigned char *duty,
+		 double temp[NUM_TEMP_SENSORS])
+{
+	double flow = plant_flow(plant, duty);
+	double mass_flow;
+
+	if (flow < MIN_FLOW)
+		flow = MIN_FLOW;
+	mass_flow = flow / 3600;	// kg/s
+
+	temp[0] = plant->coolant_c;
+	temp[1] = plant->coolant_c + plant->p.load_w / (mass_flow * WATER_CP);
+	temp[2] = plant->p.ambient_c;
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * plant.h - thermal model of a water cooling loop for the EK Loop Connect emulator
+ */
+
+#ifndef PLANT_H
+#define PLANT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "ekloco-protocol.h"
+
+struct plant_params {
+	double load_w;		// heat put into the coolant
+	double ambient_c;
+	double heat_capacity;	// coolant and metal, J/K
+	double ua_idle;		// radiator conductance without airflow, W/K
+	double ua_fan;		// conductance added by one fan at full speed, W/K
+	double fan_tau;		// time constant of fan speed changes, s
+	double fan_power_w;	// power of one fan at full speed
+	double start_duty;	// a stopped fan needs this much duty to start, percent
+	double stop_duty;	// a running fan stops below this duty, percent
+	int pump;		// channel driving the pump, -1 for a fixed flow
+	double flow_max;	// pump flow at full duty, l/h
+	double flow_fixed;	// flow without a pump channel, l/h
+};
+
+struct plant {
+	struct plant_params p;
+	double coolant_c;
+	double rpm[NUM_FANS];
+	double fan_energy_j;
+	bool running[NUM_FANS];
+};
+
+void plant_init(struct plant *plant, const struct plant_params *params);
+void plant_defaults(struct plant_params *params);
+
+/*
+ * Advances the model by dt seconds, with duty in percent and rpm_max the speed of every channel
+ * at full duty.
+ */
+void plant_step(struct plant *plant, double dt, const unsigned char *duty,
+		const unsigned int *rpm_max);
+
+double plant_flow(const struct plant *plant, const unsigned char *duty);
+
+/*
+ * Sensor readings: T1 is the coolant, T2 the coolant leaving the heat source and T3 the ambient
+ * air.
+ */
+void plant_temps(const struct plant *plant, const unsigned char *duty,
+		 double temp[NUM_TEMP_SENSORS]);
+
+#endif
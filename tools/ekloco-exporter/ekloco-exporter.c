@@ -0,0 +1,574 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ekloco-exporter.c - Prometheus exporter for the EK Loop Connect
+ *
+ * Takes one snapshot of the controller per refresh interval, either from the driver's hwmon
+ * attributes or directly over hidraw through libekloco, and renders it to the text exposition
+ * format right away. Scrapes over localhost TCP or a Unix socket are answered from that buffer,
+ * so they never cause USB traffic and their cost doesn't depend on how often they come.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libekloco.h"
+
+#define HWMON_NAME		"ekloopconnect"
+#define HWMON_CLASS		"/sys/class/hwmon"
+
+#define DIR_LEN			256
+#define MAX_CLIENTS		16
+#define REQUEST_SIZE		2048
+#define BODY_SIZE		8192
+#define LABEL_SIZE		32
+
+struct client {
+	int fd;
+	size_t len;
+	char request[REQUEST_SIZE];
+};
+
+struct exporter_stats {
+	unsigned long refreshes;
+	unsigned long refresh_errors;
+	unsigned long scrapes;
+	double last_refresh_secs;
+	double last_refresh_time;
+};
+
+static char hwmon_dir[DIR_LEN];
+static struct ekloco *dev;
+static char temp_labels[NUM_TEMP_SENSORS][LABEL_SIZE];
+static char fan_labels[NUM_FANS][LABEL_SIZE];
+
+static struct client clients[MAX_CLIENTS];
+static struct exporter_stats stats;
+static char body[BODY_SIZE];
+static size_t body_len;
+static bool have_snapshot;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int read_attr(const char *name, long *val)
+{
+	char path[PATH_MAX];
+	char buf[32];
+	char *end;
+
+	snprintf(path, sizeof(path), "%s/%s", hwmon_dir, name);
+	if (read_file(path, buf, sizeof(buf)))
+		return -1;
+
+	*val = strtol(buf, &end, 10);
+	return end == buf ? -1 : 0;
+}
+
+static int find_hwmon(void)
+{
+	char path[PATH_MAX];
+	char name[64];
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(HWMON_CLASS);
+	if (!dir) {
+		perror(HWMON_CLASS);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/name", HWMON_CLASS, de->d_name);
+		if (read_file(path, name, sizeof(name)) || strcmp(name, HWMON_NAME))
+			continue;
+
+		snprintf(hwmon_dir, sizeof(hwmon_dir), "%s/%.64s", HWMON_CLASS, de->d_name);
+		closedir(dir);
+		return 0;
+	}
+
+	closedir(dir);
+	fprintf(stderr, "no %s hwmon device found\n", HWMON_NAME);
+	return -1;
+}
+
+// Channel labels are static, the driver's tempN_label and fanN_label are read once.
+static void load_labels(void)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		snprintf(temp_labels[i], LABEL_SIZE, "T%d", i + 1);
+		snprintf(path, sizeof(path), "%s/temp%d_label", hwmon_dir, i + 1);
+		if (hwmon_dir[0])
+			read_file(path, temp_labels[i], LABEL_SIZE);
+	}
+
+	for (i = 0; i < NUM_FANS; i++) {
+		snprintf(fan_labels[i], LABEL_SIZE, "F%d", i + 1);
+		snprintf(path, sizeof(path), "%s/fan%d_label", hwmon_dir, i + 1);
+		if (hwmon_dir[0])
+			read_file(path, fan_labels[i], LABEL_SIZE);
+	}
+}
+
+static int snapshot_hwmon(struct ekloco_snapshot *snap)
+{
+	char name[32];
+	long val;
+	int i;
+
+	memset(snap, 0, sizeof(*snap));
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		snprintf(name, sizeof(name), "temp%d_input", i + 1);
+		if (read_attr(name, &val))
+			return -1;
+		snap->temp[i] = val / 1000;
+	}
+
+	for (i = 0; i < NUM_FANS; i++) {
+		snprintf(name, sizeof(name), "fan%d_input", i + 1);
+		if (read_attr(name, &val))
+			return -1;
+		snap->rpm[i] = val;
+
+		snprintf(name, sizeof(name), "pwm%d", i + 1);
+		if (read_attr(name, &val))
+			return -1;
+		snap->pwm[i] = val;
+	}
+
+	// The driver exports flow as an extra fan and the level as a humidity alarm.
+	if (read_attr("fan7_input", &val))
+		return -1;
+	snap->flow_lph = val;
+
+	if (read_attr("humidity1_alarm", &val))
+		return -1;
+	snap->level_ok = !val;
+
+	return 0;
+}
+
+static size_t append(size_t len, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (len >= BODY_SIZE)
+		return len;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(body + len, BODY_SIZE - len, fmt, ap);
+	va_end(ap);
+
+	return ret < 0 ? len : len + ret;
+}
+
+static void render(const struct ekloco_snapshot *snap)
+{
+	size_t len = 0;
+	int i;
+
+	len = append(len, "# HELP ekloco_temperature_celsius Temperature sensor reading.\n"
+		     "# TYPE ekloco_temperature_celsius gauge\n");
+	for (i = 0; i < NUM_TEMP_SENSORS; i++)
+		if (snap->temp[i] != SENSOR_TEMP_UNUSED)
+			len = append(len, "ekloco_temperature_celsius{sensor=\"%s\"} %d\n",
+				     temp_labels[i], snap->temp[i]);
+
+	len = append(len, "# HELP ekloco_fan_rpm Fan speed.\n# TYPE ekloco_fan_rpm gauge\n");
+	for (i = 0; i < NUM_FANS; i++)
+		len = append(len, "ekloco_fan_rpm{fan=\"%s\"} %u\n", fan_labels[i], snap->rpm[i]);
+
+	len = append(len, "# HELP ekloco_fan_duty_ratio Fan duty, 0 to 1.\n"
+		     "# TYPE ekloco_fan_duty_ratio gauge\n");
+	for (i = 0; i < NUM_FANS; i++)
+		len = append(len, "ekloco_fan_duty_ratio{fan=\"%s\"} %.3f\n", fan_labels[i],
+			     snap->pwm[i] / 255.0);
+
+	len = append(len, "# HELP ekloco_coolant_flow_lph Coolant flow in l/h.\n"
+		     "# TYPE ekloco_coolant_flow_lph gauge\n"
+		     "ekloco_coolant_flow_lph %u\n"
+		     "# HELP ekloco_coolant_level_ok Whether the coolant level sensor reads optimal.\n"
+		     "# TYPE ekloco_coolant_level_ok gauge\n"
+		     "ekloco_coolant_level_ok %d\n", snap->flow_lph, snap->level_ok);
+
+	body_len = len < BODY_SIZE ? len : BODY_SIZE - 1;
+}
+
+static void refresh(void)
+{
+	struct ekloco_snapshot snap;
+	struct timespec ts;
+	uint64_t start = now_ns();
+	int ret;
+
+	ret = dev ? ekloco_read_snapshot(dev, &snap) : snapshot_hwmon(&snap);
+
+	stats.refreshes++;
+	stats.last_refresh_secs = (now_ns() - start) / 1e9;
+	if (ret) {
+		// Keep serving the last good snapshot, its timestamp shows its age.
+		stats.refresh_errors++;
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	stats.last_refresh_time = ts.tv_sec + ts.tv_nsec / 1e9;
+	render(&snap);
+	have_snapshot = true;
+}
+
+static void respond(struct client *c)
+{
+	char header[256];
+	char meta[1024];
+	const char *status = "200 OK";
+	int header_len, meta_len = 0;
+	bool metrics;
+
+	metrics = !strncmp(c->request, "GET /metrics ", 13) || !strncmp(c->request, "GET / ", 6);
+	if (!metrics)
+		status = "404 Not Found";
+	else
+		stats.scrapes++;
+
+	if (metrics)
+		meta_len = snprintf(meta, sizeof(meta),
+			"# HELP ekloco_exporter_last_refresh_timestamp_seconds Time of the last good snapshot.\n"
+			"# TYPE ekloco_exporter_last_refresh_timestamp_seconds gauge\n"
+			"ekloco_exporter_last_refresh_timestamp_seconds %.3f\n"
+			"# HELP ekloco_exporter_refresh_duration_seconds Time the last refresh took.\n"
+			"# TYPE ekloco_exporter_refresh_duration_seconds gauge\n"
+			"ekloco_exporter_refresh_duration_seconds %.6f\n"
+			"# HELP ekloco_exporter_refresh_errors_total Refreshes that failed.\n"
+			"# TYPE ekloco_exporter_refresh_errors_total counter\n"
+			"ekloco_exporter_refresh_errors_total %lu\n"
+			"# HELP ekloco_exporter_scrapes_total Scrapes served.\n"
+			"# TYPE ekloco_exporter_scrapes_total counter\n"
+			"ekloco_exporter_scrapes_total %lu\n",
+			stats.last_refresh_time, stats.last_refresh_secs, stats.refresh_errors,
+			stats.scrapes);
+
+	header_len = snprintf(header, sizeof(header),
+			      "HTTP/1.0 %s\r\n"
+			      "Content-Type: text/plain; version=0.0.4\r\n"
+			      "Content-Length: %zu\r\n"
+			      "Connection: close\r\n\r\n",
+			      status, metrics ? (have_snapshot ? body_len : 0) + meta_len : 0);
+
+	// Small enough for the socket buffer, a client that doesn't read just loses its answer.
+	send(c->fd, header, header_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (metrics && have_snapshot)
+		send(c->fd, body, body_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (metrics)
+		send(c->fd, meta, meta_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void client_close(int efd, struct client *c)
+{
+	epoll_ctl(efd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void client_accept(int efd, int lfd)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct client *c = NULL;
+	int fd;
+	int i;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			c = &clients[i];
+			break;
+		}
+	}
+	if (!c) {
+		close(fd);
+		return;
+	}
+
+	c->fd = fd;
+	c->len = 0;
+	ev.data.ptr = c;
+	epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void client_read(int efd, struct client *c)
+{
+	ssize_t len;
+
+	len = recv(c->fd, c->request + c->len, sizeof(c->request) - 1 - c->len, 0);
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len <= 0) {
+		client_close(efd, c);
+		return;
+	}
+
+	c->len += len;
+	c->request[c->len] = '\0';
+
+	// Only the request line matters, answer once the headers are complete.
+	if (strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n") ||
+	    c->len == sizeof(c->request) - 1) {
+		respond(c);
+		client_close(efd, c);
+	}
+}
+
+static int listen_tcp(const char *addr)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	char host[64];
+	unsigned int port;
+	int one = 1;
+	int fd;
+
+	if (sscanf(addr, "%63[^:]:%u", host, &port) != 2 || port > 65535 ||
+	    inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+		fprintf(stderr, "invalid address: %s\n", addr);
+		return -1;
+	}
+	sin.sin_port = htons(port);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(fd, MAX_CLIENTS)) {
+		perror(addr);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, MAX_CLIENTS)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -l, --listen=ADDR:PORT  serve on TCP (default 127.0.0.1:9552)\n"
+		"  -u, --unix=PATH         serve on a Unix socket instead\n"
+		"  -i, --interval=MS       time between snapshots (default 5000)\n"
+		"  -H, --hwmon=DIR         hwmon device directory (default: the first %s)\n"
+		"  -r, --hidraw[=DEV]      read the controller over hidraw instead of hwmon\n",
+		prog, HWMON_NAME);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "listen", required_argument, NULL, 'l' },
+		{ "unix", required_argument, NULL, 'u' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "hwmon", required_argument, NULL, 'H' },
+		{ "hidraw", optional_argument, NULL, 'r' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	struct epoll_event ev, events[MAX_CLIENTS + 3];
+	const char *listen_addr = "127.0.0.1:9552";
+	const char *unix_path = NULL;
+	const char *hidraw = NULL;
+	bool use_hidraw = false;
+	unsigned int interval = 5000;
+	struct itimerspec its = { 0 };
+	uint64_t expirations;
+	sigset_t mask;
+	bool running = true;
+	int efd, tfd, lfd, sfd;
+	char *end;
+	int i, n;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "l:u:i:H:r::h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'l':
+			listen_addr = optarg;
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 'i':
+			interval = strtoul(optarg, &end, 0);
+			if (end == optarg || *end || !interval)
+				goto bad_arg;
+			break;
+		case 'H':
+			snprintf(hwmon_dir, sizeof(hwmon_dir), "%s", optarg);
+			break;
+		case 'r':
+			use_hidraw = true;
+			hidraw = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (use_hidraw) {
+		dev = ekloco_open(hidraw);
+		if (!dev) {
+			perror(hidraw ? hidraw : "ekloco_open");
+			return 1;
+		}
+	} else if (!hwmon_dir[0] && find_hwmon()) {
+		return 1;
+	}
+	load_labels();
+
+	lfd = unix_path ? listen_unix(unix_path) : listen_tcp(listen_addr);
+	if (lfd < 0)
+		return 1;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	// Terminating signals just end the loop, so the socket file gets removed.
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || tfd < 0 || efd < 0) {
+		perror("setup");
+		return 1;
+	}
+
+	its.it_value.tv_sec = its.it_interval.tv_sec = interval / 1000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &tfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+	ev.data.ptr = &lfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.ptr = &sfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+
+	refresh();
+
+	while (running) {
+		n = epoll_wait(efd, events, MAX_CLIENTS + 3, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &sfd) {
+				running = false;
+			} else if (events[i].data.ptr == &tfd) {
+				if (read(tfd, &expirations, sizeof(expirations)) > 0)
+					refresh();
+			} else if (events[i].data.ptr == &lfd) {
+				client_accept(efd, lfd);
+			} else {
+				client_read(efd, events[i].data.ptr);
+			}
+		}
+	}
+
+	if (unix_path)
+		unlink(unix_path);
+	ekloco_close(dev);
+	return 0;
+
+bad_arg:
+	fprintf(stderr, "invalid argument: %s\n", optarg);
+	usage(argv[0]);
+	return 1;
+}
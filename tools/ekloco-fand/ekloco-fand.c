@@ -0,0 +1,550 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ekloco-fand.c - fan control daemon for the EK Loop Connect
+ *
+ * Reads the temperatures its curves depend on from the driver's hwmon attributes, maps them to
+ * duties through piecewise linear curves with hysteresis and writes a pwm attribute only when its
+ * duty changes. A single epoll loop waits on a timerfd for the control tick and a signalfd, so
+ * the daemon wakes up exactly once per tick. While every temperature stays within the steady
+ * band, the tick doubles up to a maximum, and drops back to the base interval on any change.
+ *
+ * Every temperature read is a USB transaction in the driver, so each source is read once per
+ * tick no matter how many curves use it.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HWMON_NAME		"ekloopconnect"
+#define HWMON_CLASS		"/sys/class/hwmon"
+
+#define NUM_FANS		6
+#define NUM_TEMP_SENSORS	3
+#define MAX_POINTS		8
+#define DIR_LEN			256
+
+// Duty written on exit and when a curve's source can't be read.
+#define FAILSAFE_PWM		255
+
+struct point {
+	long temp;		// millidegrees, like hwmon
+	unsigned int pwm;
+};
+
+struct curve {
+	bool used;
+	unsigned int source;	// temperature sensor index
+	long hysteresis;	// millidegrees
+	struct point points[MAX_POINTS];
+	unsigned int num_points;
+	int pwm_fd;
+	int current;		// last written duty, -1 before the first write
+};
+
+struct source {
+	bool used;
+	int fd;
+	long temp;
+	long last_temp;
+	bool valid;
+};
+
+struct stats {
+	unsigned long wakeups;
+	unsigned long ticks;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long errors;
+	uint64_t start_ns;
+};
+
+static char hwmon_dir[DIR_LEN];
+static struct curve curves[NUM_FANS];
+static struct source sources[NUM_TEMP_SENSORS];
+static struct stats stats;
+static bool verbose;
+
+static unsigned int base_interval = 1000;	// ms
+static unsigned int max_interval = 8000;	// ms
+static long steady_band = 500;			// millidegrees
+static unsigned int interval;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int find_hwmon(void)
+{
+	char path[PATH_MAX];
+	char name[64];
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(HWMON_CLASS);
+	if (!dir) {
+		perror(HWMON_CLASS);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/name", HWMON_CLASS, de->d_name);
+		if (read_file(path, name, sizeof(name)) || strcmp(name, HWMON_NAME))
+			continue;
+
+		snprintf(hwmon_dir, sizeof(hwmon_dir), "%s/%.64s", HWMON_CLASS, de->d_name);
+		closedir(dir);
+		return 0;
+	}
+
+	closedir(dir);
+	fprintf(stderr, "no %s hwmon device found\n", HWMON_NAME);
+	return -1;
+}
+
+static int open_attr(const char *name, int flags)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", hwmon_dir, name);
+	fd = open(path, flags | O_CLOEXEC);
+	if (fd < 0)
+		perror(path);
+
+	return fd;
+}
+
+// Reads an already open attribute from the start, sysfs regenerates the value every time.
+static int read_attr(int fd, long *val)
+{
+	char buf[32];
+	ssize_t len;
+	char *end;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+
+	buf[len] = '\0';
+	*val = strtol(buf, &end, 10);
+	return end == buf ? -1 : 0;
+}
+
+static int write_attr(int fd, long val)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%ld", val);
+	return pwrite(fd, buf, len, 0) == len ? 0 : -1;
+}
+
+/*
+ * Config lines are "pwmN tempM HYST T:PWM...", with hysteresis and curve temperatures in degC
+ * and duties in 0-255. The curve is linear between points and flat outside of them.
+ */
+static int load_config(const char *path)
+{
+	char line[256];
+	char *tok, *save;
+	unsigned int channel, source, n = 0;
+	struct curve *c;
+	double temp, hyst;
+	unsigned int pwm;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "pwm%u temp%u %lf", &channel, &source, &hyst) != 3 ||
+		    channel < 1 || channel > NUM_FANS || source < 1 ||
+		    source > NUM_TEMP_SENSORS || hyst < 0 || curves[channel - 1].used)
+			goto bad_line;
+
+		c = &curves[channel - 1];
+		c->used = true;
+		c->source = source - 1;
+		c->hysteresis = hyst * 1000;
+
+		// Skip the three leading fields, the rest are points.
+		strtok_r(line, " \t\n", &save);
+		strtok_r(NULL, " \t\n", &save);
+		strtok_r(NULL, " \t\n", &save);
+		while ((tok = strtok_r(NULL, " \t\n", &save))) {
+			if (c->num_points == MAX_POINTS ||
+			    sscanf(tok, "%lf:%u", &temp, &pwm) != 2 || pwm > 255)
+				goto bad_line;
+			if (c->num_points && temp * 1000 <= c->points[c->num_points - 1].temp)
+				goto bad_line;
+
+			c->points[c->num_points].temp = temp * 1000;
+			c->points[c->num_points].pwm = pwm;
+			c->num_points++;
+		}
+		if (!c->num_points)
+			goto bad_line;
+
+		sources[c->source].used = true;
+	}
+
+	fclose(f);
+	return 0;
+
+bad_line:
+	fprintf(stderr, "%s:%u: invalid line\n", path, n);
+	fclose(f);
+	return -1;
+}
+
+static unsigned int curve_eval(const struct curve *c, long temp)
+{
+	const struct point *lo, *hi;
+	unsigned int i;
+
+	if (temp <= c->points[0].temp)
+		return c->points[0].pwm;
+
+	for (i = 1; i < c->num_points; i++) {
+		if (temp > c->points[i].temp)
+			continue;
+
+		lo = &c->points[i - 1];
+		hi = &c->points[i];
+		return lo->pwm + ((long)hi->pwm - (long)lo->pwm) * (temp - lo->temp) /
+		       (hi->temp - lo->temp);
+	}
+
+	return c->points[c->num_points - 1].pwm;
+}
+
+/*
+ * Raises the duty as soon as the curve asks for it, but only lowers it once the temperature
+ * dropped the hysteresis below the point that asked for the current duty.
+ */
+static unsigned int curve_target(const struct curve *c, long temp)
+{
+	unsigned int up = curve_eval(c, temp);
+	unsigned int down;
+
+	if (c->current < 0 || (int)up >= c->current)
+		return up;
+
+	down = curve_eval(c, temp + c->hysteresis);
+	return (int)down < c->current ? down : (unsigned int)c->current;
+}
+
+static void set_pwm(struct curve *c, unsigned int channel, unsigned int pwm)
+{
+	if ((int)pwm == c->current)
+		return;
+
+	if (write_attr(c->pwm_fd, pwm)) {
+		stats.errors++;
+		return;
+	}
+
+	if (verbose)
+		fprintf(stderr, "pwm%u: %d -> %u\n", channel + 1, c->current, pwm);
+	c->current = pwm;
+	stats.writes++;
+}
+
+// Runs one control step, returns whether every source stayed within the steady band.
+static bool control_tick(void)
+{
+	struct source *s;
+	struct curve *c;
+	bool steady = true;
+	unsigned int i;
+
+	stats.ticks++;
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		s = &sources[i];
+		if (!s->used)
+			continue;
+
+		stats.reads++;
+		if (read_attr(s->fd, &s->temp)) {
+			stats.errors++;
+			s->valid = false;
+			steady = false;
+			continue;
+		}
+
+		if (!s->valid || labs(s->temp - s->last_temp) > steady_band) {
+			s->last_temp = s->temp;
+			steady = false;
+		}
+		s->valid = true;
+	}
+
+	for (i = 0; i < NUM_FANS; i++) {
+		c = &curves[i];
+		if (!c->used)
+			continue;
+
+		s = &sources[c->source];
+		set_pwm(c, i, s->valid ? curve_target(c, s->temp) : FAILSAFE_PWM);
+	}
+
+	return steady;
+}
+
+static int arm_timer(int fd, unsigned int ms)
+{
+	struct itimerspec its = {
+		.it_value = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L },
+		.it_interval = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L },
+	};
+
+	return timerfd_settime(fd, 0, &its, NULL);
+}
+
+static void print_stats(void)
+{
+	double minutes = (now_ns() - stats.start_ns) / 60e9;
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(stderr, "interval: %u ms, wakeups: %lu (%.1f/min), ticks: %lu, reads: %lu, "
+		"writes: %lu, errors: %lu, cpu: %ld.%06ld s user, %ld.%06ld s sys\n",
+		interval, stats.wakeups, minutes > 0 ? stats.wakeups / minutes : 0, stats.ticks,
+		stats.reads, stats.writes, stats.errors, (long)ru.ru_utime.tv_sec,
+		(long)ru.ru_utime.tv_usec, (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] -c FILE\n"
+		"  -c, --config=FILE     curves, lines of \"pwmN tempM HYST T:PWM...\"\n"
+		"  -H, --hwmon=DIR       hwmon device directory (default: the first %s)\n"
+		"  -i, --interval=MS     control tick (default 1000)\n"
+		"  -m, --max-interval=MS longest tick while temperatures are steady (default 8000)\n"
+		"  -s, --steady=C        change that counts as steady (default 0.5)\n"
+		"  -v, --verbose         log every pwm write\n"
+		"\n"
+		"SIGUSR1 prints wakeup and CPU statistics, they are also printed on exit.\n",
+		prog, HWMON_NAME);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "config", required_argument, NULL, 'c' },
+		{ "hwmon", required_argument, NULL, 'H' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "max-interval", required_argument, NULL, 'm' },
+		{ "steady", required_argument, NULL, 's' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	struct epoll_event ev, events[2];
+	struct signalfd_siginfo si;
+	const char *config = NULL;
+	char name[16];
+	sigset_t mask;
+	uint64_t expirations;
+	bool running = true;
+	bool steady;
+	int efd, tfd, sfd;
+	char *end;
+	int i, n;
+	int opt;
+	int ret = 1;
+
+	while ((opt = getopt_long(argc, argv, "c:H:i:m:s:vh", options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			config = optarg;
+			break;
+		case 'H':
+			snprintf(hwmon_dir, sizeof(hwmon_dir), "%s", optarg);
+			break;
+		case 'i':
+			base_interval = strtoul(optarg, &end, 0);
+			if (end == optarg || *end || !base_interval)
+				goto bad_arg;
+			break;
+		case 'm':
+			max_interval = strtoul(optarg, &end, 0);
+			if (end == optarg || *end)
+				goto bad_arg;
+			break;
+		case 's':
+			steady_band = strtod(optarg, &end) * 1000;
+			if (end == optarg || *end || steady_band < 0)
+				goto bad_arg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!config) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (max_interval < base_interval)
+		max_interval = base_interval;
+
+	if (load_config(config))
+		return 1;
+	if (!hwmon_dir[0] && find_hwmon())
+		return 1;
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++) {
+		if (!sources[i].used)
+			continue;
+		snprintf(name, sizeof(name), "temp%d_input", i + 1);
+		sources[i].fd = open_attr(name, O_RDONLY);
+		if (sources[i].fd < 0)
+			return 1;
+	}
+
+	for (i = 0; i < NUM_FANS; i++) {
+		if (!curves[i].used)
+			continue;
+		snprintf(name, sizeof(name), "pwm%d", i + 1);
+		curves[i].pwm_fd = open_attr(name, O_RDWR);
+		if (curves[i].pwm_fd < 0)
+			return 1;
+		curves[i].current = -1;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || tfd < 0 || efd < 0) {
+		perror("setup");
+		return 1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = tfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+	ev.data.fd = sfd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+
+	stats.start_ns = now_ns();
+	control_tick();
+	interval = base_interval;
+	if (arm_timer(tfd, interval)) {
+		perror("timerfd_settime");
+		return 1;
+	}
+
+	while (running) {
+		n = epoll_wait(efd, events, 2, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			goto out;
+		}
+		stats.wakeups++;
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == sfd) {
+				if (read(sfd, &si, sizeof(si)) != sizeof(si))
+					continue;
+				if (si.ssi_signo == SIGUSR1)
+					print_stats();
+				else
+					running = false;
+				continue;
+			}
+
+			if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+				continue;
+
+			steady = control_tick();
+			if (steady && interval < max_interval) {
+				interval = interval * 2 < max_interval ? interval * 2 : max_interval;
+				arm_timer(tfd, interval);
+			} else if (!steady && interval != base_interval) {
+				interval = base_interval;
+				arm_timer(tfd, interval);
+			}
+		}
+	}
+
+	ret = 0;
+out:
+	// Leave the fans at full speed, nothing is controlling them anymore.
+	for (i = 0; i < NUM_FANS; i++)
+		if (curves[i].used)
+			set_pwm(&curves[i], i, FAILSAFE_PWM);
+
+	print_stats();
+	return ret;
+
+bad_arg:
+	fprintf(stderr, "invalid argument: %s\n", optarg);
+	usage(argv[0]);
+	return 1;
+}
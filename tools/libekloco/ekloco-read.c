@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ekloco-read.c - print EK Loop Connect readings through libekloco
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libekloco.h"
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_snapshot(const struct ekloco_snapshot *snap, uint64_t latency_ns)
+{
+	int i;
+
+	printf("%.1f us:", latency_ns / 1000.0);
+	for (i = 0; i < EKLOCO_NUM_TEMP_SENSORS; i++)
+		printf(" T%d %d C", i + 1, snap->temp[i]);
+	printf(", flow %u l/h, level %s\n", snap->flow_lph, snap->level_ok ? "ok" : "low");
+	for (i = 0; i < EKLOCO_NUM_FANS; i++)
+		printf("  F%d %u rpm, pwm %u\n", i + 1, snap->rpm[i], snap->pwm[i]);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [/dev/hidrawN]\n"
+		"  -n, --count=N         snapshots to take (default 1)\n"
+		"  -i, --interval=MS     time between snapshots (default 1000)\n"
+		"  -D, --depth=N         requests in flight, 1-%d (default %d)\n"
+		"  -s, --set=CH:PWM      set fan CH (1-%d) to PWM (0-255) first\n",
+		prog, EKLOCO_SNAPSHOT_REQUESTS, EKLOCO_SNAPSHOT_REQUESTS, EKLOCO_NUM_FANS);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "count", required_argument, NULL, 'n' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "depth", required_argument, NULL, 'D' },
+		{ "set", required_argument, NULL, 's' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	struct ekloco_snapshot snap;
+	struct ekloco *dev;
+	unsigned int count = 1, interval = 1000, depth = EKLOCO_SNAPSHOT_REQUESTS;
+	unsigned int channel = 0, pwm = 0;
+	bool set = false;
+	uint64_t start;
+	unsigned int n;
+	int opt;
+	int ret;
+
+	while ((opt = getopt_long(argc, argv, "n:i:D:s:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%u:%u", &channel, &pwm) != 2 || !channel) {
+				fprintf(stderr, "invalid argument: %s\n", optarg);
+				return 1;
+			}
+			set = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	dev = ekloco_open(optind < argc ? argv[optind] : NULL);
+	if (!dev) {
+		perror("ekloco_open");
+		return 1;
+	}
+
+	if (ekloco_set_depth(dev, depth)) {
+		fprintf(stderr, "invalid depth: %u\n", depth);
+		ekloco_close(dev);
+		return 1;
+	}
+	fprintf(stderr, "using %s\n", ekloco_uses_io_uring(dev) ? "io_uring" : "read/write");
+
+	if (set) {
+		ret = ekloco_set_pwm(dev, channel - 1, pwm);
+		if (ret)
+			fprintf(stderr, "set F%u: %s\n", channel, strerror(-ret));
+	}
+
+	for (n = 0; n < count; n++) {
+		if (n)
+			usleep(interval * 1000);
+
+		start = now_ns();
+		ret = ekloco_read_snapshot(dev, &snap);
+		if (ret) {
+			fprintf(stderr, "read: %s\n", strerror(-ret));
+			continue;
+		}
+		print_snapshot(&snap, snap.timestamp_ns - start);
+	}
+
+	ekloco_close(dev);
+	return 0;
+}
@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * libekloco.c - userspace access to the EK Loop Connect over hidraw
+ *
+ * The controller answers requests in order and its responses carry no channel, so a batch of
+ * requests is written back to back and the responses are matched by position. With io_uring the
+ * writes and reads of a batch go out as two linked chains in a single system call, otherwise
+ * they are plain writes followed by polled reads. Either way a full snapshot costs about one
+ * round trip instead of seven.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ekloco-protocol.h"
+#include "libekloco.h"
+#include "uring.h"
+
+#define TIMEOUT_MS		500
+#define REPORT_SIZE		64
+#define RING_ENTRIES		32
+
+#define HIDRAW_CLASS		"/sys/class/hidraw"
+
+// Reads are told apart by the sensor port prefix.
+#define SENSOR_PORT_PREFIX_OFFSET	9
+
+enum op {
+	OP_WRITE,
+	OP_READ,
+	OP_CANCEL,
+};
+
+#define USER_DATA(op, i)	((uint64_t)(op) << 32 | (i))
+
+struct frame {
+	uint8_t data[REPORT_SIZE];
+	int len;
+};
+
+struct ekloco {
+	int fd;
+	unsigned int depth;
+	bool use_ring;
+	struct uring ring;
+	/*
+	 * Kept here rather than on the stack, a request the kernel failed to cancel may still
+	 * complete into them after a timeout.
+	 */
+	uint8_t req[EKLOCO_SNAPSHOT_REQUESTS][BUFFER_SIZE];
+	struct frame resp[EKLOCO_SNAPSHOT_REQUESTS];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int remaining_ms(uint64_t deadline)
+{
+	uint64_t now = now_ns();
+
+	return now >= deadline ? 0 : (deadline - now + 999999) / 1000000;
+}
+
+static int read_line(const char *path, const char *prefix, char *buf, size_t size)
+{
+	size_t len = strlen(prefix);
+	char line[256];
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, prefix, len))
+			continue;
+
+		snprintf(buf, size, "%s", line + len);
+		buf[strcspn(buf, "\n")] = '\0';
+		ret = 0;
+		break;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+// Finds the hidraw node of interface 0, which is the one taking requests.
+static int find_hidraw(char *path, size_t size)
+{
+	unsigned int bus, vendor, product;
+	char file[PATH_MAX];
+	char val[64];
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(HIDRAW_CLASS);
+	if (!dir)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(file, sizeof(file), "%s/%s/device/uevent", HIDRAW_CLASS, de->d_name);
+		if (read_line(file, "HID_ID=", val, sizeof(val)) ||
+		    sscanf(val, "%x:%x:%x", &bus, &vendor, &product) != 3 ||
+		    vendor != USB_VENDOR_ID_EK || product != USB_PRODUCT_ID_EK_LOOP_CONNECT)
+			continue;
+
+		// Emulated devices have no USB interface, take them as they are.
+		snprintf(file, sizeof(file), "%s/%s/device/../bInterfaceNumber", HIDRAW_CLASS,
+			 de->d_name);
+		if (!read_line(file, "", val, sizeof(val)) && strtoul(val, NULL, 16) != 0)
+			continue;
+
+		snprintf(path, size, "/dev/%s", de->d_name);
+		closedir(dir);
+		return 0;
+	}
+
+	closedir(dir);
+	errno = ENODEV;
+	return -1;
+}
+
+struct ekloco *ekloco_open(const char *path)
+{
+	char found[PATH_MAX];
+	struct ekloco *dev;
+	int err;
+
+	if (!path) {
+		if (find_hidraw(found, sizeof(found)))
+			return NULL;
+		path = found;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0) {
+		err = errno;
+		free(dev);
+		errno = err;
+		return NULL;
+	}
+
+	dev->depth = EKLOCO_SNAPSHOT_REQUESTS;
+
+	// Locked-down kernels often disable io_uring, fall back to plain I/O then.
+	dev->use_ring = !uring_init(&dev->ring, RING_ENTRIES);
+
+	return dev;
+}
+
+void ekloco_close(struct ekloco *dev)
+{
+	if (!dev)
+		return;
+
+	if (dev->use_ring)
+		uring_exit(&dev->ring);
+	close(dev->fd);
+	free(dev);
+}
+
+int ekloco_set_depth(struct ekloco *dev, unsigned int depth)
+{
+	if (!depth || depth > EKLOCO_SNAPSHOT_REQUESTS)
+		return -EINVAL;
+
+	dev->depth = depth;
+	return 0;
+}
+
+bool ekloco_uses_io_uring(const struct ekloco *dev)
+{
+	return dev->use_ring;
+}
+
+// Throws away reports left over from an earlier timeout, they would shift every response.
+static void drain(struct ekloco *dev)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	uint8_t buf[REPORT_SIZE];
+
+	while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+		if (read(dev->fd, buf, sizeof(buf)) <= 0)
+			break;
+}
+
+static int plain_batch(struct ekloco *dev, unsigned int first, unsigned int n)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	uint64_t deadline = now_ns() + TIMEOUT_MS * 1000000ULL;
+	struct frame *resp;
+	ssize_t len;
+	unsigned int i;
+	int ret;
+
+	for (i = first; i < first + n; i++) {
+		len = write(dev->fd, dev->req[i], BUFFER_SIZE);
+		if (len < 0)
+			return -errno;
+		if (len != BUFFER_SIZE)
+			return -EIO;
+	}
+
+	for (i = first; i < first + n; i++) {
+		resp = &dev->resp[i];
+
+		ret = poll(&pfd, 1, remaining_ms(deadline));
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			return -ETIMEDOUT;
+
+		len = read(dev->fd, resp->data, sizeof(resp->data));
+		if (len < 0)
+			return -errno;
+		resp->len = len;
+	}
+
+	return 0;
+}
+
+static int ring_cancel(struct ekloco *dev, unsigned int first, unsigned int n)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i, op;
+	int count = 0;
+
+	for (op = OP_WRITE; op <= OP_READ; op++) {
+		for (i = first; i < first + n; i++) {
+			sqe = uring_get_sqe(&dev->ring);
+			if (!sqe)
+				break;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = USER_DATA(op, i);
+			sqe->user_data = USER_DATA(OP_CANCEL, i);
+			count++;
+		}
+	}
+
+	return uring_submit(&dev->ring) < 0 ? 0 : count;
+}
+
+static int ring_batch(struct ekloco *dev, unsigned int first, unsigned int n)
+{
+	uint64_t deadline = now_ns() + TIMEOUT_MS * 1000000ULL;
+	struct pollfd pfd = { .fd = dev->ring.fd, .events = POLLIN };
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	unsigned int outstanding;
+	unsigned int i;
+	bool cancelled = false;
+	int err = 0;
+	int ret;
+
+	// Two chains, so every read starts as soon as the one before it completed.
+	for (i = first; i < first + n; i++) {
+		sqe = uring_get_sqe(&dev->ring);
+		if (!sqe)
+			return -EBUSY;
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = dev->fd;
+		sqe->addr = (uintptr_t)dev->req[i];
+		sqe->len = BUFFER_SIZE;
+		sqe->user_data = USER_DATA(OP_WRITE, i);
+		if (i < first + n - 1)
+			sqe->flags = IOSQE_IO_LINK;
+	}
+
+	for (i = first; i < first + n; i++) {
+		sqe = uring_get_sqe(&dev->ring);
+		if (!sqe)
+			return -EBUSY;
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = dev->fd;
+		sqe->addr = (uintptr_t)dev->resp[i].data;
+		sqe->len = REPORT_SIZE;
+		sqe->user_data = USER_DATA(OP_READ, i);
+		if (i < first + n - 1)
+			sqe->flags = IOSQE_IO_LINK;
+	}
+
+	ret = uring_submit(&dev->ring);
+	if (ret < 0)
+		return ret;
+	outstanding = ret;
+
+	while (outstanding) {
+		while (outstanding && uring_peek(&dev->ring, &cqe)) {
+			outstanding--;
+			i = cqe.user_data & 0xffffffff;
+
+			if (cqe.user_data >> 32 == OP_CANCEL)
+				continue;
+			if (cqe.res < 0 && !err)
+				err = cqe.res;
+			if (cqe.user_data >> 32 == OP_READ && cqe.res >= 0)
+				dev->resp[i].len = cqe.res;
+		}
+		if (!outstanding)
+			break;
+
+		ret = poll(&pfd, 1, remaining_ms(deadline));
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+		if (ret)
+			continue;
+
+		// Give up on the ring if even the cancellation doesn't complete.
+		if (cancelled) {
+			uring_exit(&dev->ring);
+			dev->use_ring = false;
+			return -ETIMEDOUT;
+		}
+
+		outstanding += ring_cancel(dev, first, n);
+		cancelled = true;
+		deadline = now_ns() + TIMEOUT_MS * 1000000ULL;
+		err = -ETIMEDOUT;
+	}
+
+	// Kernels before 5.6 have io_uring without plain reads and writes.
+	if (err == -EINVAL) {
+		uring_exit(&dev->ring);
+		dev->use_ring = false;
+	}
+
+	return err;
+}
+
+// Sends the first n requests in batches of the configured depth.
+static int xfer(struct ekloco *dev, unsigned int n)
+{
+	unsigned int first, count;
+	int ret;
+
+	memset(dev->resp, 0, sizeof(dev->resp));
+	drain(dev);
+
+	for (first = 0; first < n; first += count) {
+		count = n - first < dev->depth ? n - first : dev->depth;
+
+		if (dev->use_ring)
+			ret = ring_batch(dev, first, count);
+		else
+			ret = plain_batch(dev, first, count);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static bool is_read_response(const struct frame *resp, bool sensors)
+{
+	if (resp->len < BUFFER_SIZE ||
+	    memcmp(resp->data, read_response_header, sizeof(read_response_header)))
+		return false;
+
+	return !!resp->data[SENSOR_PORT_PREFIX_OFFSET] == sensors;
+}
+
+int ekloco_read_snapshot(struct ekloco *dev, struct ekloco_snapshot *snap)
+{
+	const uint8_t *buf;
+	unsigned int i;
+	int ret;
+
+	memcpy(dev->req[0], sensor_read_request, BUFFER_SIZE);
+	for (i = 0; i < NUM_FANS; i++) {
+		memcpy(dev->req[i + 1], fan_read_request, BUFFER_SIZE);
+		memcpy(dev->req[i + 1] + CHANNEL_OFFSET, fan_channels[i], CHANNEL_SIZE);
+	}
+
+	ret = xfer(dev, EKLOCO_SNAPSHOT_REQUESTS);
+	if (ret)
+		return ret;
+
+	// Anything else in the stream, like another program's responses, shifts the matching.
+	for (i = 0; i < EKLOCO_SNAPSHOT_REQUESTS; i++)
+		if (!is_read_response(&dev->resp[i], i == 0))
+			return -EPROTO;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->timestamp_ns = now_ns();
+
+	buf = dev->resp[0].data;
+	snap->temp[0] = buf[SENSOR_T1_OFFSET];
+	snap->temp[1] = buf[SENSOR_T2_OFFSET];
+	snap->temp[2] = buf[SENSOR_T3_OFFSET];
+	snap->level_ok = !!buf[SENSOR_LEVEL_OFFSET];
+	// Flow measurement has a conversion factor of 0.8 l/h
+	snap->flow_lph = ((buf[SENSOR_FLOW_OFFSET] << 8) + buf[SENSOR_FLOW_OFFSET + 1]) * 8 / 10;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		buf = dev->resp[i + 1].data;
+		snap->rpm[i] = (buf[FAN_READ_RPM_OFFSET] << 8) + buf[FAN_READ_RPM_OFFSET + 1];
+		snap->pwm[i] = buf[FAN_READ_PWM_OFFSET] * 255 / 100;
+	}
+
+	return 0;
+}
+
+int ekloco_set_pwm(struct ekloco *dev, unsigned int channel, unsigned int pwm)
+{
+	struct frame *resp = &dev->resp[0];
+	int ret;
+
+	if (channel >= NUM_FANS || pwm > 255)
+		return -EINVAL;
+
+	memcpy(dev->req[0], fan_set_request, BUFFER_SIZE);
+	memcpy(dev->req[0] + CHANNEL_OFFSET, fan_channels[channel], CHANNEL_SIZE);
+	dev->req[0][FAN_SET_PWM_OFFSET] = (pwm * 100 + 127) / 255;
+
+	ret = xfer(dev, 1);
+	if (ret)
+		return ret;
+
+	if (resp->len < (int)sizeof(set_response_header) ||
+	    memcmp(resp->data, set_response_header, sizeof(set_response_header)))
+		return -EPROTO;
+
+	return 0;
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * libekloco.h - userspace access to the EK Loop Connect over hidraw
+ *
+ * For hosts that can't load the kernel driver. Speaks the same protocol, using the frames from
+ * module/ekloco-protocol.h. Don't use it on a controller the driver is bound to, both would see
+ * each other's responses.
+ */
+
+#ifndef _LIBEKLOCO_H
+#define _LIBEKLOCO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ekloco-protocol.h"
+#include "uapi/ekloco.h"
+
+// Requests behind one snapshot: the sensors and every fan.
+#define EKLOCO_SNAPSHOT_REQUESTS	(1 + EKLOCO_NUM_FANS)
+
+struct ekloco;
+
+struct ekloco_snapshot {
+	uint64_t timestamp_ns;			// CLOCK_MONOTONIC, when the last response arrived
+	int temp[EKLOCO_NUM_TEMP_SENSORS];	// degC, SENSOR_TEMP_UNUSED when the port is not used
+	unsigned int flow_lph;
+	bool level_ok;
+	unsigned int rpm[EKLOCO_NUM_FANS];
+	unsigned int pwm[EKLOCO_NUM_FANS];	// 0-255, like hwmon
+};
+
+/*
+ * Opens the hidraw node at path, or finds the control interface of the first controller when
+ * path is NULL. Returns NULL and sets errno on failure.
+ */
+struct ekloco *ekloco_open(const char *path);
+void ekloco_close(struct ekloco *dev);
+
+/*
+ * Number of requests sent before waiting for their responses, 1 to EKLOCO_SNAPSHOT_REQUESTS
+ * (the default). 1 gives one round trip per request, like the kernel driver.
+ */
+int ekloco_set_depth(struct ekloco *dev, unsigned int depth);
+bool ekloco_uses_io_uring(const struct ekloco *dev);
+
+// All return 0 or a negative errno.
+int ekloco_read_snapshot(struct ekloco *dev, struct ekloco_snapshot *snap);
+int ekloco_set_pwm(struct ekloco *dev, unsigned int channel, unsigned int pwm);
+
+#endif /* _LIBEKLOCO_H */
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * uring.h - minimal io_uring wrapper for libekloco
+ *
+ * Just enough of the raw interface to queue reads and writes and reap their completions, so the
+ * library doesn't need liburing to be installed.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int to_submit;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+};
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring);
+int uring_peek(struct uring *ring, struct io_uring_cqe *cqe);
+
+#endif /* _URING_H */